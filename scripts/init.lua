@@ -1,8 +1,10 @@
 print("NEXTGAME INIT")
 
 local materials = require "materials"
+local terrain = require "terrain"
 
 materials.LoadAllMaterialPacks()
+terrain.LoadTerrain(global.BASE_DIR.."/terrain/default.lua")
 
 ---------------------------------------------------------------------------------
 -- TEMPORARY CODE BELOW
@@ -0,0 +1,187 @@
+local M = {}
+
+-- Terrain descriptions are Lua files evaluated with the node constructors
+-- below in scope. They return {density = node, material = node}, density
+-- is negative inside the terrain, coordinates are in chunks. Numbers are
+-- accepted wherever a node is, arithmetic operators build nodes too.
+--
+-- The node graph is flattened here into a list of ops (see
+-- source/Map/TerrainGraph.h) and handed over to the map generator.
+
+local Node = {}
+Node.__index = Node
+
+local function NewNode(op, t)
+	t.op = op
+	return setmetatable(t, Node)
+end
+
+local function IsNode(v)
+	return getmetatable(v) == Node
+end
+
+local function Value(v)
+	if type(v) == "number" then
+		return NewNode("const", {k = {v}})
+	end
+	assert(IsNode(v), "terrain node or number expected")
+	return v
+end
+
+local function Mad(a, k, c)
+	return NewNode("mad", {a = Value(a), k = {k, c}})
+end
+
+-- with a number operand affine coordinates stay affine, see "mad"
+Node.__add = function(a, b)
+	if type(b) == "number" then return Mad(a, 1, b) end
+	if type(a) == "number" then return Mad(b, 1, a) end
+	return NewNode("add", {a = a, b = b})
+end
+Node.__sub = function(a, b)
+	if type(b) == "number" then return Mad(a, 1, -b) end
+	if type(a) == "number" then return Mad(b, -1, a) end
+	return NewNode("sub", {a = a, b = b})
+end
+Node.__mul = function(a, b)
+	if type(b) == "number" then return Mad(a, b, 0) end
+	if type(a) == "number" then return Mad(b, a, 0) end
+	return NewNode("mul", {a = a, b = b})
+end
+Node.__unm = function(a)
+	return Mad(a, -1, 0)
+end
+
+local function Fbm(op, t)
+	return NewNode(op, {
+		a = Value(t.x),
+		b = Value(op == "fbm2" and t.z or t.y),
+		c = op == "fbm3" and Value(t.z) or nil,
+		n = t.octaves or 1,
+		k = {
+			t.frequency or 1,
+			t.amplitude or 1,
+			t.lacunarity or 2,
+			t.gain or 0.5,
+		},
+	})
+end
+
+local env = {
+	math = math,
+	x = NewNode("x", {}),
+	y = NewNode("y", {}),
+	z = NewNode("z", {}),
+}
+
+function env.const(v) return Value(v) end
+function env.min(a, b) return NewNode("min", {a = Value(a), b = Value(b)}) end
+function env.max(a, b) return NewNode("max", {a = Value(a), b = Value(b)}) end
+function env.mad(a, k, c) return Mad(a, k, c) end
+
+function env.clamp(a, lo, hi)
+	return NewNode("clamp", {a = Value(a), k = {lo, hi}})
+end
+
+-- lerp(a, b, clamp(t, 0, 1))
+function env.blend(a, b, t)
+	return NewNode("blend", {a = Value(a), b = Value(b), c = Value(t)})
+end
+
+-- {x = node, z = node, octaves = 1, frequency = 1, amplitude = 1,
+--  lacunarity = 2, gain = 0.5}, fbm3 takes 'y' as well
+function env.fbm2(t) return Fbm("fbm2", t) end
+function env.fbm3(t) return Fbm("fbm3", t) end
+
+-- offsets the coordinate by fbm2 noise, e.g. warp(x, {x = x, z = z, ...})
+function env.warp(coord, t)
+	return coord + Fbm("fbm2", t)
+end
+
+-- {x = node, z = node, y = nil, frequency = 1, stream = 0}, a value in
+-- [0, 1) per lattice cell, the same for the same world seed, e.g. for
+-- scattered rocks. Different streams give unrelated values.
+function env.random(t)
+	return NewNode("random", {
+		a = Value(t.x),
+		b = Value(t.z),
+		c = t.y and Value(t.y) or nil,
+		n = t.stream or 0,
+		k = {t.frequency or 1},
+	})
+end
+
+-- slope of a heightfield, which may only depend on x and z
+function env.slope(height)
+	return NewNode("slope", {a = Value(height)})
+end
+
+-- {height = node, slope = node, default = 1, rules...}, a rule is
+-- {material = n, min_height = -inf, max_height = inf, min_slope = 0,
+-- max_slope = inf}, the first matching one wins
+function env.material(t)
+	return NewNode("material", {
+		a = Value(t.height),
+		b = t.slope and Value(t.slope) or nil,
+		k = {t.default or 1},
+		rules = t,
+	})
+end
+
+local function Compile(desc)
+	local ops = {}
+	local rules = {}
+	local index = {}
+
+	local function Emit(node)
+		if index[node] then
+			return index[node]
+		end
+		local op = {
+			op = node.op,
+			a = node.a and Emit(node.a) or -1,
+			b = node.b and Emit(node.b) or -1,
+			c = node.c and Emit(node.c) or -1,
+			n = node.n or 0,
+			m = 0,
+			k = node.k or {},
+		}
+		if node.rules then
+			op.n = #rules
+			op.m = #node.rules
+			for _, r in ipairs(node.rules) do
+				rules[#rules+1] = {
+					material = r.material,
+					min_height = r.min_height or -math.huge,
+					max_height = r.max_height or math.huge,
+					min_slope = r.min_slope or 0,
+					max_slope = r.max_slope or math.huge,
+				}
+			end
+		end
+		ops[#ops+1] = op
+		index[node] = #ops - 1
+		return #ops - 1
+	end
+
+	return {
+		density = Emit(Value(desc.density)),
+		material = desc.material and Emit(Value(desc.material)) or -1,
+		ops = ops,
+		rules = rules,
+	}
+end
+
+function M.LoadTerrain(filename)
+	local code, err = loadfile(filename)
+	if code == nil then
+		print(err)
+		return
+	end
+	setfenv(code, setmetatable({}, {__index = env}))
+	local graph = Compile(code())
+	print("loading terrain: "..filename.." ("..#graph.ops.." ops)")
+	global.SetTerrainGraph(graph)
+end
+
+return M
@@ -113,20 +113,53 @@ Vector<uint8_t> ByteReader::read_compressed(Error *err)
 	if (*err)
 		return {};
 
+	ByteReader peek = *this;
+	const int decompressed_len = peek.read_int32(err);
+	if (*err)
+		return {};
+	if (decompressed_len < 0) {
+		err->set("Malformed compressed sequence (decompressed length: %d)",
+			decompressed_len);
+		return {};
+	}
+
+	Vector<uint8_t> out(decompressed_len);
+	read_compressed(out, err);
+	if (*err)
+		return {};
+	return out;
+}
+
+void ByteReader::read_compressed(Slice<uint8_t> out, Error *err)
+{
+	if (*err)
+		return;
+
 	const int decompressed_len = read_int32(err);
 	const int compressed_len = read_int32(err);
 	if (*err)
-		return {};
+		return;
 
-	if (compressed_len > data.length)
-		err->set("Malformed compressed sequence (byte stream size: %d, compressed stream size: %d",
+	if (decompressed_len != out.length) {
+		err->set("Malformed compressed sequence (expected size: %d, decompressed size: %d)",
+			out.length, decompressed_len);
+		return;
+	}
+	if (compressed_len < 0 || compressed_len > data.length) {
+		err->set("Malformed compressed sequence (byte stream size: %d, compressed stream size: %d)",
 			data.length, compressed_len);
+		return;
+	}
+	if (decompressed_len == 0)
+		return;
 
-	Vector<uint8_t> out(decompressed_len);
-	int bytes_read = LZ4_decompress_safe((const char*)data.data, (char*)out.data(),
+	const int bytes_read = LZ4_decompress_safe((const char*)data.data, (char*)out.data,
 		compressed_len, decompressed_len);
-	NG_ASSERT(bytes_read == out.length());
-	return out;
+	if (bytes_read != decompressed_len) {
+		err->set("Malformed compressed sequence (LZ4 error: %d)", bytes_read);
+		return;
+	}
+	data = data.sub(compressed_len);
 }
 
 //----------------------------------------------------------------------
@@ -1,3 +1,5 @@
+#pragma once
+
 #include "Core/Slice.h"
 #include "Core/Error.h"
 #include "Core/Vector.h"
@@ -23,6 +25,10 @@ struct ByteReader {
 	void            read(Slice<uint8_t> out, Error *err = &DefaultError);
 	Vector<uint8_t> read_compressed(Error *err = &DefaultError);
 
+	// Decompresses the block directly into 'out', its length must match the
+	// decompressed length of the block.
+	void            read_compressed(Slice<uint8_t> out, Error *err = &DefaultError);
+
 	ByteReader(Slice<const uint8_t> data): data(data) {}
 };
 
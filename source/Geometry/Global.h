@@ -14,6 +14,11 @@ static inline int offset_3d(const Vec3i &p, const Vec3i &size)
 	return (p.z * size.y + p.y) * size.x + p.x;
 }
 
+static inline Vec3i offset_to_3d(int offset, const Vec3i &size)
+{
+	return Vec3i(offset % size.x, offset / size.x % size.y, offset / (size.x * size.y));
+}
+
 static inline int offset_3d_slab(const Vec3i &p, const Vec3i &size)
 {
 	return size.x * size.y * (p.z % 2) + p.y * size.x + p.x;
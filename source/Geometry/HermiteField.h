@@ -83,5 +83,14 @@ void hermite_rle_fields_to_mesh(
 	Slice<const int> lods, int largest_lod,
 	const Vec3 &base);
 
+// Visits every voxel line and cube, none is skipped by the occupancy of its
+// voxels. Slow, makes the same mesh, only for tests of the fast paths.
+void hermite_rle_fields_to_mesh_reference(
+	Vector<V3N3M1_terrain> &vertices,
+	Vector<uint32_t> &indices,
+	Slice<const HermiteRLEField*> fields,
+	Slice<const int> lods, int largest_lod,
+	const Vec3 &base);
+
 void debug_draw_mc(const Vec3 *verts, HermiteData *hd, const Vec3 &color = Vec3_X());
 void generate_marching_cubes();
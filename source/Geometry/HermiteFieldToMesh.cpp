@@ -2,6 +2,9 @@
 #include "Geometry/DebugDraw.h"
 #include "Core/Defer.h"
 #include "OS/ThreadLocal.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // Two other axes of a given one.
 static const Vec2i OTHER_AXES_TABLE[] = {
@@ -453,10 +456,48 @@ struct TemporaryData {
 	Vector<Vec3> vertices;
 	HermiteField fs[8];
 	Vector<IndexVConfigPair> idxbufs[8];
+	Vector<uint8_t> lines[8];
+	Vector<uint64_t> planes[8];
 };
 
 static ThreadLocal<TemporaryData> temporary_data;
 
+// Materials of a voxel line along x: all air, all solid or both.
+constexpr uint8_t LINE_AIR = 1 << 0;
+constexpr uint8_t LINE_SOLID = 1 << 1;
+constexpr uint8_t LINE_MIXED = LINE_AIR | LINE_SOLID;
+
+// Fills 'out' with LINE_* bits for each line (y, z) of the field, at offset
+// y + z * size.y. Works on the runs: a compressed run marks all the lines it
+// covers at once, only uncompressed voxels are looked at one by one.
+static void line_materials(Vector<uint8_t> *out, const HermiteRLEField &f)
+{
+	out->resize(f.size.y * f.size.z);
+	Slice<uint8_t> lines = out->sub();
+	if (f.data.length() == 1) {
+		fill(lines, f.data[0].material ? LINE_SOLID : LINE_AIR);
+		return;
+	}
+	fill(lines, (uint8_t)0);
+
+	const int w = f.size.x;
+	for (int i = 0; i < f.seqs.length() - 1; i++) {
+		const RLESeq &seq = f.seqs[i];
+		const int begin = seq.offset();
+		const int end = f.seqs[i+1].offset();
+		const HermiteData *data = f.data.data() + seq.data_offset();
+		if (seq.is_compressed()) {
+			const uint8_t bit = data->material ? LINE_SOLID : LINE_AIR;
+			for (int l = begin / w, last = (end - 1) / w; l <= last; l++)
+				lines[l] |= bit;
+			continue;
+		}
+		for (int j = begin; j < end; j++)
+			lines[j / w] |= data[j - begin].material ? LINE_SOLID : LINE_AIR;
+	}
+}
+
+template <bool Reference>
 static void hermite_rle_fields_to_mesh_same_lod(Vector<V3N3M1_terrain> &vertices,
 	Vector<uint32_t> &indices, Slice<const HermiteRLEField*> fields,
 	int lod, int largest_lod, const Vec3 &base)
@@ -512,6 +553,12 @@ static void hermite_rle_fields_to_mesh_same_lod(Vector<V3N3M1_terrain> &vertices
 	const int base_vertex = vertices.length();
 	TemporaryData *tmp = temporary_data.get();
 
+	Vector<uint8_t> (&lines)[8] = tmp->lines;
+	for (int i = 0; i < 8; i++) {
+		if (fields[i] && !Reference)
+			line_materials(&lines[i], *fields[i]);
+	}
+
 	Vector<IndexVConfigPair> &idxbuf = tmp->idxbuf;
 	idxbuf.resize(dcsize.x * dcsize.y * 2);
 
@@ -770,6 +817,23 @@ static void hermite_rle_fields_to_mesh_same_lod(Vector<V3N3M1_terrain> &vertices
 			}
 		}
 
+		// The cubes of the line have their corners in these 4 voxel lines of
+		// both halves, if those are all air or all solid there is no surface
+		// and no need for the iterators
+		if (!Reference) {
+			uint8_t line_bits = 0;
+			for (int x = 0; x < 2; x++) {
+				for (int i = 0; i < 4; i++) {
+					foffsets[i].x = x;
+					const int fi = offset_3d(foffsets[i], Vec3i(2));
+					if (fields[fi])
+						line_bits |= lines[fi][voffsets[i].y + voffsets[i].z * vsize.y];
+				}
+			}
+			if (line_bits != LINE_MIXED)
+				continue;
+		}
+
 		continuation = false;
 	for (int x = 0; x < 2; x++) {
 		// actual fields where we will take the iterators from
@@ -1028,10 +1092,58 @@ static inline void collect_edges(CubeContext *ctx, const Vec3i &pos,
 	ctx->add_material(hd1.material);
 }
 
+// Fills 'out' with a bit per voxel for each row (y, z) of the field along x,
+// set for the solid ones. Rows are at offset y + z * size.y.
+static void occupancy_planes(Vector<uint64_t> *out, const HermiteField &f)
+{
+	NG_ASSERT(f.size.x <= 64);
+	const int rows = f.size.y * f.size.z;
+	out->resize(rows);
+	for (int r = 0; r < rows; r++) {
+		const HermiteData *row = f.data.data() + r * f.size.x;
+		uint64_t bits = 0;
+		int x = 0;
+#ifdef __SSE2__
+		// material is the low byte of each 32-bit voxel, 16 voxels at a time
+		const __m128i material = _mm_set1_epi32(0xFF);
+		const __m128i zero = _mm_setzero_si128();
+		for (; x + 16 <= f.size.x; x += 16) {
+			__m128i air[4];
+			for (int i = 0; i < 4; i++) {
+				const __m128i v = _mm_loadu_si128((const __m128i*)(row + x + i * 4));
+				air[i] = _mm_cmpeq_epi32(_mm_and_si128(v, material), zero);
+			}
+			const __m128i air8 = _mm_packs_epi16(
+				_mm_packs_epi32(air[0], air[1]),
+				_mm_packs_epi32(air[2], air[3]));
+			bits |= (uint64_t)(~_mm_movemask_epi8(air8) & 0xFFFF) << x;
+		}
+#endif
+		for (; x < f.size.x; x++)
+			bits |= (uint64_t)(row[x].material != 0) << x;
+		(*out)[r] = bits;
+	}
+}
+
+// bits [from; to]
+static inline uint64_t bit_range(int from, int to)
+{
+	if (from > to)
+		return 0;
+	return ((uint64_t)2 << to) - ((uint64_t)1 << from);
+}
+
+static inline int lowest_bit(uint64_t bits)
+{
+	return __builtin_ctzll(bits);
+}
+
+template <bool Reference>
 static void create_vertices(
 	Vector<V3N3M1_terrain> &vertices, Vector<Vec3> &tmp_normals,
 	Vector<Vec3> &virt_vertices,
 	Slice<Vector<IndexVConfigPair>> vindices, Slice<const HermiteField> fields,
+	Slice<const Vector<uint64_t>> planes,
 	const FieldAccessHelper &fah, const Vec3 &base)
 {
 	const int base_vertex = vertices.length();
@@ -1090,42 +1202,65 @@ static void create_vertices(
 		for (int j = 0; j < 3; j++)
 			chunk_edge_positions[j] = fah.edge_positions[i].position[j];
 
-		const uint8_t x0mask = 85;  // 0b01010101
-		const uint8_t x1mask = 170; // 0b10101010
-		uint8_t config = 0;
+		// Cubes of a row are bits, the ones with both air and solid corners
+		// are found a row at a time. Cubes next to the faces and edges taken
+		// from a lower lod are visited whatever their config is, they may
+		// collect edges of other fields. The rest have no vertex if their
+		// corners are all air or all solid.
+		auto near = [](int p, int at) { return p == at || p+1 == at; };
+		auto near_bits = [](int at) { return bit_range(max(at-1, 0), min(at, 63)); };
+		const uint64_t face_x_cubes = af_lods_less_than[0] ?
+			near_bits(chunk_face_positions.x) : 0;
+		const Slice<const uint64_t> rows = planes[i];
+		const int rows_y = field.size.y;
+		const uint64_t row_cubes = bit_range(0, dcsize.x - 1);
 		HermiteData hd[8];
 		for (int z = 0; z < dcsize.z; z++) {
 		for (int y = 0; y < dcsize.y; y++) {
-		for (int x = 0; x < dcsize.x; x++) {
-			const Vec3i pos(x, y, z);
-			if (x == 0) {
-				config &= ~x0mask;
-				hd[0] = field.get({x, y,   z});
-				hd[2] = field.get({x, y+1, z});
-				hd[4] = field.get({x, y,   z+1});
-				hd[6] = field.get({x, y+1, z+1});
-				config |=
-					((hd[0].material != 0) << 0) |
-					((hd[2].material != 0) << 2) |
-					((hd[4].material != 0) << 4) |
-					((hd[6].material != 0) << 6);
-			} else {
-				config >>= 1;
-				hd[0] = hd[1];
-				hd[2] = hd[3];
-				hd[4] = hd[5];
-				hd[6] = hd[7];
+			const uint64_t r0 = rows[y   + rows_y * z];
+			const uint64_t r1 = rows[y+1 + rows_y * z];
+			const uint64_t r2 = rows[y   + rows_y * (z+1)];
+			const uint64_t r3 = rows[y+1 + rows_y * (z+1)];
+			const uint64_t any = r0 | r1 | r2 | r3;
+			const uint64_t all = r0 & r1 & r2 & r3;
+			uint64_t active = (any | any >> 1) & ~(all & all >> 1);
+			if ((af_lods_less_than[1] && near(y, chunk_face_positions.y)) ||
+				(af_lods_less_than[2] && near(z, chunk_face_positions.z)) ||
+				(ae_lods_less_than[0] && near(y, chunk_edge_positions[0].y) &&
+					near(z, chunk_edge_positions[0].z)))
+			{
+				active = row_cubes;
 			}
-			config &= ~x1mask;
+			active |= face_x_cubes;
+			if (ae_lods_less_than[1] && near(z, chunk_edge_positions[1].z))
+				active |= near_bits(chunk_edge_positions[1].x);
+			if (ae_lods_less_than[2] && near(y, chunk_edge_positions[2].y))
+				active |= near_bits(chunk_edge_positions[2].x);
+			active &= row_cubes;
+			// the reference visits every cube, configs come from the voxels
+			if (Reference)
+				active = row_cubes;
+		for (; active != 0; active &= active - 1) {
+			const int x = lowest_bit(active);
+			const Vec3i pos(x, y, z);
+			hd[0] = field.get({x,   y,   z});
 			hd[1] = field.get({x+1, y,   z});
+			hd[2] = field.get({x,   y+1, z});
 			hd[3] = field.get({x+1, y+1, z});
+			hd[4] = field.get({x,   y,   z+1});
 			hd[5] = field.get({x+1, y,   z+1});
+			hd[6] = field.get({x,   y+1, z+1});
 			hd[7] = field.get({x+1, y+1, z+1});
-			config |=
-				((hd[1].material != 0) << 1) |
-				((hd[3].material != 0) << 3) |
-				((hd[5].material != 0) << 5) |
-				((hd[7].material != 0) << 7);
+			uint8_t config =
+				((r0 >> x) & 3) |
+				((r1 >> x) & 3) << 2 |
+				((r2 >> x) & 3) << 4 |
+				((r3 >> x) & 3) << 6;
+			if (Reference) {
+				config = 0;
+				for (int j = 0; j < 8; j++)
+					config |= (hd[j].material != 0) << j;
+			}
 
 			CubeContext cc;
 			uint32_t vconfig;
@@ -1326,7 +1461,10 @@ static bool is_empty(Slice<const HermiteRLEField*> fields)
 	return true;
 }
 
-void hermite_rle_fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
+// With Reference set every voxel line and cube is visited, none is skipped
+// by the occupancy of its voxels.
+template <bool Reference>
+static void fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
 	Vector<uint32_t> &indices, Slice<const HermiteRLEField*> fields,
 	Slice<const int> lods, int largest_lod, const Vec3 &base)
 {
@@ -1337,7 +1475,7 @@ void hermite_rle_fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
 
 	int thelod = -1;
 	if (same_lod(lods, &thelod)) {
-		hermite_rle_fields_to_mesh_same_lod(vertices, indices,
+		hermite_rle_fields_to_mesh_same_lod<Reference>(vertices, indices,
 			fields, thelod, largest_lod, base);
 		return;
 	}
@@ -1356,10 +1494,16 @@ void hermite_rle_fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
 
 	const int base_vertex = vertices.length();
 
+	Vector<uint64_t> (&planes)[8] = tmp->planes;
+
 	unpack_fields(fs, fields, fah);
 	sync_fields(fs, fah);
-	create_vertices(vertices, tmp_normals, virt_vertices,
-		idxbufs, fs, fah, base);
+	for (int i = 0; i < 8; i++) {
+		if (lods[i] != -1)
+			occupancy_planes(&planes[i], fs[i]);
+	}
+	create_vertices<Reference>(vertices, tmp_normals, virt_vertices,
+		idxbufs, fs, planes, fah, base);
 	if (vertices.length() == base_vertex)
 		return;
 
@@ -1457,21 +1601,33 @@ void hermite_rle_fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
 		Slice<const IndexVConfigPair> inds = idxbufs[i];
 		const Vec3i dcsize = field.size - Vec3i(1);
 		const Vec3i dup_faces = fah.dup_faces[i];
+		// cubes with a sign change on one of the 3 edges of their first corner
+		const Slice<const uint64_t> rows = planes[i];
+		const int rows_y = field.size.y;
+		const uint64_t row_cubes = bit_range(0, dcsize.x - 1);
 		for (int z = 0; z < dcsize.z; z++) {
 		for (int y = 0; y < dcsize.y; y++) {
-		for (int x = 0; x < dcsize.x; x++) {
-			const Vec3i pos(x, y, z);
+			const uint64_t r0 = rows[y   + rows_y * z];
+			const uint64_t r1 = rows[y+1 + rows_y * z];
+			const uint64_t r2 = rows[y   + rows_y * (z+1)];
+			const uint64_t any = r0 | r0 >> 1 | r1 | r2;
+			const uint64_t all = r0 & r0 >> 1 & r1 & r2;
+			const uint64_t found = Reference ? row_cubes : any & ~all & row_cubes;
+		for (uint64_t active = found; active != 0; active &= active - 1) {
+			const int x = lowest_bit(active);
 			const HermiteData &hd0 = field.get({x,   y,   z});
 			const HermiteData &hd1 = field.get({x+1, y,   z});
 			const HermiteData &hd2 = field.get({x,   y+1, z});
 			const HermiteData &hd4 = field.get({x,   y,   z+1});
-			const uint8_t sign =
-				((hd0.material != 0) << 0) |
-				((hd1.material != 0) << 1) |
-				((hd2.material != 0) << 2) |
-				((hd4.material != 0) << 3);
-			if (sign == 0 || sign == 15)
-				continue;
+			if (Reference) {
+				const uint8_t sign =
+					((hd0.material != 0) << 0) |
+					((hd1.material != 0) << 1) |
+					((hd2.material != 0) << 2) |
+					((hd4.material != 0) << 3);
+				if (sign == 0 || sign == 15)
+					continue;
+			}
 
 			const bool flip = hd0.material != 0;
 			if (y >= 1 && z >= 1 && edge_has_intersection(hd0, hd1)) {
@@ -1651,6 +1807,19 @@ void hermite_rle_fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
 	for (int i = base_vertex; i < vertices.length(); i++)
 		vertices[i].normal = pack_normal(normalize(tmp_normals[i-base_vertex]));
 }
+void hermite_rle_fields_to_mesh(Vector<V3N3M1_terrain> &vertices,
+	Vector<uint32_t> &indices, Slice<const HermiteRLEField*> fields,
+	Slice<const int> lods, int largest_lod, const Vec3 &base)
+{
+	fields_to_mesh<false>(vertices, indices, fields, lods, largest_lod, base);
+}
+
+void hermite_rle_fields_to_mesh_reference(Vector<V3N3M1_terrain> &vertices,
+	Vector<uint32_t> &indices, Slice<const HermiteRLEField*> fields,
+	Slice<const int> lods, int largest_lod, const Vec3 &base)
+{
+	fields_to_mesh<true>(vertices, indices, fields, lods, largest_lod, base);
+}
 
 
 //----------------------------------------------------------------------
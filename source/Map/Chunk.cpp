@@ -2,32 +2,53 @@
 
 namespace Map {
 
-void Chunk::generate_lod_fields()
+FieldRef reduce_lod_field(const HermiteRLEField &source, int from, int to)
+{
+	NG_ASSERT(from < to);
+	HermiteField tmp_fields[2];
+	tmp_fields[0] = HermiteField(lod_field_size(from));
+	source.decompress(tmp_fields[0].data);
+	for (int i = from + 1; i <= to; i++) {
+		HermiteField &dst = tmp_fields[(i - from) % 2];
+		dst = HermiteField(lod_field_size(i));
+		reduce_field(&dst, tmp_fields[(i - from - 1) % 2]);
+	}
+	return intern_field(HermiteRLEField(tmp_fields[(to - from) % 2]));
+}
+
+int Chunk::lod_source(int lod) const
+{
+	int source = lod - 1;
+	while (source > 0 && !has_lod(source))
+		source--;
+	return source;
+}
+
+void Chunk::reset_lods()
 {
-	switch (lods[0].data.length()) {
-	case 0:
+	for (int i = 1; i < LODS_N; i++)
+		lods[i].clear();
+	if (lods[0]->data.length() != 1)
 		return;
-	case 1:
-		for (int i = 1; i < LODS_N; i++) {
-			lods[i].data.append(lods[0].data[0]);
-			lods[i].seqs.pappend(0, 0, true);
-			lods[i].finalize(CHUNK_SIZE / Vec3i(lod_factor(i)) + Vec3i(1));
-		}
-		break;
-	default:
-		HermiteField tmp_fields[LODS_N];
-		for (int i = 0; i < LODS_N; i++) {
-			tmp_fields[i] = HermiteField(CHUNK_SIZE / Vec3i(lod_factor(i)) + Vec3i(1));
-		}
-		lods[0].decompress(tmp_fields[0].data);
-		for (int i = 1; i < LODS_N; i++) {
-			reduce_field(&tmp_fields[i], tmp_fields[i-1]);
-		}
-		for (int i = 1; i < LODS_N; i++) {
-			lods[i] = HermiteRLEField(tmp_fields[i]);
-		}
-		break;
+
+	// uniform fields are tiny and shared by the pool, not worth the trip to
+	// a worker
+	for (int i = 1; i < LODS_N; i++) {
+		HermiteRLEField f;
+		f.data.append(lods[0]->data[0]);
+		f.seqs.pappend(0, 0, true);
+		f.finalize(lod_field_size(i));
+		lods[i] = intern_field(std::move(f));
 	}
 }
 
+void Chunk::generate_lod_fields()
+{
+	reset_lods();
+	if (is_uniform())
+		return;
+	for (int i = 1; i < LODS_N; i++)
+		lods[i] = reduce_lod_field(*lods[i-1], i-1, i);
+}
+
 } // namespace Map
@@ -1,23 +1,65 @@
 #pragma once
 
-#include "Geometry/HermiteField.h"
+#include "Map/FieldPool.h"
 #include "OOP/RTTI.h"
 
 namespace Map {
 
 enum ChunkFlags {
 	MCF_GENERATING = 1 << 1,
+	// lods are not decoded yet, the field is in StorageChunk::packed
+	MCF_PACKED = 1 << 2,
+	MCF_UNPACKING = 1 << 3,
+	// as it was generated, no write request has touched it
+	MCF_PRISTINE = 1 << 4,
+	// a task is reducing one of the lods, see Storage::queue_build_lod
+	MCF_BUILDING_LOD = 1 << 5,
 };
 
 struct Chunk {
-	HermiteRLEField lods[LODS_N];
+	// shared and immutable, see FieldPool.h. Lod 0 is the chunk itself, the
+	// rest is reduced from it when a request needs it and dropped under
+	// memory pressure, except for uniform chunks which have them all.
+	FieldRef lods[LODS_N];
 	int readers = 0;
 	bool writer = false;
 	uint8_t flags = 0;
 
+	bool is_uniform() const { return lods[0]->data.length() <= 1; }
+	bool has_lod(int lod) const { return lod == 0 || is_uniform() || lods[lod]->data.length() != 0; }
+	// the finest lod 'lod' can be reduced from
+	int lod_source(int lod) const;
+	// lods[0] has changed, drops the rest
+	void reset_lods();
+	// builds all the lods right away
 	void generate_lod_fields();
 };
 
+// size of the field of a given lod, with the +1 border
+static inline Vec3i lod_field_size(int lod)
+{
+	return CHUNK_SIZE / Vec3i(lod_factor(lod)) + Vec3i(1);
+}
+
+// The world is that many chunks high, starting at y = 0. Nothing is loaded,
+// generated or saved outside of it.
+constexpr int WORLD_HEIGHT_CHUNKS = 16;
+
+static inline bool chunk_in_world(const Vec3i &location)
+{
+	return location.y >= 0 && location.y < WORLD_HEIGHT_CHUNKS;
+}
+
+// whether any chunk of the storage chunk at 'location' is in the world
+static inline bool storage_chunk_in_world(const Vec3i &location)
+{
+	const int min_y = location.y * STORAGE_CHUNK_SIZE.y;
+	return min_y + STORAGE_CHUNK_SIZE.y > 0 && min_y < WORLD_HEIGHT_CHUNKS;
+}
+
+// Reduces 'source' of lod 'from' to lod 'to', can be called from any thread.
+FieldRef reduce_lod_field(const HermiteRLEField &source, int from, int to);
+
 struct EGenerateMapChunkRequest : RTTIBase<EGenerateMapChunkRequest>
 {
 	Vec3i location;
@@ -26,7 +68,32 @@ struct EGenerateMapChunkRequest : RTTIBase<EGenerateMapChunkRequest>
 struct EMapChunkGenerated : RTTIBase<EMapChunkGenerated>
 {
 	Vec3i location;
-	HermiteRLEField fields[LODS_N];
+	FieldRef fields[LODS_N];
+};
+
+// Generates all chunks of a box, e.g. a whole storage chunk or a slab of it,
+// the result comes as a single EMapChunksGenerated.
+struct EGenerateMapChunksRequest : RTTIBase<EGenerateMapChunksRequest>
+{
+	Vec3i location;
+	Vec3i size;
+};
+
+// Fired when the generator is created and when its terrain changes.
+struct EMapGeneratorChanged : RTTIBase<EMapGeneratorChanged>
+{
+	// see Generator::fingerprint
+	uint64_t fingerprint;
+};
+
+struct EMapChunksGenerated : RTTIBase<EMapChunksGenerated>
+{
+	Vec3i location;
+	Vec3i size;
+	// LODS_N fields per chunk, chunks are in offset_3d order
+	Vector<FieldRef> fields;
+	// CPU tasks still working on the batch, Generator only
+	int tasks_left = 0;
 };
 
 } // namespace Map
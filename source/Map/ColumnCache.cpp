@@ -0,0 +1,81 @@
+#include "Map/ColumnCache.h"
+#include "Core/Defer.h"
+#include <cstdio>
+
+namespace Map {
+
+ColumnCache::ColumnCache(int capacity):
+	mutex(SDL_CreateMutex()), capacity(capacity)
+{
+	NG_ASSERT(mutex != nullptr);
+}
+
+ColumnCache::~ColumnCache()
+{
+	SDL_DestroyMutex(mutex);
+}
+
+bool ColumnCache::get(const Vec3i &column, TerrainColumn *out)
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	Entry *e = columns.get(column);
+	if (!e) {
+		misses++;
+		return false;
+	}
+	hits++;
+	e->last_use = clock++;
+	out->n = e->column.n;
+	out->rows_n = e->column.rows_n;
+	out->data = e->column.data.sub();
+	out->affine = e->column.affine.sub();
+	out->base = e->column.base.sub();
+	out->step = e->column.step.sub();
+	return true;
+}
+
+void ColumnCache::put(const Vec3i &column, TerrainColumn &&data)
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	if (Entry *e = columns.get(column)) {
+		// another task got there first
+		e->last_use = clock++;
+		return;
+	}
+	if (columns.length() >= capacity) {
+		// capacity is small, a scan is cheaper than keeping a list in order
+		Vec3i lru;
+		int64_t lru_use = INT64_MAX;
+		for (auto kv : columns) {
+			if (kv.value.last_use < lru_use) {
+				lru = kv.key;
+				lru_use = kv.value.last_use;
+			}
+		}
+		columns.remove(lru);
+		evictions++;
+	}
+	columns.insert(column, Entry{std::move(data), clock++});
+}
+
+void ColumnCache::clear()
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	columns.clear();
+}
+
+void ColumnCache::print_stats()
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	const int64_t lookups = hits + misses;
+	printf("Map generator column cache: %d/%d columns, %lld hits, %lld misses "
+		"(%.1f%% hit rate), %lld evictions\n",
+		columns.length(), capacity, (long long)hits, (long long)misses,
+		lookups ? hits * 100.0 / lookups : 0.0, (long long)evictions);
+}
+
+} // namespace Map
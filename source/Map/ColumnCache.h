@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Map/Config.h"
+#include "Map/TerrainGraph.h"
+#include "Core/HashMap.h"
+#include "Core/Utils.h"
+#include <SDL2/SDL_mutex.h>
+
+namespace Map {
+
+// Thread-safe LRU cache of TerrainColumn keyed by the chunk column (x and z
+// of the chunk location, y is 0). Generator tasks share it, so a heightfield
+// is computed once for all chunks stacked along y. Entries are copied in and
+// out, the cache never hands out pointers.
+struct ColumnCache {
+	struct Entry {
+		TerrainColumn column;
+		int64_t last_use;
+	};
+
+	// guards everything below
+	SDL_mutex *mutex;
+	HashMap<Vec3i, Entry> columns;
+	int capacity;
+	int64_t clock = 0;
+
+	int64_t hits = 0;
+	int64_t misses = 0;
+	int64_t evictions = 0;
+
+	NG_DELETE_COPY_AND_MOVE(ColumnCache);
+	explicit ColumnCache(int capacity);
+	~ColumnCache();
+
+	// Copies the cached column into 'out', returns false on a miss.
+	bool get(const Vec3i &column, TerrainColumn *out);
+	void put(const Vec3i &column, TerrainColumn &&data);
+	void clear();
+	void print_stats();
+};
+
+} // namespace Map
@@ -3,15 +3,56 @@
 #include "Math/Vec.h"
 #include "Core/String.h"
 
+static inline int compute_hash(const Vec3i &key)
+{
+	return ::compute_hash(Slice<const Vec3i>(&key, 1));
+}
+
 namespace Map {
 
 struct Config {
 	Vec3i visible_range;
+
+	// Storage chunks the player is expected to reach within that many
+	// seconds are loaded ahead of time, 0 disables prefetching.
+	double prefetch_horizon = 2.0;
+
+	// Meshes of terrain nobody changed are kept there between visits and
+	// runs, so that meshing them again is a file read. Empty disables it.
+	String mesh_cache_directory;
+
+	// Least recently used meshes are removed once the files take more than
+	// that, in bytes.
+	int64_t mesh_cache_budget = 256LL * 1024 * 1024;
 };
 
 struct StorageConfig {
 	const Config *map_config = nullptr;
 	String directory;
+
+	// Everything the generator makes is derived from the seed and the
+	// location, it has to stay the same for the lifetime of a world.
+	uint64_t seed = 0;
+
+	// Save lods[1..] next to lod 0 for chunks which have them all at the
+	// moment. Makes storage chunks bigger, but loading them doesn't need to
+	// reduce lods again.
+	bool store_lods = true;
+
+	// Save chunks nobody has edited. Without it storage chunks keep only
+	// the edited ones and mark the rest pristine, these are generated again
+	// when requested, which relies on the generator being deterministic
+	// (see Generator::chunk_random). Storage chunks without edits are not
+	// saved at all then.
+	bool store_pristine = true;
+
+	// Resident storage chunks are evicted in least recently requested order
+	// once their fields take more than that, in bytes.
+	int64_t memory_budget = 1024LL * 1024 * 1024;
+
+	// Dirty storage chunks are saved that often, in seconds. Edits made in
+	// between are kept in the mutator journal.
+	int64_t save_interval = 300;
 };
 
 } // namespace Map
@@ -0,0 +1,170 @@
+#include "Map/FieldPool.h"
+#include "Core/HashMap.h"
+#include "Core/Defer.h"
+#include "Math/Random.h"
+#include <SDL2/SDL_mutex.h>
+#include <cstdio>
+#include <cstring>
+
+namespace Map {
+
+struct FieldPool {
+	// guards everything below
+	SDL_mutex *mutex;
+	HashMap<ContentHash, SharedField*> fields;
+	FieldPoolStats stats;
+
+	NG_DELETE_COPY_AND_MOVE(FieldPool);
+	FieldPool(): mutex(SDL_CreateMutex()) { NG_ASSERT(mutex != nullptr); }
+	~FieldPool() { SDL_DestroyMutex(mutex); }
+};
+
+static FieldPool pool;
+
+ContentHash content_hash(Slice<const uint8_t> bytes, uint64_t seed)
+{
+	uint64_t h = seed;
+	int i = 0;
+	for (; i + 8 <= bytes.length; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes.data + i, 8);
+		h = mix64(h ^ word);
+	}
+	uint64_t tail = 0;
+	if (i < bytes.length)
+		memcpy(&tail, bytes.data + i, bytes.length - i);
+	return ContentHash{mix64(h ^ tail ^ ((uint64_t)bytes.length << 56))};
+}
+
+static uint64_t field_hash(const HermiteRLEField &f)
+{
+	uint64_t h = mix64(((uint64_t)(uint32_t)f.size.x << 32) ^ (uint32_t)f.size.z);
+	h = mix64(h ^ (uint32_t)f.size.y);
+	h = content_hash(slice_cast<const uint8_t>(f.data.sub()), h).value;
+	return content_hash(slice_cast<const uint8_t>(f.seqs.sub()), h).value;
+}
+
+static bool same_field(const HermiteRLEField &a, const HermiteRLEField &b)
+{
+	return a.size == b.size &&
+		slice_cast<const uint8_t>(a.data.sub()) == slice_cast<const uint8_t>(b.data.sub()) &&
+		slice_cast<const uint8_t>(a.seqs.sub()) == slice_cast<const uint8_t>(b.seqs.sub());
+}
+
+FieldRef intern_field(HermiteRLEField &&field)
+{
+	if (field.data.length() == 0)
+		return FieldRef();
+
+	// hashing is the expensive part, it's done outside of the lock
+	const uint64_t hash = field_hash(field);
+	SDL_LockMutex(pool.mutex);
+	DEFER { SDL_UnlockMutex(pool.mutex); };
+	pool.stats.interned++;
+	if (SharedField **existing = pool.fields.get(ContentHash{hash})) {
+		SharedField *sf = *existing;
+		// refs may be 0 here, the last handle is on its way to release()
+		// which checks refs again under the lock
+		if (same_field(sf->field, field)) {
+			SDL_AtomicIncRef(&sf->refs);
+			pool.stats.hits++;
+			return FieldRef(sf);
+		}
+	}
+
+	SharedField *sf = new (OrDie) SharedField;
+	sf->field = std::move(field);
+	sf->hash = hash;
+	SDL_AtomicSet(&sf->refs, 1);
+	if (pool.fields.get(ContentHash{hash}))
+		return FieldRef(sf);
+	sf->pooled = true;
+	pool.fields.insert(ContentHash{hash}, sf);
+	pool.stats.fields++;
+	pool.stats.bytes += sf->field.byte_length();
+	return FieldRef(sf);
+}
+
+void FieldRef::release()
+{
+	SharedField *sf = m_shared;
+	if (!sf)
+		return;
+	m_shared = nullptr;
+
+	// read before the decrement, the field may be gone after it
+	const bool pooled = sf->pooled;
+	const uint64_t hash = sf->hash;
+	if (!SDL_AtomicDecRef(&sf->refs))
+		return;
+	if (!pooled) {
+		delete sf;
+		return;
+	}
+
+	// intern_field may have handed it out again in the meantime, or another
+	// release may have deleted it already, so only the pool entry is trusted
+	SDL_LockMutex(pool.mutex);
+	DEFER { SDL_UnlockMutex(pool.mutex); };
+	SharedField **entry = pool.fields.get(ContentHash{hash});
+	if (!entry || *entry != sf || SDL_AtomicGet(&sf->refs) != 0)
+		return;
+	pool.fields.remove(ContentHash{hash});
+	pool.stats.fields--;
+	pool.stats.bytes -= sf->field.byte_length();
+	delete sf;
+}
+
+FieldRef::FieldRef(const FieldRef &r): m_shared(r.m_shared)
+{
+	if (m_shared)
+		SDL_AtomicIncRef(&m_shared->refs);
+}
+
+FieldRef &FieldRef::operator=(const FieldRef &r)
+{
+	if (r.m_shared)
+		SDL_AtomicIncRef(&r.m_shared->refs);
+	release();
+	m_shared = r.m_shared;
+	return *this;
+}
+
+FieldRef &FieldRef::operator=(FieldRef &&r)
+{
+	if (this != &r) {
+		release();
+		m_shared = r.m_shared;
+		r.m_shared = nullptr;
+	}
+	return *this;
+}
+
+const HermiteRLEField *FieldRef::get() const
+{
+	static const HermiteRLEField empty;
+	return m_shared ? &m_shared->field : &empty;
+}
+
+int FieldRef::refs() const
+{
+	return m_shared ? SDL_AtomicGet(&m_shared->refs) : 0;
+}
+
+FieldPoolStats field_pool_stats()
+{
+	SDL_LockMutex(pool.mutex);
+	DEFER { SDL_UnlockMutex(pool.mutex); };
+	return pool.stats;
+}
+
+void print_field_pool_stats()
+{
+	const FieldPoolStats s = field_pool_stats();
+	printf("Map field pool: %d distinct fields, %.1f MB, %lld interned, "
+		"%lld shared (%.1f%%)\n",
+		s.fields, s.bytes / (1024.0 * 1024.0), (long long)s.interned,
+		(long long)s.hits, s.interned ? s.hits * 100.0 / s.interned : 0.0);
+}
+
+} // namespace Map
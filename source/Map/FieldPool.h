@@ -0,0 +1,84 @@
+#pragma once
+
+#include "Geometry/HermiteField.h"
+#include <SDL2/SDL_atomic.h>
+
+namespace Map {
+
+// 64-bit hash of contents, usable as a HashMap key. Equal hashes are not a
+// proof, compare the bytes.
+struct ContentHash {
+	uint64_t value;
+
+	bool operator==(const ContentHash &r) const { return value == r.value; }
+	bool operator!=(const ContentHash &r) const { return value != r.value; }
+};
+
+static inline int compute_hash(const ContentHash &key)
+{
+	return key.value ^ (key.value >> 32);
+}
+
+ContentHash content_hash(Slice<const uint8_t> bytes, uint64_t seed = 0);
+
+// Chunk fields never change once stored, an edit produces a new field. Most of
+// them are identical too: all the air, all the solid ground. The pool keeps one
+// copy of each distinct field, chunks refer to it through FieldRef.
+struct SharedField {
+	HermiteRLEField field;
+	uint64_t hash = 0;
+	SDL_atomic_t refs;
+	// in the pool, as opposed to a hash collision kept aside
+	bool pooled = false;
+};
+
+// Refcounted handle of a pooled field, can be copied and released from any
+// thread. The null handle is an empty field.
+class FieldRef {
+	SharedField *m_shared = nullptr;
+
+	void release();
+
+public:
+	FieldRef() = default;
+	// takes over a reference
+	explicit FieldRef(SharedField *shared): m_shared(shared) {}
+	FieldRef(const FieldRef &r);
+	FieldRef(FieldRef &&r): m_shared(r.m_shared) { r.m_shared = nullptr; }
+	~FieldRef() { release(); }
+
+	FieldRef &operator=(const FieldRef &r);
+	FieldRef &operator=(FieldRef &&r);
+
+	const HermiteRLEField &operator*() const { return *get(); }
+	const HermiteRLEField *operator->() const { return get(); }
+	const HermiteRLEField *get() const;
+	explicit operator bool() const { return m_shared != nullptr; }
+
+	// the same buffers, fields with the same contents are the same buffers
+	// unless their hashes collide
+	bool operator==(const FieldRef &r) const { return m_shared == r.m_shared; }
+	bool operator!=(const FieldRef &r) const { return m_shared != r.m_shared; }
+
+	// handles of the field, 0 for the empty one
+	int refs() const;
+	// hash of the contents, 0 for the empty field
+	uint64_t hash() const { return m_shared ? m_shared->hash : 0; }
+	void clear() { release(); }
+};
+
+// Returns the pooled copy of 'field', adding it if there is none.
+FieldRef intern_field(HermiteRLEField &&field);
+
+struct FieldPoolStats {
+	int fields = 0;
+	int64_t bytes = 0;
+	// intern_field calls and the ones which found the field in the pool
+	int64_t interned = 0;
+	int64_t hits = 0;
+};
+
+FieldPoolStats field_pool_stats();
+void print_field_pool_stats();
+
+} // namespace Map
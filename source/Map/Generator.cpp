@@ -1,5 +1,8 @@
 #include "Map/Generator.h"
 #include "Core/Memory.h"
+#include "Geometry/Global.h"
+#include "OS/IO.h"
+#include "OS/Timer.h"
 
 struct EGenerateMapChunkMessage : RTTIBase<EGenerateMapChunkMessage>
 {
@@ -8,7 +11,21 @@ struct EGenerateMapChunkMessage : RTTIBase<EGenerateMapChunkMessage>
 	Vec3i location;
 
 	// out
-	HermiteRLEField fields[LODS_N];
+	Map::FieldRef fields[LODS_N];
+	double time = 0;
+};
+
+// One CPU task worth of chunks from a batch, see Generator::chunks_per_task.
+struct EGenerateMapChunksMessage : RTTIBase<EGenerateMapChunksMessage>
+{
+	// in
+	const Map::Generator *mapgen;
+	Map::EMapChunksGenerated *batch;
+	int begin;
+	int end;
+
+	// out
+	double time = 0;
 };
 
 struct PointInfo {
@@ -16,7 +33,16 @@ struct PointInfo {
 	int m;
 };
 
-// F == PointInfo (*)(const Vec3 &p)
+static void make_uniform_field(HermiteRLEField *rle_field, const HermiteData &hd,
+	const Vec3i &size)
+{
+	rle_field->data.append(hd);
+	rle_field->seqs.pappend(0, 0, true);
+	rle_field->finalize(size);
+}
+
+// F == void (*)(PointInfo *out, int n, const Vec3 &p, float step), fills 'n'
+// points starting at 'p', 'step' apart along x.
 template <typename F>
 static void generate_chunk(HermiteRLEField *rle_field, const Vec3i &pos, F f)
 {
@@ -24,15 +50,17 @@ static void generate_chunk(HermiteRLEField *rle_field, const Vec3i &pos, F f)
 	const Vec3i csize = vsize - Vec3i(1); // chunk size
 	const Vec3i ssize = vsize + Vec3i(1); // sampling size, grab -1 as well
 	Vector<float> layer(ssize.x * ssize.y * 2);
+	Vector<PointInfo> row(ssize.x);
 
 	int offset = 0;
 	for (int z = -1; z < vsize.z; z++) {
 	for (int y = -1; y < vsize.y; y++) {
+		const Vec3 unit_pos = Vec3(-1, y, z) / ToVec3(csize);
+		f(row.data(), ssize.x, ToVec3(pos) + unit_pos, 1.0f / csize.x);
 	for (int x = -1; x < vsize.x; x++) {
 		const int x1 = x+1, y1 = y+1, z1 = z+1;
-		const Vec3 unit_pos = Vec3(x, y, z) / ToVec3(csize);
 		HermiteData hd = HermiteData_Air();
-		const PointInfo pi = f(ToVec3(pos) + unit_pos);
+		const PointInfo pi = row[x1];
 		const float v = pi.v;
 		float vx = x1 ? layer[offset_3d_slab({x1-1, y1, z1}, ssize)] : v;
 		float vy = y1 ? layer[offset_3d_slab({x1, y1-1, z1}, ssize)] : v;
@@ -54,62 +82,201 @@ static void generate_chunk(HermiteRLEField *rle_field, const Vec3i &pos, F f)
 	rle_field->finalize(vsize);
 }
 
-static void generate_map_chunk(RTTIObject *data)
+// Range of the height offset of the noise terrain, octave amplitudes summed
+// up (Perlin noise stays within [-1, 1]). Positive offsets are doubled and
+// get the 3D detail on top.
+static const float NOISE_TERRAIN_AMP = (2.0f + 1.0f + 0.5f + 0.25f + 0.125f) / 2.0f;
+static const float NOISE_TERRAIN_MIN = -NOISE_TERRAIN_AMP;
+static const float NOISE_TERRAIN_MAX = NOISE_TERRAIN_AMP * 2.0f + 0.25f;
+
+static void generate_chunk_fields(HermiteRLEField *fields,
+	const Map::Generator *mapgen, const Vec3i &location)
 {
-	EGenerateMapChunkMessage *msg = EGenerateMapChunkMessage::cast(data);
-	const Noise3D *n3d = msg->mapgen->n3d;
-	const Noise2D *n2d = msg->mapgen->n2d;
+	const Noise3D *n3d = mapgen->n3d;
+	const Noise2D *n2d = mapgen->n2d;
+	Vector<float> noise_row, tmp_row;
+	Vector<int> material_row;
+	Map::TerrainRows graph_rows;
+
+	// Heightfield rows are shared by chunks stacked along y, the first row
+	// of every z row restores them from the cache or saves them.
+	const int zrows_n = CHUNK_SIZE.z / lod_factor(0) + 2;
+	const float zrow_scale = CHUNK_SIZE.z / lod_factor(0);
+	const Vec3i column_key(location.x, 0, location.z);
+	Map::TerrainColumn column;
+	bool column_cached = false;
+	int column_zrow = -1;
 
-	auto gen = [&](const Vec3 &pp)
+	auto gen_flat = [&](PointInfo *out, int n, const Vec3 &p, float)
 	{
-		/*
-		const Vec3 ff = pp / Vec3(6);
-		float noise =
-			n2d->Get(ff.x, ff.z) * 2.0f +
-			n2d->Get(ff.x*2, ff.z*2) * 1.0f +
-			n2d->Get(ff.x*4, ff.z*4) * 0.5f +
-			n2d->Get(ff.x*8, ff.z*8) * 0.25f +
-			n2d->Get(ff.x*16, ff.z*16) * 0.125f;
-		noise /= 2.0f;
-
-		int material = 1;
-		if (noise > 0.1f) {
-			material = 3;
-			noise *= 2.0f;
-			noise += n3d->Get(ff.x*32, ff.y*48, ff.z*32) * 0.25f;
-		}
-		*/
-		//return PointInfo{pp.y - 2.5f - noise, material};
-		return PointInfo{pp.y - 2.5f, 1};
+		for (int i = 0; i < n; i++)
+			out[i] = PointInfo{p.y - 2.5f, 1};
 	};
-	generate_chunk(&msg->fields[0], msg->location, gen);
-	if (msg->fields[0].data.length() == 1) {
-		for (int i = 1; i < LODS_N; i++) {
-			msg->fields[i].data.append(msg->fields[0].data[0]);
-			msg->fields[i].seqs.pappend(0, 0, true);
-			msg->fields[i].finalize(CHUNK_SIZE / Vec3i(lod_factor(i)) + Vec3i(1));
+	auto gen_noise = [&](PointInfo *out, int n, const Vec3 &pp, float step)
+	{
+		const Vec3 ff = pp / Vec3(6);
+		const float fstep = step / 6;
+		noise_row.resize(n);
+		tmp_row.resize(n);
+		float *noise = noise_row.data();
+		float *tmp = tmp_row.data();
+		n2d->get_row(noise, n, ff.x, fstep, ff.z);
+		for (int i = 0; i < n; i++)
+			noise[i] *= 2.0f;
+		float scale = 2.0f, amp = 1.0f;
+		for (int o = 0; o < 4; o++, scale *= 2.0f, amp *= 0.5f) {
+			n2d->get_row(tmp, n, ff.x*scale, fstep*scale, ff.z*scale);
+			for (int i = 0; i < n; i++)
+				noise[i] += tmp[i] * amp;
 		}
-	} else {
-		HermiteField tmp_fields[LODS_N];
-		for (int i = 0; i < LODS_N; i++) {
-			tmp_fields[i] = HermiteField(CHUNK_SIZE / Vec3i(lod_factor(i)) + Vec3i(1));
+
+		bool detail = false;
+		for (int i = 0; i < n; i++) {
+			noise[i] /= 2.0f;
+			detail |= noise[i] > 0.1f;
 		}
-		msg->fields[0].decompress(tmp_fields[0].data);
-		for (int i = 1; i < LODS_N; i++) {
-			reduce_field(&tmp_fields[i], tmp_fields[i-1]);
+		if (detail)
+			n3d->get_row(tmp, n, ff.x*32, fstep*32, ff.y*48, ff.z*32);
+		for (int i = 0; i < n; i++) {
+			int material = 1;
+			if (noise[i] > 0.1f) {
+				material = 3;
+				noise[i] *= 2.0f;
+				noise[i] += tmp[i] * 0.25f;
+			}
+			out[i] = PointInfo{pp.y - 2.5f - noise[i], material};
 		}
-		for (int i = 1; i < LODS_N; i++) {
-			msg->fields[i] = HermiteRLEField(tmp_fields[i]);
+	};
+	auto gen_graph = [&](PointInfo *out, int n, const Vec3 &p, float step)
+	{
+		const Map::TerrainGraph *graph = mapgen->graph.get();
+		const int zrow = std::lround((p.z - location.z) * zrow_scale) + 1;
+		const bool first = zrow != column_zrow;
+		column_zrow = zrow;
+		if (first && column_cached)
+			graph->load_column_row(&graph_rows, column, zrow, p, step);
+
+		noise_row.resize(n);
+		material_row.resize(n);
+		graph->eval_row(noise_row.data(), material_row.data(),
+			n, p, step, &graph_rows);
+		if (first && !column_cached)
+			graph->store_column_row(&column, zrow, zrows_n, graph_rows);
+		for (int i = 0; i < n; i++)
+			out[i] = PointInfo{noise_row[i], material_row[i]};
+	};
+	// Has to bound the terrain function over a box.
+	auto gen_bounds = [&](const Vec3 &min, const Vec3 &max)
+	{
+		if (mapgen->terrain == Map::GT_GRAPH)
+			return mapgen->graph->bounds(min, max);
+		if (mapgen->terrain == Map::GT_NOISE) {
+			return DensityBounds{
+				min.y - 2.5f - NOISE_TERRAIN_MAX,
+				max.y - 2.5f - NOISE_TERRAIN_MIN, -1};
 		}
+		return DensityBounds{min.y - 2.5f, max.y - 2.5f, 1};
+	};
+
+	// Provably uniform chunks (all air or all of the same solid) are a
+	// single run, no need to sample them. The box covers all points
+	// generate_chunk samples, including the -1 border.
+	const Vec3 csize = ToVec3(CHUNK_SIZE / Vec3i(lod_factor(0)));
+	const DensityBounds bounds = gen_bounds(
+		ToVec3(location) - Vec3(1) / csize, ToVec3(location) + Vec3(1));
+	const bool air = bounds.min >= 0.0f;
+	const bool solid = bounds.max < 0.0f && bounds.m != -1;
+	if (air || solid) {
+		HermiteData hd = HermiteData_Air();
+		if (solid)
+			hd.material = bounds.m;
+		for (int i = 0; i < LODS_N; i++)
+			make_uniform_field(&fields[i], hd, CHUNK_SIZE / Vec3i(lod_factor(i)) + Vec3i(1));
+		return;
+	}
+
+	if (mapgen->terrain == Map::GT_NOISE)
+		generate_chunk(&fields[0], location, gen_noise);
+	else if (mapgen->terrain == Map::GT_GRAPH) {
+		column_cached = mapgen->column_cache->get(column_key, &column);
+		generate_chunk(&fields[0], location, gen_graph);
+		if (!column_cached)
+			mapgen->column_cache->put(column_key, std::move(column));
+	} else
+		generate_chunk(&fields[0], location, gen_flat);
+	// the rest of the lods is reduced when some request needs it, see
+	// Storage::queue_build_lod
+	if (fields[0].data.length() == 1) {
+		for (int i = 1; i < LODS_N; i++)
+			make_uniform_field(&fields[i], fields[0].data[0],
+				CHUNK_SIZE / Vec3i(lod_factor(i)) + Vec3i(1));
 	}
 }
 
+// Fields are interned right here, on the worker, hashing them is not cheap.
+static void generate_shared_chunk_fields(Map::FieldRef *out,
+	const Map::Generator *mapgen, const Vec3i &location)
+{
+	HermiteRLEField fields[LODS_N];
+	generate_chunk_fields(fields, mapgen, location);
+	for (int i = 0; i < LODS_N; i++)
+		out[i] = Map::intern_field(std::move(fields[i]));
+}
+
+static void generate_map_chunk(RTTIObject *data)
+{
+	EGenerateMapChunkMessage *msg = EGenerateMapChunkMessage::cast(data);
+	Timer t;
+	generate_shared_chunk_fields(msg->fields, msg->mapgen, msg->location);
+	msg->time = t.elapsed();
+}
+
+static void generate_map_chunks(RTTIObject *data)
+{
+	EGenerateMapChunksMessage *msg = EGenerateMapChunksMessage::cast(data);
+	Map::EMapChunksGenerated *batch = msg->batch;
+	// Column by column, top to bottom. Chunks of a column share the
+	// heightfield (see ColumnCache) and the ones above the terrain are
+	// mostly uniform and cheap.
+	const Vec3i size = batch->size;
+	Timer t;
+	for (int j = msg->begin; j < msg->end; j++) {
+		const int column = j / size.y;
+		const Vec3i p(column % size.x, size.y - 1 - j % size.y, column / size.x);
+		const int i = offset_3d(p, size);
+		generate_shared_chunk_fields(&batch->fields[i * LODS_N], msg->mapgen,
+			batch->location + p);
+	}
+	msg->time = t.elapsed();
+}
+
 namespace Map {
 
-Generator::Generator()
+// columns, each is a few dozen KB
+static const int COLUMN_CACHE_SIZE = 256;
+
+// part of the fingerprint, bump it when the same graph starts to generate
+// different chunks
+static const uint64_t GENERATOR_VERSION = 1;
+
+static uint64_t mix_float(uint64_t h, float v)
 {
-	n2d = new (OrDie) Noise2D(0);
-	n3d = new (OrDie) Noise3D(0);
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return mix64(h ^ bits);
+}
+
+Generator::Generator(const StorageConfig *config): config(config)
+{
+	// seed 0 keeps the noise of worlds made before there were seeds
+	const int noise_seed = config->seed ^ (config->seed >> 32);
+	n2d = new (OrDie) Noise2D(noise_seed);
+	n3d = new (OrDie) Noise3D(noise_seed);
+	column_cache = new (OrDie) ColumnCache(COLUMN_CACHE_SIZE);
+	const String terrain_env = IO::get_environment("NEXTGAME_TERRAIN");
+	if (terrain_env == "noise")
+		terrain = GT_NOISE;
+	use_graph = terrain_env != "noise" && terrain_env != "flat";
 
 	NG_EventManager->register_handler(EID_GENERATE_MAP_CHUNK_REQUEST,
 		PASS_TO_METHOD(Generator, handle_generate_map_chunk_request),
@@ -117,19 +284,80 @@ Generator::Generator()
 	NG_EventManager->register_handler(EID_MAP_CHUNK_GENERATED_INTERNAL,
 		PASS_TO_METHOD(Generator, handle_map_chunk_generated_internal),
 		this, false);
+	NG_EventManager->register_handler(EID_GENERATE_MAP_CHUNKS_REQUEST,
+		PASS_TO_METHOD(Generator, handle_generate_map_chunks_request),
+		this, false);
+	NG_EventManager->register_handler(EID_MAP_CHUNKS_GENERATED_INTERNAL,
+		PASS_TO_METHOD(Generator, handle_map_chunks_generated_internal),
+		this, false);
+	fire_generator_changed();
 }
 
 Generator::~Generator()
 {
 	delete n2d;
 	delete n3d;
+	delete column_cache;
 
 	NG_EventManager->unregister_handlers(this);
 }
 
+bool Generator::set_graph(UniquePtr<TerrainGraph> g, Error *err)
+{
+	if (generating) {
+		err->set("Terrain graph can't change once chunks are generated");
+		return false;
+	}
+	g->n2d = n2d;
+	g->n3d = n3d;
+	g->seed = config->seed;
+	if (!g->compile(err))
+		return false;
+	graph = std::move(g);
+	column_cache->clear();
+	if (use_graph)
+		terrain = GT_GRAPH;
+	fire_generator_changed();
+	return true;
+}
+
+uint64_t Generator::fingerprint() const
+{
+	uint64_t h = mix64(GENERATOR_VERSION ^ config->seed);
+	h = mix64(h ^ (uint64_t)terrain);
+	if (terrain != GT_GRAPH)
+		return h;
+
+	h = mix64(h ^ (uint32_t)graph->density);
+	h = mix64(h ^ (uint32_t)graph->material);
+	for (const TerrainOp &op : graph->ops) {
+		h = mix64(h ^ ((uint64_t)op.code << 32) ^ (uint32_t)op.a);
+		h = mix64(h ^ ((uint64_t)(uint32_t)op.b << 32) ^ (uint32_t)op.c);
+		h = mix64(h ^ ((uint64_t)(uint32_t)op.n << 32) ^ (uint32_t)op.m);
+		for (float k : op.k)
+			h = mix_float(h, k);
+	}
+	for (const TerrainMaterialRule &r : graph->rules) {
+		h = mix_float(h, r.min_height);
+		h = mix_float(h, r.max_height);
+		h = mix_float(h, r.min_slope);
+		h = mix_float(h, r.max_slope);
+		h = mix64(h ^ (uint32_t)r.material);
+	}
+	return h;
+}
+
+void Generator::fire_generator_changed() const
+{
+	EMapGeneratorChanged ev;
+	ev.fingerprint = fingerprint();
+	NG_EventManager->fire(EID_MAP_GENERATOR_CHANGED, &ev);
+}
+
 void Generator::handle_generate_map_chunk_request(RTTIObject *event)
 {
 	EGenerateMapChunkRequest *req = EGenerateMapChunkRequest::cast(event);
+	generating = true;
 	EGenerateMapChunkMessage *msg = new (OrDie) EGenerateMapChunkMessage;
 	msg->mapgen = this;
 	msg->location = req->location;
@@ -144,6 +372,8 @@ void Generator::handle_generate_map_chunk_request(RTTIObject *event)
 void Generator::handle_map_chunk_generated_internal(RTTIObject *event)
 {
 	EGenerateMapChunkMessage *msg = EGenerateMapChunkMessage::cast(event);
+	generated_chunks++;
+	generate_time += msg->time;
 	EMapChunkGenerated out;
 	out.location = msg->location;
 	for (int i = 0; i < LODS_N; i++)
@@ -151,4 +381,46 @@ void Generator::handle_map_chunk_generated_internal(RTTIObject *event)
 	NG_EventManager->fire(EID_MAP_CHUNK_GENERATED, &out);
 }
 
+void Generator::handle_generate_map_chunks_request(RTTIObject *event)
+{
+	EGenerateMapChunksRequest *req = EGenerateMapChunksRequest::cast(event);
+	const int n = volume(req->size);
+	if (n == 0)
+		return;
+	generating = true;
+
+	auto batch = new (OrDie) EMapChunksGenerated;
+	batch->location = req->location;
+	batch->size = req->size;
+	batch->fields.resize(n * LODS_N);
+
+	for (int begin = 0; begin < n; begin += chunks_per_task) {
+		auto msg = new (OrDie) EGenerateMapChunksMessage;
+		msg->mapgen = this;
+		msg->batch = batch;
+		msg->begin = begin;
+		msg->end = min(begin + chunks_per_task, n);
+		batch->tasks_left++;
+
+		EWorkerTask wt;
+		wt.data = msg;
+		wt.execute = generate_map_chunks;
+		wt.finalize = fire_and_delete_finalizer<EID_MAP_CHUNKS_GENERATED_INTERNAL>;
+		NG_EventManager->fire(EID_QUEUE_CPU_TASK, &wt);
+	}
+}
+
+void Generator::handle_map_chunks_generated_internal(RTTIObject *event)
+{
+	EGenerateMapChunksMessage *msg = EGenerateMapChunksMessage::cast(event);
+	EMapChunksGenerated *batch = msg->batch;
+	generated_chunks += msg->end - msg->begin;
+	generate_time += msg->time;
+	if (--batch->tasks_left > 0)
+		return;
+
+	NG_EventManager->fire(EID_MAP_CHUNKS_GENERATED, batch);
+	delete batch;
+}
+
 } // namespace Map
@@ -1,23 +1,67 @@
 #pragma once
 
 #include "Map/StorageChunk.h"
+#include "Map/TerrainGraph.h"
+#include "Map/ColumnCache.h"
 #include "Math/Vec.h"
 #include "Math/Noise.h"
+#include "Math/Random.h"
 #include "OOP/EventManager.h"
+#include "Core/UniquePtr.h"
 
 namespace Map {
 
+enum GeneratorTerrain {
+	GT_FLAT,
+	GT_NOISE,
+	GT_GRAPH,
+};
+
 struct Generator : RTTIBase<Generator>
 {
+	const StorageConfig *config;
 	Noise3D *n3d;
 	Noise2D *n2d;
+	// NEXTGAME_TERRAIN=flat|noise overrides the graph
+	GeneratorTerrain terrain = GT_FLAT;
+	bool use_graph = true;
+	UniquePtr<TerrainGraph> graph;
+	// y independent graph rows of recently generated chunk columns
+	ColumnCache *column_cache;
+	// batches are split into CPU tasks of that many chunks
+	int chunks_per_task = 64;
+	// finished chunks, the time is in seconds summed over CPU tasks
+	int64_t generated_chunks = 0;
+	double generate_time = 0;
+	// set by the first generation request, the graph is fixed from then on
+	bool generating = false;
 
 	NG_DELETE_COPY_AND_MOVE(Generator);
-	Generator();
+	Generator(const StorageConfig *config);
 	~Generator();
 
+	// Random numbers for stochastic features of a chunk, e.g. ores or
+	// scattered rocks. They don't depend on the order in which workers
+	// generate chunks, so unmodified chunks can be generated again.
+	RandomStream chunk_random(const Vec3i &location, uint32_t stream) const
+	{
+		return RandomStream(random_key(config->seed, location, stream));
+	}
+
+	// Compiles the graph and switches to it. Fails once there were any
+	// generation requests, tasks read the graph without locking.
+	bool set_graph(UniquePtr<TerrainGraph> graph, Error *err = &DefaultError);
+
+	// Hash of everything the generated chunks depend on: the seed, the
+	// terrain and the ops and rules of the graph. Pristine chunks are only
+	// generated again by a generator with the same fingerprint.
+	uint64_t fingerprint() const;
+	void fire_generator_changed() const;
+
 	void handle_generate_map_chunk_request(RTTIObject *event);
 	void handle_map_chunk_generated_internal(RTTIObject *event);
+	void handle_generate_map_chunks_request(RTTIObject *event);
+	void handle_map_chunks_generated_internal(RTTIObject *event);
 };
 
 } // namespace Map
@@ -0,0 +1,246 @@
+#include "Map/Journal.h"
+#include "OS/WorkerTask.h"
+
+enum JournalTaskType {
+	JTT_APPEND,
+	JTT_TRUNCATE,
+	// 'data' is the whole new file
+	JTT_REWRITE,
+};
+
+struct EJournalTask : RTTIBase<EJournalTask>
+{
+	Map::Journal *journal;
+	Vector<uint8_t> data;
+	JournalTaskType type = JTT_APPEND;
+};
+
+namespace Map {
+
+// File header:
+//   "NGJL"
+//   uint32 version
+constexpr uint32_t JOURNAL_VERSION = 1;
+constexpr int JOURNAL_HEADER_SIZE = 8;
+constexpr int JOURNAL_RECORD_HEADER_SIZE = 8;
+
+static uint32_t record_checksum(Slice<const uint8_t> data)
+{
+	return compute_hash(slice_cast<const char>(data));
+}
+
+static void write_header(ByteWriter *w)
+{
+	w->write_string("NGJL");
+	w->write_uint32(JOURNAL_VERSION);
+}
+
+static void write_record(ByteWriter *w, Slice<const uint8_t> record)
+{
+	w->write_uint32(record.length);
+	w->write_uint32(record_checksum(record));
+	w->write(record);
+}
+
+} // namespace Map
+
+static void execute_journal_task(RTTIObject *data)
+{
+	EJournalTask *msg = EJournalTask::cast(data);
+	Map::Journal *j = msg->journal;
+	Error err;
+	if (msg->type == JTT_REWRITE) {
+		// the old file stays complete until the new one replaces it
+		const String tmp = j->filename + ".tmp";
+		IO::File *f = IO::open_file(tmp.c_str(), IO::FF_WRITE | IO::FF_CREATE, &err);
+		if (err) {
+			warn("Journal rewrite failed: %s", err.description());
+			return;
+		}
+		IO::truncate_file(f, 0, &err);
+		if (!err)
+			IO::write_at(f, msg->data, 0, &err);
+		if (!err)
+			IO::sync_file(f, &err);
+		if (!err)
+			IO::rename_file(tmp.c_str(), j->filename.c_str(), &err);
+		if (err) {
+			IO::close_file(f);
+			warn("Journal rewrite failed: %s", err.description());
+			return;
+		}
+		IO::close_file(j->file);
+		j->file = f;
+		j->end = msg->data.length();
+		return;
+	}
+
+	if (msg->type == JTT_TRUNCATE) {
+		IO::truncate_file(j->file, Map::JOURNAL_HEADER_SIZE, &err);
+		j->end = Map::JOURNAL_HEADER_SIZE;
+	} else {
+		IO::write_at(j->file, msg->data, j->end, &err);
+		j->end += msg->data.length();
+	}
+	if (!err)
+		IO::sync_file(j->file, &err);
+	if (err)
+		warn("Journal write failed: %s", err.description());
+}
+
+static void finalize_journal_task(RTTIObject *data)
+{
+	EJournalTask *msg = EJournalTask::cast(data);
+	msg->journal->tasks_in_flight--;
+	delete msg;
+}
+
+namespace Map {
+
+Journal::~Journal()
+{
+	NG_ASSERT(tasks_in_flight == 0);
+	if (file)
+		IO::close_file(file);
+}
+
+Vector<Vector<uint8_t>> Journal::open(const char *filename, Error *err)
+{
+	Vector<Vector<uint8_t>> out;
+	file = IO::open_file(filename, IO::FF_READ | IO::FF_WRITE | IO::FF_CREATE, err);
+	if (*err)
+		return out;
+
+	const int64_t size = IO::file_size(file, err);
+	if (*err)
+		return out;
+
+	if (size < JOURNAL_HEADER_SIZE) {
+		ByteWriter w;
+		write_header(&w);
+		IO::truncate_file(file, 0, err);
+		if (!*err)
+			IO::write_at(file, w.sub(), 0, err);
+		if (!*err)
+			IO::sync_file(file, err);
+		if (!*err)
+			this->filename = filename;
+		end = JOURNAL_HEADER_SIZE;
+		return out;
+	}
+
+	Vector<uint8_t> contents(size);
+	IO::read_at(file, contents, 0, err);
+	if (*err)
+		return out;
+
+	if (slice_cast<const char>(contents.sub(0, 4)) != "NGJL") {
+		err->set("Bad magic, NGJL expected: %s", filename);
+		return out;
+	}
+	ByteReader br(contents.sub(4));
+	const uint32_t version = br.read_uint32(err);
+	if (*err)
+		return out;
+	if (version != JOURNAL_VERSION) {
+		err->set("Unsupported journal version %d: %s", version, filename);
+		return out;
+	}
+
+	end = JOURNAL_HEADER_SIZE;
+	while (br.data.length >= JOURNAL_RECORD_HEADER_SIZE) {
+		Error rerr(EV_QUIET);
+		const uint32_t length = br.read_uint32(&rerr);
+		const uint32_t checksum = br.read_uint32(&rerr);
+		if (length > (uint32_t)br.data.length)
+			break;
+		Slice<const uint8_t> payload = br.data.sub(0, length);
+		if (record_checksum(payload) != checksum)
+			break;
+		records.append(Vector<uint8_t>(payload));
+		out.append(Vector<uint8_t>(payload));
+		br.data = br.data.sub(length);
+		end += JOURNAL_RECORD_HEADER_SIZE + length;
+	}
+
+	if (end != size) {
+		warn("Dropping torn journal tail in %s (%d bytes)",
+			filename, (int)(size - end));
+		IO::truncate_file(file, end, err);
+	}
+	if (!*err)
+		this->filename = filename;
+	return out;
+}
+
+static void queue_journal_task(Journal *j, EJournalTask *msg)
+{
+	EWorkerTask wt;
+	wt.data = msg;
+	wt.execute = execute_journal_task;
+	wt.finalize = finalize_journal_task;
+	NG_EventManager->fire(EID_QUEUE_IO_TASK, &wt);
+	j->tasks_in_flight++;
+}
+
+void Journal::append(Slice<const uint8_t> record)
+{
+	if (filename.length() == 0)
+		return;
+	write_record(&pending, record);
+	pending_records++;
+	records.append(Vector<uint8_t>(record));
+}
+
+void Journal::commit()
+{
+	if (pending_records == 0)
+		return;
+
+	auto msg = new (OrDie) EJournalTask;
+	msg->journal = this;
+	msg->data = std::move(pending.data);
+	pending_records = 0;
+	queue_journal_task(this, msg);
+}
+
+void Journal::truncate()
+{
+	pending.data.clear();
+	pending_records = 0;
+	records.clear();
+	if (filename.length() == 0)
+		return;
+
+	auto msg = new (OrDie) EJournalTask;
+	msg->journal = this;
+	msg->type = JTT_TRUNCATE;
+	queue_journal_task(this, msg);
+}
+
+void Journal::drop(int n)
+{
+	if (n == 0)
+		return;
+	if (n == records.length()) {
+		truncate();
+		return;
+	}
+
+	// the new file has the records not committed yet as well
+	records.remove(0, n);
+	ByteWriter w;
+	write_header(&w);
+	for (const Vector<uint8_t> &record : records)
+		write_record(&w, record);
+	pending.data.clear();
+	pending_records = 0;
+
+	auto msg = new (OrDie) EJournalTask;
+	msg->journal = this;
+	msg->type = JTT_REWRITE;
+	msg->data = std::move(w.data);
+	queue_journal_task(this, msg);
+}
+
+} // namespace Map
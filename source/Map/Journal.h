@@ -0,0 +1,56 @@
+#pragma once
+
+#include "Core/ByteIO.h"
+#include "Core/Vector.h"
+#include "Core/Error.h"
+#include "OS/IO.h"
+
+namespace Map {
+
+// Append-only log of records, used to keep changes which are not in the region
+// files yet. Records are buffered on the main thread and written by the I/O
+// worker on commit, all records of a commit share a single fsync.
+//
+// Record layout:
+//   uint32 length
+//   uint32 checksum
+//   uint8  payload[length]
+// A torn or corrupt tail (crash in the middle of a commit) is cut off on open.
+//
+// Records which are no longer needed are dropped from the front, the rest is
+// written to a new file which replaces the journal.
+struct Journal {
+	// empty if the journal couldn't be opened
+	String filename;
+	// I/O worker only after open, replaced when records are dropped
+	IO::File *file = nullptr;
+	// size of the file, I/O worker only
+	int64_t end = 0;
+	// all records of the journal, including the ones not committed yet
+	Vector<Vector<uint8_t>> records;
+	// records appended since the last commit
+	ByteWriter pending;
+	int pending_records = 0;
+	// commit and truncate tasks queued on the I/O worker
+	int tasks_in_flight = 0;
+
+	NG_DELETE_COPY_AND_MOVE(Journal);
+	Journal() = default;
+	~Journal();
+
+	// Opens or creates the journal and returns the records it contains.
+	Vector<Vector<uint8_t>> open(const char *filename, Error *err = &DefaultError);
+
+	void append(Slice<const uint8_t> record);
+	// Queues a write of the appended records.
+	void commit();
+	// Drops all records, including the ones not committed yet.
+	void truncate();
+	// Drops the first 'n' records.
+	void drop(int n);
+
+	bool is_open() const { return filename.length() != 0; }
+	bool is_idle() const { return tasks_in_flight == 0 && pending_records == 0; }
+};
+
+} // namespace Map
@@ -0,0 +1,37 @@
+#include "Map/LuaTerrainGraph.h"
+
+namespace Map {
+
+UniquePtr<TerrainGraph> terrain_graph_from_lua(InterLua::Ref desc)
+{
+	auto graph = make_unique<TerrainGraph>();
+	InterLua::Ref ops = desc["ops"];
+	for (int i = 0, n = ops.Length(); i < n; i++) {
+		InterLua::Ref op = ops[i+1];
+		TerrainOp top;
+		top.code = terrain_op_from_name(op["op"].As<const char*>());
+		top.a = op["a"];
+		top.b = op["b"];
+		top.c = op["c"];
+		top.n = op["n"];
+		top.m = op["m"];
+		InterLua::Ref k = op["k"];
+		for (int j = 0, kn = min(k.Length(), 4); j < kn; j++)
+			top.k[j] = k[j+1];
+		graph->add(top);
+	}
+	InterLua::Ref rules = desc["rules"];
+	for (int i = 0, n = rules.Length(); i < n; i++) {
+		InterLua::Ref rule = rules[i+1];
+		graph->rules.append({
+			rule["min_height"], rule["max_height"],
+			rule["min_slope"], rule["max_slope"],
+			rule["material"],
+		});
+	}
+	graph->density = desc["density"];
+	graph->material = desc["material"];
+	return graph;
+}
+
+} // namespace Map
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "Script/InterLua.h"
+#include "Map/TerrainGraph.h"
+#include "Core/UniquePtr.h"
+
+namespace Map {
+
+// Builds a graph from the flat description made by scripts/terrain.lua, it
+// still has to be compiled.
+UniquePtr<TerrainGraph> terrain_graph_from_lua(InterLua::Ref desc);
+
+} // namespace Map
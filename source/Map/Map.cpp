@@ -6,6 +6,9 @@
 #include "Render/Meshes.h"
 #include "Math/Color.h"
 #include "Map/Position.h"
+#include "Math/Random.h"
+#include "OS/IO.h"
+#include <SDL2/SDL_atomic.h>
 
 constexpr int VAO_BASE_SIZE = 1 << 24;
 
@@ -170,6 +173,11 @@ static bool lods_match(int lods_a[8], int lods_b[8])
 	return true;
 }
 
+// Meshes of the largest lods cover many 2x2x2 groups of chunks. Those are
+// split in parts along z which are meshed on several workers, the worker
+// finishing the last part puts the mesh together.
+constexpr int GEOMETRY_PART_GROUPS = 16;
+
 struct EGenerateMapChunkGeometryMessage : RTTIBase<EGenerateMapChunkGeometryMessage>
 {
 	// in
@@ -179,46 +187,110 @@ struct EGenerateMapChunkGeometryMessage : RTTIBase<EGenerateMapChunkGeometryMess
 
 	// out
 	ChunkMesh *mesh;
+
+	Vector<MeshData> parts;
+	// parts not executed yet (any thread) and not finalized yet (main thread)
+	SDL_atomic_t parts_executing;
+	int parts_finalizing;
+
+	// mesh cache, the file is empty if it's disabled
+	MeshKey cache_key;
+	uint64_t cache_version = 0;
+	String cache_file;
+	// the mesh is in the cache, it's loaded instead of meshed
+	bool cache_hit = false;
+	// the cached mesh couldn't be loaded, it was meshed again
+	bool cache_failed = false;
+	// read by an I/O reader on a hit, the mesh file to write on a miss
+	Vector<uint8_t> cache_contents;
+};
+
+struct EGenerateMapChunkGeometryPartMessage : RTTIBase<EGenerateMapChunkGeometryPartMessage>
+{
+	EGenerateMapChunkGeometryMessage *msg;
+	int part;
+	// range of groups along z
+	int z_from;
+	int z_to;
+};
+
+// Mesh files are written by the I/O worker, like storage chunks, the mesh
+// cache learns about them once they are on the disk. The index goes through
+// the same queue, after the meshes it lists.
+struct EStoreMapChunkGeometryMessage : RTTIBase<EStoreMapChunkGeometryMessage>
+{
+	// in
+	MeshKey key;
+	uint64_t version;
+	String filename; // mesh cache directory if 'index'
+	Vector<uint8_t> contents;
+	bool index = false;
+	// out
+	bool stored = false;
 };
 
-static void generate_map_chunk_geometry(RTTIObject *data)
+// Content version of the chunks a mesh is made of, the fields of the lods it
+// uses. Fields are pooled by their hashes, which stay the same between runs.
+static uint64_t mesh_version(const EMapStorageRequest *req, const int mesh_lods[8])
+{
+	uint64_t h = 0;
+	for (int i = 0; i < req->chunks.length(); i++) {
+		const Chunk *c = req->chunks[i];
+		if (c == nullptr) {
+			h = mix64(h ^ 1);
+			continue;
+		}
+		const Vec3i lpos = offset_to_3d(i, req->size);
+		const int lod = ((lpos.z > 0)<<2) | ((lpos.y > 0)<<1) | (lpos.x > 0);
+		h = mix64(h ^ c->lods[mesh_lods[lod]].hash());
+		h = mix64(h ^ 2);
+	}
+	return h;
+}
+
+static void store_map_chunk_geometry(RTTIObject *data)
+{
+	auto msg = EStoreMapChunkGeometryMessage::cast(data);
+	Error err(EV_QUIET);
+	if (msg->index)
+		write_mesh_index(msg->filename, msg->contents, &err);
+	else
+		IO::write_file(msg->filename.c_str(), msg->contents, &err);
+	msg->stored = !err;
+}
+
+static void queue_map_chunk_geometry_store(EStoreMapChunkGeometryMessage *msg)
 {
-	EGenerateMapChunkGeometryMessage *msg = EGenerateMapChunkGeometryMessage::cast(data);
-	const Vec3i size = msg->req->size - Vec3i(1);
+	EWorkerTask wt;
+	wt.data = msg;
+	wt.execute = store_map_chunk_geometry;
+	wt.finalize = fire_and_delete_finalizer<EID_MAP_CHUNK_GEOMETRY_STORED>;
+	NG_EventManager->fire(EID_QUEUE_IO_TASK, &wt);
+}
+
+static void finish_map_chunk_geometry(EGenerateMapChunkGeometryMessage *msg)
+{
+	// serialized here, written by the I/O worker
+	if (msg->cache_file.length() > 0 && !msg->cache_hit) {
+		ByteWriter w;
+		serialize_mesh(&w, msg->cache_key, msg->cache_version, msg->parts);
+		msg->cache_contents = std::move(w.data);
+	}
+
 	ChunkMesh *mc = msg->mesh;
 	NG_ASSERT(mc->vertices.length() == 0);
 	NG_ASSERT(mc->indices.length() == 0);
-	for (int z = 0; z < size.z; z++) {
-	for (int y = 0; y < size.y; y++) {
-	for (int x = 0; x < size.x; x++) {
-		int lods[8];
-		const HermiteRLEField *fields[8];
-		const Vec3i pos(x, y, z);
-		const Vec3 base = ToVec3(CHUNK_SIZE * pos) * CUBE_SIZE;
-		for (int i = 0; i < 8; i++) {
-			const Vec3i lpos = pos + rel22(i);
-			const int lod = ((lpos.z > 0)<<2) | ((lpos.y > 0)<<1) | (lpos.x > 0);
-			int off = offset_3d(lpos, msg->req->size);
-			if (msg->req->chunks[off] == nullptr) {
-				lods[i] = -1;
-				fields[i] = nullptr;
-			} else {
-				lods[i] = mc->lods[lod];
-				fields[i] = &msg->req->chunks[off]->lods[lods[i]];
-			}
-		}
-		const int basev = mc->vertices.length();
-		const int basei = mc->indices.length();
-
-		hermite_rle_fields_to_mesh(mc->vertices, mc->indices,
-			fields, lods, LAST_LOD, base);
-		const int count = mc->indices.length() - basei;
-		if (count > 0) {
-			mc->base_vertex.append(basev);
-			mc->base_index.append((GLvoid*)(size_t)(basei*sizeof(uint32_t)));
-			mc->count.append(count);
-		}
-	}}}
+	MeshData mesh;
+	merge_mesh_parts(&mesh, msg->parts);
+	msg->parts.clear();
+	for (int i = 0; i < mesh.count.length(); i++) {
+		mc->base_vertex.append(mesh.base_vertex[i]);
+		mc->base_index.append((GLvoid*)(size_t)
+			(mesh.base_index[i]*sizeof(uint32_t)));
+		mc->count.append(mesh.count[i]);
+	}
+	mc->vertices = std::move(mesh.vertices);
+	mc->indices = std::move(mesh.indices);
 
 	const int n = mc->count.length();
 	if (n == 0)
@@ -246,6 +318,96 @@ static void generate_map_chunk_geometry(RTTIObject *data)
 	mc->pobject->setCollisionShape(mc->pshape);
 }
 
+static void generate_map_chunk_geometry_part(RTTIObject *data)
+{
+	auto pmsg = EGenerateMapChunkGeometryPartMessage::cast(data);
+	EGenerateMapChunkGeometryMessage *msg = pmsg->msg;
+	mesh_chunk_groups(&msg->parts[pmsg->part], msg->req->chunks,
+		msg->req->size, msg->mesh->lods, pmsg->z_from, pmsg->z_to);
+	if (SDL_AtomicDecRef(&msg->parts_executing))
+		finish_map_chunk_geometry(msg);
+}
+
+// A cached mesh is read by an I/O reader, decoding it is cheap next to
+// meshing. The collision shape is built the same way.
+static void read_map_chunk_geometry(RTTIObject *data)
+{
+	auto msg = EGenerateMapChunkGeometryMessage::cast(data);
+	Error err(EV_QUIET);
+	msg->cache_contents = IO::read_file(msg->cache_file.c_str(), &err);
+	if (err)
+		msg->cache_contents.clear();
+}
+
+static void load_map_chunk_geometry(RTTIObject *data)
+{
+	auto msg = EGenerateMapChunkGeometryMessage::cast(data);
+	Error err(EV_QUIET);
+	msg->parts[0] = deserialize_mesh(msg->cache_contents,
+		msg->cache_key, msg->cache_version, &err);
+	msg->cache_contents.clear();
+	if (err) {
+		msg->cache_hit = false;
+		msg->cache_failed = true;
+		msg->parts[0] = MeshData();
+		mesh_chunk_groups(&msg->parts[0], msg->req->chunks,
+			msg->req->size, msg->mesh->lods, 0, msg->req->size.z - 1);
+	}
+	finish_map_chunk_geometry(msg);
+}
+
+// the mesh is done when all of its parts are
+static void finalize_map_chunk_geometry_part(RTTIObject *data)
+{
+	auto pmsg = EGenerateMapChunkGeometryPartMessage::cast(data);
+	EGenerateMapChunkGeometryMessage *msg = pmsg->msg;
+	delete pmsg;
+	if (--msg->parts_finalizing == 0)
+		fire_and_delete_finalizer<EID_MAP_CHUNK_GEOMETRY_GENERATED>(msg);
+}
+
+static void queue_map_chunk_geometry_parts(EGenerateMapChunkGeometryMessage *msg)
+{
+	const Vec3i groups = msg->req->size - Vec3i(1);
+	const int part_z = max(1, GEOMETRY_PART_GROUPS / (groups.x * groups.y));
+	const int n = (groups.z + part_z - 1) / part_z;
+	msg->parts.resize(n);
+	SDL_AtomicSet(&msg->parts_executing, n);
+	msg->parts_finalizing = n;
+	for (int i = 0; i < n; i++) {
+		auto pmsg = new (OrDie) EGenerateMapChunkGeometryPartMessage;
+		pmsg->msg = msg;
+		pmsg->part = i;
+		pmsg->z_from = i * part_z;
+		pmsg->z_to = min(groups.z, pmsg->z_from + part_z);
+
+		EWorkerTask wt;
+		wt.data = pmsg;
+		wt.execute = generate_map_chunk_geometry_part;
+		wt.finalize = finalize_map_chunk_geometry_part;
+		NG_EventManager->fire(EID_QUEUE_CPU_TASK, &wt);
+	}
+}
+
+// the mesh file was read, it's decoded on a CPU worker, or meshed if the
+// read failed
+static void finalize_map_chunk_geometry_read(RTTIObject *data)
+{
+	auto msg = EGenerateMapChunkGeometryMessage::cast(data);
+	if (msg->cache_contents.length() == 0) {
+		msg->cache_hit = false;
+		msg->cache_failed = true;
+		queue_map_chunk_geometry_parts(msg);
+		return;
+	}
+
+	EWorkerTask wt;
+	wt.data = msg;
+	wt.execute = load_map_chunk_geometry;
+	wt.finalize = fire_and_delete_finalizer<EID_MAP_CHUNK_GEOMETRY_GENERATED>;
+	NG_EventManager->fire(EID_QUEUE_CPU_TASK, &wt);
+}
+
 static void convert_range(Vec3i *origin, Vec3i *size, int from_lod, int to_lod)
 {
 	int d = lod_factor(from_lod) / lod_factor(to_lod);
@@ -329,6 +491,7 @@ static void generate_lod_structure(const Vec3 &position, const Config *config, F
 
 void Map::player_position_update(const Vec3d &wp)
 {
+	prefetcher.update(wp);
 	if (queued_geometry > 0)
 		return;
 
@@ -358,6 +521,8 @@ void Map::player_position_update(const Vec3d &wp)
 		next->geometry.insert(abspos, m);
 		auto req = new (OrDie) EMapStorageRequest(this,
 			abspos-Vec3i(1), size+Vec3i(1), lods);
+		// chunks nearest to the player are loaded first
+		req->priority = distance2(abspos + size / Vec3i(2), pos.chunk);
 		NG_EventManager->fire(EID_MAP_STORAGE_REQUEST, req);
 		queued_geometry++;
 	};
@@ -378,6 +543,7 @@ void Map::handle_chunks_updated(RTTIObject *event)
 	UpdatedChunks *uc = updated_chunks.append();
 	uc->min = msg->min;
 	uc->max = msg->max;
+	mesh_cache.invalidate(msg->min, msg->max);
 }
 
 void Map::finalize_map_update()
@@ -446,12 +612,24 @@ void Map::handle_map_storage_response(RTTIObject *event)
 	msg->config = config;
 	msg->req = req;
 	msg->mesh = mc;
+	if (mesh_cache.enabled()) {
+		msg->cache_key.location = req->location+Vec3i(1);
+		copy_memory(msg->cache_key.lods, mc->lods, 8);
+		msg->cache_version = mesh_version(req, mc->lods);
+		msg->cache_file = mesh_cache.filename(msg->cache_key);
+		msg->cache_hit = mesh_cache.lookup(msg->cache_key, msg->cache_version);
+	}
+	if (!msg->cache_hit) {
+		queue_map_chunk_geometry_parts(msg);
+		return;
+	}
 
+	msg->parts.resize(1);
 	EWorkerTask wt;
 	wt.data = msg;
-	wt.execute = generate_map_chunk_geometry;
-	wt.finalize = fire_and_delete_finalizer<EID_MAP_CHUNK_GEOMETRY_GENERATED>;
-	NG_EventManager->fire(EID_QUEUE_CPU_TASK, &wt);
+	wt.execute = read_map_chunk_geometry;
+	wt.finalize = finalize_map_chunk_geometry_read;
+	NG_EventManager->fire(EID_QUEUE_IO_READ_TASK, &wt);
 }
 
 void Map::handle_map_chunk_geometry_generated(RTTIObject *event)
@@ -465,14 +643,51 @@ void Map::handle_map_chunk_geometry_generated(RTTIObject *event)
 		next->vao.append_indices(slice_cast<const uint8_t>(mesh->indices.sub()));
 	}
 
+	if (msg->cache_failed)
+		mesh_cache.failed++;
+	if (msg->cache_contents.length() > 0) {
+		auto smsg = new (OrDie) EStoreMapChunkGeometryMessage;
+		smsg->key = msg->cache_key;
+		smsg->version = msg->cache_version;
+		smsg->filename = msg->cache_file;
+		smsg->contents = std::move(msg->cache_contents);
+		queue_map_chunk_geometry_store(smsg);
+		mesh_cache.pending_writes++;
+	} else if (msg->cache_failed) {
+		mesh_cache.remove(msg->cache_key);
+	}
+
 	queued_geometry--;
 	delete msg->req;
 	if (queued_geometry == 0)
 		finalize_map_update();
 }
 
+void Map::handle_map_chunk_geometry_stored(RTTIObject *event)
+{
+	auto msg = EStoreMapChunkGeometryMessage::cast(event);
+	mesh_cache.pending_writes--;
+	if (msg->index) {
+		if (!msg->stored)
+			warn("Failed to save the mesh cache index: %s", msg->filename.c_str());
+		return;
+	}
+	if (msg->stored)
+		mesh_cache.insert(msg->key, msg->version, msg->contents.length());
+	if (!mesh_cache.index_due())
+		return;
+
+	auto imsg = new (OrDie) EStoreMapChunkGeometryMessage;
+	imsg->filename = mesh_cache.directory;
+	imsg->contents = mesh_cache.serialize_index();
+	imsg->index = true;
+	queue_map_chunk_geometry_store(imsg);
+	mesh_cache.pending_writes++;
+}
+
 Map::Map(const Config *config, const WorldOffset *offset, BulletWorld *btworld):
-	config(config), offset(offset), btworld(btworld)
+	config(config), offset(offset), btworld(btworld), prefetcher(config),
+	mesh_cache(config)
 {
 	NG_EventManager->register_handler(EID_MAP_STORAGE_RESPONSE,
 		PASS_TO_METHOD(Map, handle_map_storage_response),
@@ -480,6 +695,9 @@ Map::Map(const Config *config, const WorldOffset *offset, BulletWorld *btworld):
 	NG_EventManager->register_handler(EID_MAP_CHUNK_GEOMETRY_GENERATED,
 		PASS_TO_METHOD(Map, handle_map_chunk_geometry_generated),
 		this, false);
+	NG_EventManager->register_handler(EID_MAP_CHUNK_GEOMETRY_STORED,
+		PASS_TO_METHOD(Map, handle_map_chunk_geometry_stored),
+		this, false);
 	NG_EventManager->register_handler(EID_CHUNKS_UPDATED,
 		PASS_TO_METHOD(Map, handle_chunks_updated),
 		this, false);
@@ -497,7 +715,7 @@ Map::~Map()
 
 bool Map::can_quit()
 {
-	return queued_geometry == 0;
+	return queued_geometry == 0 && mesh_cache.pending_writes == 0;
 }
 
 void Map::move()
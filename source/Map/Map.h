@@ -6,6 +6,8 @@
 #include "Core/HashMap.h"
 #include "OOP/EventManager.h"
 #include "Map/Config.h"
+#include "Map/Prefetcher.h"
+#include "Map/MeshCache.h"
 #include "OS/Timer.h"
 #include "Physics/Bullet.h"
 
@@ -84,6 +86,8 @@ struct Map : RTTIBase<Map> {
 	State *next = &states[1];
 	Vec3i last_player_chunk = Vec3i(9999999);
 	Timer t_map_update = Timer(TA_DONT_START);
+	Prefetcher prefetcher;
+	MeshCache mesh_cache;
 
 	NG_DELETE_COPY_AND_MOVE(Map);
 	Map(const Config *config, const WorldOffset *offset, BulletWorld *btworld);
@@ -97,6 +101,7 @@ struct Map : RTTIBase<Map> {
 	void handle_chunks_updated(RTTIObject *event);
 	void handle_map_storage_response(RTTIObject *event);
 	void handle_map_chunk_geometry_generated(RTTIObject *event);
+	void handle_map_chunk_geometry_stored(RTTIObject *event);
 
 	void update();
 };
@@ -0,0 +1,433 @@
+#include "Map/MeshCache.h"
+#include "Map/FieldPool.h"
+#include "Geometry/Global.h"
+#include "Math/Random.h"
+#include "Core/Defer.h"
+#include "OS/IO.h"
+#include <algorithm>
+#include <cstdio>
+
+namespace Map {
+
+// Mesh file layout:
+//   "NGMC"
+//   uint32 format
+//   int32 location (x, y, z)
+//   int8 lods[8]
+//   uint64 content version
+//   int32 vertices, indices and groups
+//   uint64 checksum of everything below
+//   V3N3M1_terrain vertices[]
+//   uint32 indices[]
+//   int32 count[], base_vertex[], base_index[]
+// Arrays are stored as they are in memory, a mapped file is read with a copy
+// per array. Bump the format when meshing changes, old meshes are misses then.
+constexpr uint32_t MESH_FORMAT = 1;
+constexpr int MESH_HEADER_SIZE = 56;
+
+// Index layout:
+//   "NGMI"
+//   uint32 format
+//   int32 entries
+//   uint64 checksum of everything below
+//   entries: int32 location (x, y, z), int8 lods[8], uint64 content version,
+//   int64 length, int64 last use
+constexpr uint32_t MESH_INDEX_FORMAT = 1;
+constexpr int MESH_INDEX_HEADER_SIZE = 20;
+// the index is written along with every that many stored meshes, a crash
+// loses at most those
+constexpr int MESH_INDEX_SAVE_INTERVAL = 64;
+
+static_assert(LODS_N <= 10, "mesh file names have a digit per lod");
+
+static_assert(sizeof(V3N3M1_terrain) == 20, "mesh files store vertices as is");
+
+bool MeshKey::operator==(const MeshKey &r) const
+{
+	if (location != r.location)
+		return false;
+	for (int i = 0; i < 8; i++) {
+		if (lods[i] != r.lods[i])
+			return false;
+	}
+	return true;
+}
+
+static uint64_t key_hash(const MeshKey &key)
+{
+	uint64_t h = mix64(((uint64_t)(uint32_t)key.location.x << 32) ^
+		(uint32_t)key.location.z);
+	h = mix64(h ^ (uint32_t)key.location.y);
+	for (int lod : key.lods)
+		h = mix64(h ^ (uint32_t)lod);
+	return h;
+}
+
+int compute_hash(const MeshKey &key)
+{
+	const uint64_t h = key_hash(key);
+	return h ^ (h >> 32);
+}
+
+static void write_key(ByteWriter *w, const MeshKey &key)
+{
+	w->write_int32(key.location.x);
+	w->write_int32(key.location.y);
+	w->write_int32(key.location.z);
+	for (int lod : key.lods)
+		w->write_int8(lod);
+}
+
+static MeshKey read_key(ByteReader *br, Error *err)
+{
+	MeshKey key;
+	key.location.x = br->read_int32(err);
+	key.location.y = br->read_int32(err);
+	key.location.z = br->read_int32(err);
+	for (int &lod : key.lods)
+		lod = br->read_int8(err);
+	return key;
+}
+
+void serialize_mesh(ByteWriter *w, const MeshKey &key, uint64_t version,
+	Slice<const MeshData> parts)
+{
+	ByteWriter payload;
+	int nv = 0;
+	int ni = 0;
+	int ng = 0;
+	for (const MeshData &part : parts) {
+		payload.write(slice_cast<const uint8_t>(part.vertices.sub()));
+		nv += part.vertices.length();
+		ng += part.count.length();
+	}
+	for (const MeshData &part : parts) {
+		payload.write(slice_cast<const uint8_t>(part.indices.sub()));
+		ni += part.indices.length();
+	}
+	for (const MeshData &part : parts) {
+		for (int count : part.count)
+			payload.write_int32(count);
+	}
+	int voffset = 0;
+	for (const MeshData &part : parts) {
+		for (int base : part.base_vertex)
+			payload.write_int32(voffset + base);
+		voffset += part.vertices.length();
+	}
+	int ioffset = 0;
+	for (const MeshData &part : parts) {
+		for (int base : part.base_index)
+			payload.write_int32(ioffset + base);
+		ioffset += part.indices.length();
+	}
+
+	w->write_string("NGMC");
+	w->write_uint32(MESH_FORMAT);
+	write_key(w, key);
+	w->write_uint64(version);
+	w->write_int32(nv);
+	w->write_int32(ni);
+	w->write_int32(ng);
+	w->write_uint64(content_hash(payload.sub()).value);
+	w->write(payload.sub());
+}
+
+template <typename T>
+static void read_array(Vector<T> *out, ByteReader *br, int n)
+{
+	out->resize(n);
+	br->read(slice_cast<uint8_t>(out->sub()));
+}
+
+MeshData deserialize_mesh(Slice<const uint8_t> data, const MeshKey &key,
+	uint64_t version, Error *err)
+{
+	MeshData out;
+	if (data.length < MESH_HEADER_SIZE ||
+		slice_cast<const char>(data.sub(0, 4)) != "NGMC")
+	{
+		err->set("Bad magic, NGMC expected");
+		return out;
+	}
+
+	ByteReader br(data.sub(4, MESH_HEADER_SIZE));
+	const uint32_t format = br.read_uint32(err);
+	const MeshKey file_key = read_key(&br, err);
+	const uint64_t file_version = br.read_uint64(err);
+	const int nv = br.read_int32(err);
+	const int ni = br.read_int32(err);
+	const int ng = br.read_int32(err);
+	const uint64_t checksum = br.read_uint64(err);
+	if (*err)
+		return out;
+
+	if (format != MESH_FORMAT) {
+		err->set("Unsupported mesh file format %d", format);
+		return out;
+	}
+	if (file_key != key || file_version != version) {
+		err->set("Mesh file of another mesh or version");
+		return out;
+	}
+	const Slice<const uint8_t> payload = data.sub(MESH_HEADER_SIZE);
+	const int64_t expected = (int64_t)nv * sizeof(V3N3M1_terrain) +
+		(int64_t)ni * sizeof(uint32_t) + (int64_t)ng * 3 * sizeof(int32_t);
+	if (nv < 0 || ni < 0 || ng < 0 || payload.length != expected) {
+		err->set("Mesh file length mismatch");
+		return out;
+	}
+	if (content_hash(payload).value != checksum) {
+		err->set("Mesh file checksum mismatch");
+		return out;
+	}
+
+	ByteReader pr(payload);
+	read_array(&out.vertices, &pr, nv);
+	read_array(&out.indices, &pr, ni);
+	read_array(&out.count, &pr, ng);
+	read_array(&out.base_vertex, &pr, ng);
+	read_array(&out.base_index, &pr, ng);
+	return out;
+}
+
+MeshData load_mesh_file(const char *filename, const MeshKey &key,
+	uint64_t version, Error *err)
+{
+	IO::MappedFile *mf = IO::map_file(filename, err);
+	if (*err)
+		return {};
+	DEFER { delete mf; };
+	return deserialize_mesh(mf->data, key, version, err);
+}
+
+MeshCache::MeshCache(const Config *config):
+	directory(config->mesh_cache_directory),
+	budget(config->mesh_cache_budget)
+{
+	if (!enabled())
+		return;
+
+	String path = directory;
+	Error err(EV_QUIET);
+	IO::make_directories(path, &err);
+	if (err) {
+		warn("Mesh cache disabled, no directory: %s", directory.c_str());
+		directory = "";
+		return;
+	}
+	load_index();
+}
+
+MeshCache::~MeshCache()
+{
+	if (enabled())
+		save_index();
+}
+
+// Distinct keys have distinct names, a file is never shared by two meshes.
+static String mesh_basename(const MeshKey &key)
+{
+	const int *l = key.lods;
+	return String::format("%d_%d_%d_%d%d%d%d%d%d%d%d.ngm",
+		key.location.x, key.location.y, key.location.z,
+		l[0], l[1], l[2], l[3], l[4], l[5], l[6], l[7]);
+}
+
+String MeshCache::filename(const MeshKey &key) const
+{
+	return directory + "/" + mesh_basename(key);
+}
+
+bool MeshCache::lookup(const MeshKey &key, uint64_t version)
+{
+	MeshCacheEntry *e = entries.get(key);
+	if (!e || e->version != version) {
+		misses++;
+		return false;
+	}
+	e->last_use = clock++;
+	hits++;
+	return true;
+}
+
+void MeshCache::insert(const MeshKey &key, uint64_t version, int64_t length)
+{
+	if (MeshCacheEntry *e = entries.get(key)) {
+		bytes -= e->length;
+		*e = {version, length, clock++};
+	} else {
+		entries.insert(key, MeshCacheEntry{version, length, clock++});
+	}
+	bytes += length;
+	stored++;
+	unsaved++;
+	if (bytes <= budget)
+		return;
+
+	struct Candidate {
+		int64_t last_use;
+		MeshKey key;
+		bool operator<(const Candidate &r) const { return last_use < r.last_use; }
+	};
+	Vector<Candidate> candidates;
+	for (auto kv : entries)
+		candidates.append({kv.value.last_use, kv.key});
+	std::sort(candidates.data(), candidates.data() + candidates.length());
+	for (const Candidate &c : candidates) {
+		if (bytes <= budget)
+			break;
+		remove(c.key);
+		evicted++;
+	}
+}
+
+void MeshCache::remove(const MeshKey &key)
+{
+	const MeshCacheEntry *e = entries.get(key);
+	if (!e)
+		return;
+	bytes -= e->length;
+	entries.remove(key);
+	Error err(EV_QUIET);
+	IO::remove_file(filename(key).c_str(), &err);
+}
+
+void MeshCache::invalidate(const Vec3i &min, const Vec3i &max)
+{
+	// meshes are made of the chunks they cover and the ones before them
+	Vector<MeshKey> keys;
+	for (auto kv : entries) {
+		const MeshKey &key = kv.key;
+		const Vec3i size(lod_factor(key.lods[7]));
+		const Vec3i mesh_min = key.location - Vec3i(1);
+		const Vec3i mesh_max = key.location + size - Vec3i(1);
+		if (aabb_aabb_intersection(min, max, mesh_min, mesh_max))
+			keys.append(key);
+	}
+	for (const MeshKey &key : keys)
+		remove(key);
+	invalidated += keys.length();
+}
+
+void MeshCache::load_index()
+{
+	const String index = directory + "/index";
+	Error err(EV_QUIET);
+	Vector<uint8_t> data;
+	if (IO::file_exists(index.c_str()))
+		data = IO::read_file(index.c_str(), &err);
+	if (data.length() >= MESH_INDEX_HEADER_SIZE &&
+		slice_cast<const char>(data.sub(0, 4)) == "NGMI")
+	{
+		ByteReader br(data.sub(4));
+		const uint32_t format = br.read_uint32(&err);
+		const int n = br.read_int32(&err);
+		const uint64_t checksum = br.read_uint64(&err);
+		if (!err && format == MESH_INDEX_FORMAT &&
+			content_hash(br.data).value == checksum)
+		{
+			for (int i = 0; i < n && !err; i++) {
+				const MeshKey key = read_key(&br, &err);
+				MeshCacheEntry e;
+				e.version = br.read_uint64(&err);
+				e.length = br.read_int64(&err);
+				e.last_use = br.read_int64(&err);
+				if (err)
+					break;
+				entries.insert(key, e);
+				bytes += e.length;
+				clock = ::max(clock, e.last_use + 1);
+			}
+		}
+	}
+	if (err) {
+		entries.clear();
+		bytes = 0;
+	}
+
+	// the index may be behind the files after a run which didn't exit cleanly:
+	// entries of removed files are dropped, files the index doesn't know about
+	// don't count towards the budget, they are removed
+	HashMap<String, bool> present;
+	Error derr(EV_QUIET);
+	IO::Directory *dir = IO::open_directory(directory.c_str(), &derr);
+	if (derr)
+		return;
+	DEFER { IO::close_directory(dir); };
+	for (String name = IO::next_file(dir); name.length() > 0; name = IO::next_file(dir)) {
+		if (IO::fnmatch("*.ngm", name.c_str()))
+			present.insert(name, true);
+	}
+
+	Vector<MeshKey> missing;
+	for (auto kv : entries) {
+		const String name = mesh_basename(kv.key);
+		if (present.get(name))
+			present.remove(name);
+		else
+			missing.append(kv.key);
+	}
+	for (const MeshKey &key : missing) {
+		bytes -= entries.get(key)->length;
+		entries.remove(key);
+	}
+	for (auto kv : present) {
+		Error rerr(EV_QUIET);
+		IO::remove_file((directory + "/" + kv.key).c_str(), &rerr);
+	}
+}
+
+bool MeshCache::index_due() const
+{
+	return unsaved >= MESH_INDEX_SAVE_INTERVAL;
+}
+
+Vector<uint8_t> MeshCache::serialize_index()
+{
+	ByteWriter entries_w;
+	for (auto kv : entries) {
+		write_key(&entries_w, kv.key);
+		entries_w.write_uint64(kv.value.version);
+		entries_w.write_int64(kv.value.length);
+		entries_w.write_int64(kv.value.last_use);
+	}
+
+	ByteWriter w;
+	w.write_string("NGMI");
+	w.write_uint32(MESH_INDEX_FORMAT);
+	w.write_int32(entries.length());
+	w.write_uint64(content_hash(entries_w.sub()).value);
+	w.write(entries_w.sub());
+	unsaved = 0;
+	return std::move(w.data);
+}
+
+void MeshCache::save_index()
+{
+	Error err(EV_QUIET);
+	write_mesh_index(directory, serialize_index(), &err);
+	if (err)
+		warn("Failed to save the mesh cache index: %s", directory.c_str());
+}
+
+void write_mesh_index(const String &directory, Slice<const uint8_t> contents,
+	Error *err)
+{
+	const String index = directory + "/index";
+	const String tmp = index + ".tmp";
+	IO::write_file(tmp.c_str(), contents, err);
+	if (*err)
+		return;
+	IO::rename_file(tmp.c_str(), index.c_str(), err);
+}
+
+void MeshCache::print_stats()
+{
+	printf("Map mesh cache: %d meshes, %.1f MB, %d hits, %d misses, %d failed, "
+		"%d stored, %d evicted, %d invalidated\n",
+		entries.length(), bytes / (1024.0 * 1024.0), hits, misses, failed,
+		stored, evicted, invalidated);
+}
+
+} // namespace Map
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Map/Config.h"
+#include "Map/MeshData.h"
+#include "Core/HashMap.h"
+#include "Core/ByteIO.h"
+#include "Core/Vector.h"
+#include "Core/Error.h"
+
+namespace Map {
+
+// ChunkMesh at 'location' (as in State::geometry) with a given lod per octant.
+struct MeshKey {
+	Vec3i location;
+	int lods[8];
+
+	bool operator==(const MeshKey &r) const;
+	bool operator!=(const MeshKey &r) const { return !operator==(r); }
+};
+
+int compute_hash(const MeshKey &key);
+
+// Writes the parts one after another as a single mesh. 'version' is the
+// content version of the chunks the mesh is made of.
+void serialize_mesh(ByteWriter *w, const MeshKey &key, uint64_t version,
+	Slice<const MeshData> parts);
+
+// Reads a mesh written by serialize_mesh, fails if it was written for another
+// key or version, or if it's damaged.
+MeshData deserialize_mesh(Slice<const uint8_t> data, const MeshKey &key,
+	uint64_t version, Error *err = &DefaultError);
+
+// Maps a mesh file and reads it, can be used from any thread.
+MeshData load_mesh_file(const char *filename, const MeshKey &key,
+	uint64_t version, Error *err = &DefaultError);
+
+// Replaces the index file with 'contents' made by MeshCache::serialize_index,
+// a crash while writing leaves the old one. Can be used from any thread.
+void write_mesh_index(const String &directory, Slice<const uint8_t> contents,
+	Error *err = &DefaultError);
+
+struct MeshCacheEntry {
+	uint64_t version;
+	int64_t length;
+	int64_t last_use;
+};
+
+// Meshes of terrain which didn't change since they were made, kept on disk
+// between visits and runs, a file per ChunkMesh. Content versions make stale
+// meshes misses, EChunksUpdated removes them early. The index lives in memory
+// and is used on the main thread only, it's written by the I/O worker after
+// every few stored meshes and on exit. Mesh files are read by the I/O readers
+// and written by the I/O worker, their names are made of the whole key.
+struct MeshCache {
+	String directory; // empty if disabled
+	int64_t budget;
+	HashMap<MeshKey, MeshCacheEntry> entries;
+	int64_t bytes = 0;
+	int64_t clock = 0;
+	// mesh and index files queued for the I/O worker
+	int pending_writes = 0;
+	// meshes stored since the index was last serialized
+	int unsaved = 0;
+
+	int hits = 0;
+	int misses = 0;
+	int failed = 0;
+	int stored = 0;
+	int evicted = 0;
+	int invalidated = 0;
+
+	NG_DELETE_COPY_AND_MOVE(MeshCache);
+	explicit MeshCache(const Config *config);
+	~MeshCache();
+
+	bool enabled() const { return directory.length() > 0; }
+	String filename(const MeshKey &key) const;
+
+	// Is there a mesh for the key made of chunks of that version, marks it
+	// as used if there is.
+	bool lookup(const MeshKey &key, uint64_t version);
+	// Adds a mesh file written by a worker, evicts the least recently used
+	// ones if the files take more than the budget.
+	void insert(const MeshKey &key, uint64_t version, int64_t length);
+	void remove(const MeshKey &key);
+	// Removes meshes made of any of the chunks in the range.
+	void invalidate(const Vec3i &min, const Vec3i &max);
+
+	// Are there enough unsaved meshes to write the index out.
+	bool index_due() const;
+	Vector<uint8_t> serialize_index();
+	void load_index();
+	void save_index();
+	void print_stats();
+};
+
+} // namespace Map
@@ -0,0 +1,72 @@
+#include "Map/MeshData.h"
+#include "Geometry/HermiteField.h"
+
+namespace Map {
+
+void mesh_chunk_groups(MeshData *out, Slice<Chunk* const> chunks,
+	const Vec3i &size, const int lods[8], int z_from, int z_to)
+{
+	const Vec3i groups = size - Vec3i(1);
+	for (int z = z_from; z < z_to; z++) {
+	for (int y = 0; y < groups.y; y++) {
+	for (int x = 0; x < groups.x; x++) {
+		int group_lods[8];
+		const HermiteRLEField *fields[8];
+		const Vec3i pos(x, y, z);
+		const Vec3 base = ToVec3(CHUNK_SIZE * pos) * CUBE_SIZE;
+		for (int i = 0; i < 8; i++) {
+			const Vec3i lpos = pos + rel22(i);
+			const int octant = ((lpos.z > 0)<<2) | ((lpos.y > 0)<<1) | (lpos.x > 0);
+			const Chunk *c = chunks[offset_3d(lpos, size)];
+			if (c == nullptr) {
+				group_lods[i] = -1;
+				fields[i] = nullptr;
+			} else {
+				group_lods[i] = lods[octant];
+				fields[i] = c->lods[group_lods[i]].get();
+			}
+		}
+		const int basev = out->vertices.length();
+		const int basei = out->indices.length();
+
+		hermite_rle_fields_to_mesh(out->vertices, out->indices,
+			fields, group_lods, LAST_LOD, base);
+		const int count = out->indices.length() - basei;
+		if (count > 0) {
+			out->base_vertex.append(basev);
+			out->base_index.append(basei);
+			out->count.append(count);
+		}
+	}}}
+}
+
+void merge_mesh_parts(MeshData *out, Slice<MeshData> parts)
+{
+	if (parts.length == 1) {
+		*out = std::move(parts[0]);
+		return;
+	}
+
+	// index values are relative to the base vertex of their group, only
+	// the bases move
+	int voffset = 0;
+	int ioffset = 0;
+	for (const MeshData &part : parts) {
+		for (int i = 0; i < part.count.length(); i++) {
+			out->base_vertex.append(voffset + part.base_vertex[i]);
+			out->base_index.append(ioffset + part.base_index[i]);
+			out->count.append(part.count[i]);
+		}
+		voffset += part.vertices.length();
+		ioffset += part.indices.length();
+	}
+	out->vertices.reserve(voffset);
+	out->indices.reserve(ioffset);
+	for (MeshData &part : parts) {
+		out->vertices.append(part.vertices);
+		out->indices.append(part.indices);
+		part = MeshData();
+	}
+}
+
+} // namespace Map
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Map/Chunk.h"
+#include "Geometry/VertexFormats.h"
+#include "Core/Vector.h"
+
+namespace Map {
+
+// Terrain mesh of a ChunkMesh or of a part of it. Tables have an entry for
+// each 2x2x2 group of chunks with triangles, bases are relative to the mesh
+// and 'base_index' is in indices.
+struct MeshData {
+	Vector<V3N3M1_terrain> vertices;
+	Vector<uint32_t> indices;
+	Vector<int> count;
+	Vector<int> base_vertex;
+	Vector<int> base_index;
+};
+
+// Meshes the 2x2x2 groups of 'chunks' (a box of 'size', missing ones are
+// null) with their first corner in z_from..z_to-1 along z, with a lod per
+// octant of the box. Can be called from any thread.
+void mesh_chunk_groups(MeshData *out, Slice<Chunk* const> chunks,
+	const Vec3i &size, const int lods[8], int z_from, int z_to);
+
+// Puts parts meshed one after another along z together into an empty 'out',
+// the same mesh as if they were meshed at once. Parts are moved from.
+void merge_mesh_parts(MeshData *out, Slice<MeshData> parts);
+
+} // namespace Map
@@ -1,12 +1,95 @@
 #include "Map/Mutator.h"
 #include "Map/Storage.h"
+#include "Core/ByteIO.h"
 
 namespace Map {
 
-Mutator::Mutator()
+static void write_vec3i(ByteWriter *w, const Vec3i &v)
+{
+	w->write_int32(v.x);
+	w->write_int32(v.y);
+	w->write_int32(v.z);
+}
+
+static Vec3i read_vec3i(ByteReader *r, Error *err)
+{
+	Vec3i v;
+	v.x = r->read_int32(err);
+	v.y = r->read_int32(err);
+	v.z = r->read_int32(err);
+	return v;
+}
+
+// Journal record layout:
+//   uint8 action
+//   uint8 tool
+//   int32 material
+//   int32 chunk, closest_voxel, floor_voxel (x, y, z each)
+//   float point (x, y, z)
+static void write_batch(ByteWriter *w, const MutatorBatch &b)
+{
+	w->write_uint8(b.action);
+	w->write_uint8(b.tool);
+	w->write_int32(b.material);
+	write_vec3i(w, b.position.chunk);
+	write_vec3i(w, b.position.closest_voxel);
+	write_vec3i(w, b.position.floor_voxel);
+	w->write_float(b.position.point.x);
+	w->write_float(b.position.point.y);
+	w->write_float(b.position.point.z);
+}
+
+static MutatorBatch read_batch(Slice<const uint8_t> data, Error *err)
+{
+	ByteReader r(data);
+	MutatorBatch b;
+	b.action = (MutatorAction)r.read_uint8(err);
+	b.tool = (MutatorTool)r.read_uint8(err);
+	b.material = r.read_int32(err);
+	b.position.chunk = read_vec3i(&r, err);
+	b.position.closest_voxel = read_vec3i(&r, err);
+	b.position.floor_voxel = read_vec3i(&r, err);
+	b.position.point.x = r.read_float(err);
+	b.position.point.y = r.read_float(err);
+	b.position.point.z = r.read_float(err);
+	return b;
+}
+
+// journaled_writes of records which are not applied yet, and of the ones
+// which have nothing to save
+static const int64_t WRITE_PENDING = -1;
+static const int64_t WRITE_NONE = -2;
+
+Mutator::Mutator(const StorageConfig *config)
 {
 	NG_EventManager->register_handler(EID_MAP_STORAGE_RESPONSE,
 		PASS_TO_METHOD(Mutator, handle_map_storage_response), this, false);
+	NG_EventManager->register_handler(EID_MAP_STORAGE_CHECKPOINT,
+		PASS_TO_METHOD(Mutator, handle_map_storage_checkpoint), this, false);
+
+	// Batches left in the journal were lost in a crash, apply them again.
+	// They stay in the journal until the storage saves their results.
+	Error err(EV_QUIET);
+	const String filename = config->directory + "/journal.ngj";
+	auto records = journal.open(filename.c_str(), &err);
+	if (err) {
+		warn("Failed to open mutator journal, edits won't survive a crash: %s",
+			err.description());
+		return;
+	}
+	for (const Vector<uint8_t> &record : records) {
+		Error rerr(EV_QUIET);
+		const MutatorBatch b = read_batch(record, &rerr);
+		if (rerr) {
+			warn("Skipping malformed mutator journal record");
+			journaled_writes.append(WRITE_NONE);
+			continue;
+		}
+		journaled_writes.append(WRITE_PENDING);
+		apply(b);
+	}
+	if (records.length() > 0)
+		printf("Replaying %d journaled mutator batches\n", records.length());
 }
 
 Mutator::~Mutator()
@@ -27,7 +110,7 @@ void Mutator::handle_map_storage_response(RTTIObject *event)
 		Chunk *mc = req->chunks[offseti];
 		if (mc == nullptr)
 			continue;
-		const HermiteRLEField *f = &mc->lods[0];
+		const HermiteRLEField *f = mc->lods[0].get();
 		const Vec3i offset = Vec3i(x, y, z) * CHUNK_SIZE;
 		f->decompress_to(field.data, offset, field.size);
 	}}}
@@ -51,21 +134,55 @@ void Mutator::handle_map_storage_response(RTTIObject *event)
 		if (mc == nullptr)
 			continue;
 		const Vec3i offset = Vec3i(x, y, z) * CHUNK_SIZE;
-		mc->lods[0] = HermiteRLEField(field, offset, CHUNK_SIZE+Vec3i(1));
-		mc->generate_lod_fields();
+		mc->lods[0] = intern_field(HermiteRLEField(field, offset, CHUNK_SIZE+Vec3i(1)));
+		mc->reset_lods();
 	}}}
 
 	EChunksUpdated ev;
 	ev.min = req->location;
 	ev.max = req->location + req->size;	// also grab chunks that depend on us
 
+	// batches are applied one at a time in the order of the journal
+	Storage *storage = req->map_storage;
 	delete req;
+	for (int64_t &write : journaled_writes) {
+		if (write == WRITE_PENDING) {
+			write = storage->writes - 1;
+			break;
+		}
+	}
 	NG_EventManager->fire(EID_CHUNKS_UPDATED, &ev);
 	target_change_valid = false;
 	printf("Unpacked/packed in %fms\n", t_packing.elapsed_ms());
 }
 
+void Mutator::handle_map_storage_checkpoint(RTTIObject *event)
+{
+	// records of batches whose storage chunks are all saved are no longer
+	// needed, the rest stays in the journal
+	Storage *storage = Storage::cast(event);
+	int n = 0;
+	while (n < journaled_writes.length() &&
+		journaled_writes[n] != WRITE_PENDING &&
+		journaled_writes[n] < storage->saved_writes)
+	{
+		n++;
+	}
+	journal.drop(n);
+	journaled_writes.remove(0, n);
+}
+
 void Mutator::mutate(const MutatorBatch &batch)
+{
+	ByteWriter w;
+	write_batch(&w, batch);
+	journal.append(w.sub());
+	if (journal.is_open())
+		journaled_writes.append(WRITE_PENDING);
+	apply(batch);
+}
+
+void Mutator::apply(const MutatorBatch &batch)
 {
 	if (target_change_valid) {
 		queue.append(batch);
@@ -100,6 +217,9 @@ void Mutator::mutate(const MutatorBatch &batch)
 
 void Mutator::update()
 {
+	// group commit, one write and fsync per frame at most
+	journal.commit();
+
 	if (queue.length() == 0)
 		return;
 
@@ -108,7 +228,12 @@ void Mutator::update()
 
 	MutatorBatch b = queue.first();
 	queue.remove(0);
-	mutate(b);
+	apply(b);
+}
+
+bool Mutator::can_quit() const
+{
+	return queue.length() == 0 && !target_change_valid && journal.is_idle();
 }
 
 } // namespace Map
@@ -5,6 +5,8 @@
 #include "Geometry/HermiteField.h"
 #include "Map/Map.h"
 #include "Map/Position.h"
+#include "Map/Journal.h"
+#include "Map/Config.h"
 
 namespace Map {
 
@@ -36,15 +38,25 @@ struct Mutator : RTTIBase<Mutator>
 	HermiteField target_change;
 	MutatorBatch target_batch;
 
+	// batches which might not be in the region files yet, replayed on startup
+	Journal journal;
+	// Storage::writes index of the write request of each journal record, see
+	// Storage::saved_writes. Records are dropped once theirs is saved.
+	Vector<int64_t> journaled_writes;
+
 	NG_DELETE_COPY_AND_MOVE(Mutator);
-	Mutator();
+	Mutator(const StorageConfig *config);
 	~Mutator();
 
 	void handle_map_storage_response(RTTIObject *event);
+	void handle_map_storage_checkpoint(RTTIObject *event);
 
+	// journals the batch and applies it
 	void mutate(const MutatorBatch &batch);
+	void apply(const MutatorBatch &batch);
 
 	void update();
+	bool can_quit() const;
 };
 
 } // namespace Map
@@ -0,0 +1,87 @@
+#include "Map/Prefetcher.h"
+#include "Map/Position.h"
+#include "Geometry/Global.h"
+#include "OOP/EventManager.h"
+
+namespace Map {
+
+// minimum time between two samples, keeps the history independent of the
+// frame rate
+constexpr double PREFETCH_SAMPLE_INTERVAL = 0.05;
+// slower than that is not worth predicting, units per second
+constexpr float PREFETCH_MIN_SPEED = 1.0f;
+// the trajectory is sampled with that step, in seconds
+constexpr double PREFETCH_STEP = 0.25;
+
+// Storage chunks covered by the LOD structure around 'chunk', same extent as
+// generate_lod_structure plus the border requests grab.
+static void lod_structure_bounds(Vec3i *min, Vec3i *max,
+	const Vec3i &chunk, const Config *config)
+{
+	const Vec3i factor(lod_factor(LAST_LOD));
+	const Vec3i c = floor_div(chunk, factor);
+	const Vec3i orig = c - config->visible_range / Vec3i(2);
+	*min = floor_div(orig * factor - Vec3i(1), STORAGE_CHUNK_SIZE);
+	*max = floor_div((orig + config->visible_range) * factor, STORAGE_CHUNK_SIZE);
+}
+
+static bool contains(Slice<const Vec3i> locations, const Vec3i &location)
+{
+	for (const Vec3i &l : locations) {
+		if (l == location)
+			return true;
+	}
+	return false;
+}
+
+void Prefetcher::update(const Vec3d &wp)
+{
+	if (config->prefetch_horizon <= 0)
+		return;
+
+	const double now = timer.elapsed();
+	if (samples_n > 0 && now - samples[samples_n-1].time < PREFETCH_SAMPLE_INTERVAL)
+		return;
+	if (samples_n == PREFETCH_SAMPLES_N) {
+		for (int i = 1; i < samples_n; i++)
+			samples[i-1] = samples[i];
+		samples_n--;
+	}
+	samples[samples_n++] = {wp, now};
+	if (samples_n < 2)
+		return;
+
+	const Sample &oldest = samples[0];
+	const Vec3d velocity = (wp - oldest.position) / Vec3d(now - oldest.time);
+
+	Vector<Vec3i> locations;
+	if (length(velocity) >= PREFETCH_MIN_SPEED) {
+		Vec3i cur_min, cur_max;
+		lod_structure_bounds(&cur_min, &cur_max, Position(wp).chunk, config);
+
+		for (double t = PREFETCH_STEP; t <= config->prefetch_horizon; t += PREFETCH_STEP) {
+			const Vec3d p = wp + velocity * Vec3d(t);
+			Vec3i min, max;
+			lod_structure_bounds(&min, &max, Position(p).chunk, config);
+			for (int y = min.y; y <= max.y; y++) {
+			for (int z = min.z; z <= max.z; z++) {
+			for (int x = min.x; x <= max.x; x++) {
+				const Vec3i l(x, y, z);
+				if (cur_min <= l && l <= cur_max)
+					continue;
+				if (!contains(locations, l))
+					locations.append(l);
+			}}}
+		}
+	}
+
+	if (locations.sub() == predicted.sub())
+		return;
+
+	EMapStoragePrefetch ev;
+	ev.locations = Vector<Vec3i>(locations.sub());
+	predicted = std::move(locations);
+	NG_EventManager->fire(EID_MAP_STORAGE_PREFETCH, &ev);
+}
+
+} // namespace Map
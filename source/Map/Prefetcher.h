@@ -0,0 +1,42 @@
+#pragma once
+
+#include "Map/Config.h"
+#include "Math/Vec.h"
+#include "Core/Vector.h"
+#include "OOP/RTTI.h"
+#include "OS/Timer.h"
+
+struct EMapStoragePrefetch : RTTIBase<EMapStoragePrefetch>
+{
+	// Storage chunks which are expected to be requested soon, most urgent
+	// first. Speculative loads of the previous prefetch which are not in the
+	// list are cancelled.
+	Vector<Vec3i> locations;
+};
+
+namespace Map {
+
+constexpr int PREFETCH_SAMPLES_N = 8;
+
+// Predicts where the player is heading from recent positions and asks the
+// storage to load storage chunks which will enter the LOD structure within
+// Config::prefetch_horizon seconds.
+struct Prefetcher {
+	struct Sample {
+		Vec3d position;
+		double time;
+	};
+
+	const Config *config;
+	Timer timer;
+	Sample samples[PREFETCH_SAMPLES_N];
+	int samples_n = 0;
+	// last prefetched storage chunks, see EMapStoragePrefetch
+	Vector<Vec3i> predicted;
+
+	explicit Prefetcher(const Config *config): config(config) {}
+
+	void update(const Vec3d &wp);
+};
+
+} // namespace Map
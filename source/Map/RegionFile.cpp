@@ -0,0 +1,328 @@
+#include "Map/RegionFile.h"
+#include "Core/ByteIO.h"
+#include "Geometry/Global.h"
+#include "Core/Defer.h"
+#include <algorithm>
+
+namespace Map {
+
+// Header layout:
+//   "NGRF"
+//   uint32 version
+//   int32 region size (x, y, z)
+//   uint32 reserved
+//   RegionEntry entries[REGION_ENTRIES_N]
+// All of that fits into the first sector, payloads start from the second one.
+constexpr uint32_t REGION_VERSION = 1;
+constexpr int REGION_ENTRIES_OFFSET = 24;
+constexpr int REGION_ENTRY_SIZE = 16;
+constexpr int REGION_HEADER_SIZE =
+	REGION_ENTRIES_OFFSET + REGION_ENTRIES_N * REGION_ENTRY_SIZE;
+
+static_assert(REGION_HEADER_SIZE <= REGION_SECTOR_SIZE,
+	"region header must fit into a single sector");
+
+static uint32_t region_checksum(Slice<const uint8_t> data)
+{
+	return compute_hash(slice_cast<const char>(data));
+}
+
+static int sectors_for(int length)
+{
+	return (length + REGION_SECTOR_SIZE - 1) / REGION_SECTOR_SIZE;
+}
+
+static void write_entry(ByteWriter *w, const RegionEntry &e)
+{
+	w->write_uint32(e.sector);
+	w->write_uint32(e.length);
+	w->write_uint32(e.codec);
+	w->write_uint32(e.checksum);
+}
+
+RegionFile::~RegionFile()
+{
+	if (file)
+		IO::close_file(file);
+}
+
+RegionFile *RegionFile::open(const char *filename, Error *err)
+{
+	IO::File *file = IO::open_file(filename,
+		IO::FF_READ | IO::FF_WRITE | IO::FF_CREATE, err);
+	if (*err)
+		return nullptr;
+
+	RegionFile *rf = new (OrDie) RegionFile;
+	rf->file = file;
+
+	const int64_t size = IO::file_size(file, err);
+	if (*err) {
+		delete rf;
+		return nullptr;
+	}
+
+	if (size == 0) {
+		// fresh file, write an empty header
+		ByteWriter w;
+		w.write_string("NGRF");
+		w.write_uint32(REGION_VERSION);
+		w.write_int32(REGION_SIZE.x);
+		w.write_int32(REGION_SIZE.y);
+		w.write_int32(REGION_SIZE.z);
+		w.write_uint32(0);
+		for (const RegionEntry &e : rf->entries)
+			write_entry(&w, e);
+		IO::write_at(file, w.sub(), 0, err);
+		if (*err) {
+			delete rf;
+			return nullptr;
+		}
+		return rf;
+	}
+
+	Vector<uint8_t> header(REGION_HEADER_SIZE);
+	IO::read_at(file, header, 0, err);
+	if (*err) {
+		delete rf;
+		return nullptr;
+	}
+
+	if (slice_cast<const char>(header.sub(0, 4)) != "NGRF") {
+		err->set("Bad magic, NGRF expected: %s", filename);
+		delete rf;
+		return nullptr;
+	}
+
+	ByteReader br(header.sub(4));
+	const uint32_t version = br.read_uint32(err);
+	Vec3i region_size;
+	region_size.x = br.read_int32(err);
+	region_size.y = br.read_int32(err);
+	region_size.z = br.read_int32(err);
+	br.read_uint32(err);
+	if (*err) {
+		delete rf;
+		return nullptr;
+	}
+
+	if (version != REGION_VERSION) {
+		err->set("Unsupported region file version %d: %s", version, filename);
+		delete rf;
+		return nullptr;
+	}
+	if (region_size != REGION_SIZE) {
+		err->set("Mismatching region sizes, file: (%d %d %d), expected: (%d %d %d)",
+			VEC3(region_size), VEC3(REGION_SIZE));
+		delete rf;
+		return nullptr;
+	}
+
+	for (RegionEntry &e : rf->entries) {
+		e.sector = br.read_uint32(err);
+		e.length = br.read_uint32(err);
+		e.codec = br.read_uint32(err);
+		e.checksum = br.read_uint32(err);
+		if (*err) {
+			delete rf;
+			return nullptr;
+		}
+
+		// entry points outside of the file, most likely the payload write
+		// didn't make it to the disk, forget about it
+		const int64_t end = (int64_t)e.sector * REGION_SECTOR_SIZE + e.length;
+		if (e.codec != RC_EMPTY && (e.sector == 0 || end > size)) {
+			warn("Dropping truncated region entry in %s", filename);
+			e = RegionEntry();
+		}
+	}
+	return rf;
+}
+
+IO::MappedFile *RegionFile::map(int index, RegionCodec *codec, Error *err)
+{
+	NG_IDX_BOUNDS_CHECK(index, REGION_ENTRIES_N);
+	const RegionEntry &e = entries[index];
+	if (e.codec == RC_EMPTY) {
+		err->set("Empty region slot: %d", index);
+		return nullptr;
+	}
+
+	IO::MappedFile *mf = IO::map_file(file,
+		(int64_t)e.sector * REGION_SECTOR_SIZE, e.length, err);
+	if (*err)
+		return nullptr;
+
+	if (region_checksum(mf->data) != e.checksum) {
+		err->set("Region entry checksum mismatch (slot: %d)", index);
+		delete mf;
+		return nullptr;
+	}
+
+	*codec = (RegionCodec)e.codec;
+	return mf;
+}
+
+void RegionFile::write(int index, Slice<const uint8_t> data, RegionCodec codec,
+	Error *err)
+{
+	NG_IDX_BOUNDS_CHECK(index, REGION_ENTRIES_N);
+
+	// Find the first gap which fits the payload. Sectors of the previous
+	// version of this entry are treated as occupied, the header points to them
+	// until the new payload is on the disk, so a crash in between loses
+	// nothing.
+	struct Range {
+		uint32_t begin;
+		uint32_t end;
+		bool operator<(const Range &r) const { return begin < r.begin; }
+	};
+	Range used[REGION_ENTRIES_N];
+	int used_n = 0;
+	for (const RegionEntry &e : entries) {
+		if (e.codec == RC_EMPTY)
+			continue;
+		used[used_n++] = {e.sector, e.sector + sectors_for(e.length)};
+	}
+	std::sort(used, used + used_n);
+
+	const uint32_t needed = sectors_for(data.length);
+	uint32_t sector = 1;
+	for (int i = 0; i < used_n; i++) {
+		if (used[i].begin >= sector + needed)
+			break;
+		sector = max(sector, used[i].end);
+	}
+
+	IO::write_at(file, data, (int64_t)sector * REGION_SECTOR_SIZE, err);
+	if (*err)
+		return;
+	// otherwise the header may reach the disk first and point to sectors
+	// which don't have the payload yet
+	IO::sync_file(file, err);
+	if (*err)
+		return;
+
+	RegionEntry e;
+	e.sector = sector;
+	e.length = data.length;
+	e.codec = codec;
+	e.checksum = region_checksum(data);
+
+	ByteWriter w;
+	write_entry(&w, e);
+	IO::write_at(file, w.sub(),
+		REGION_ENTRIES_OFFSET + index * REGION_ENTRY_SIZE, err);
+	if (*err)
+		return;
+
+	entries[index] = e;
+}
+
+int64_t region_locality(const Vec3i &location)
+{
+	// 19 bits per region coordinate is plenty, slot goes last
+	const Vec3i region = floor_div(location, REGION_SIZE);
+	const int index = offset_3d(location - region * REGION_SIZE, REGION_SIZE);
+	const int64_t mask = (1 << 19) - 1;
+	return
+		((region.x & mask) << 44) |
+		((region.y & mask) << 25) |
+		((region.z & mask) << 6) |
+		index;
+}
+
+RegionCache::RegionCache(const StorageConfig *config):
+	config(config), mutex(SDL_CreateMutex())
+{
+	NG_ASSERT(mutex != nullptr);
+}
+
+RegionCache::~RegionCache()
+{
+	for (auto kv : regions)
+		delete kv.value;
+	SDL_DestroyMutex(mutex);
+}
+
+RegionFile *RegionCache::region_at(const Vec3i &location, int *index,
+	bool create, Error *err)
+{
+	const Vec3i region = floor_div(location, REGION_SIZE);
+	*index = offset_3d(location - region * REGION_SIZE, REGION_SIZE);
+
+	RegionFile *rf = regions.get_or_default(region, nullptr);
+	if (rf)
+		return rf;
+
+	String filename = String::format("r.%d.%d.%d.ngr", VEC3(region));
+	String fullpath = config->directory + "/" + filename;
+	// reads of storage chunks which were never saved don't leave empty
+	// region files behind
+	if (!create && !IO::file_exists(fullpath.c_str()))
+		return nullptr;
+	rf = RegionFile::open(fullpath.c_str(), err);
+	if (*err)
+		return nullptr;
+
+	regions.insert(region, rf);
+	return rf;
+}
+
+bool RegionCache::has(const Vec3i &location, Error *err)
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	int index;
+	RegionFile *rf = region_at(location, &index, false, err);
+	if (*err || !rf)
+		return false;
+	return rf->has(index);
+}
+
+IO::MappedFile *RegionCache::map(const Vec3i &location, RegionCodec *codec,
+	Error *err)
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	int index;
+	RegionFile *rf = region_at(location, &index, false, err);
+	if (*err)
+		return nullptr;
+	if (!rf) {
+		err->set("Storage chunk (%d %d %d) isn't stored", VEC3(location));
+		return nullptr;
+	}
+	return rf->map(index, codec, err);
+}
+
+void RegionCache::write(const Vec3i &location, Slice<const uint8_t> data,
+	RegionCodec codec, Error *err)
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	int index;
+	RegionFile *rf = region_at(location, &index, true, err);
+	if (*err)
+		return;
+	rf->write(index, data, codec, err);
+}
+
+void RegionCache::sync(const Vec3i &location, Error *err)
+{
+	IO::File *file;
+	{
+		SDL_LockMutex(mutex);
+		DEFER { SDL_UnlockMutex(mutex); };
+		int index;
+		RegionFile *rf = region_at(location, &index, false, err);
+		if (*err || !rf)
+			return;
+		file = rf->file;
+	}
+	// region files are never closed before the cache is gone, no need to
+	// hold the lock during a potentially slow fsync
+	IO::sync_file(file, err);
+}
+
+} // namespace Map
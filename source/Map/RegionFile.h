@@ -0,0 +1,94 @@
+#pragma once
+
+#include "Map/Config.h"
+#include "Core/HashMap.h"
+#include "Core/Vector.h"
+#include "Core/Error.h"
+#include "OS/IO.h"
+#include <SDL2/SDL_mutex.h>
+
+namespace Map {
+
+//----------------------------------------------------------------------
+// RegionFile
+//----------------------------------------------------------------------
+
+// Region file packs REGION_SIZE storage chunks into a single file. The file
+// starts with a fixed-size header which contains an index entry for each
+// storage chunk slot, payloads follow the header and are aligned to
+// REGION_SECTOR_SIZE.
+const Vec3i REGION_SIZE(4, 4, 4);
+const int REGION_ENTRIES_N = 64; // volume(REGION_SIZE)
+const int REGION_SECTOR_SIZE = 4096;
+
+enum RegionCodec {
+	RC_EMPTY = 0,
+	RC_NGSC = 1, // legacy StorageChunk format, stored as is during migration
+	RC_NGSF = 2, // StorageChunk, see StorageChunk::serialize
+};
+
+struct RegionEntry {
+	uint32_t sector = 0; // offset in sectors, 0 means the slot is empty
+	uint32_t length = 0; // payload length in bytes
+	uint32_t codec = RC_EMPTY;
+	uint32_t checksum = 0;
+};
+
+struct RegionFile {
+	IO::File *file = nullptr;
+	RegionEntry entries[REGION_ENTRIES_N];
+
+	NG_DELETE_COPY_AND_MOVE(RegionFile);
+	RegionFile() = default;
+	~RegionFile();
+
+	// 'index' is an offset of the storage chunk within the region
+	bool has(int index) const { return entries[index].codec != RC_EMPTY; }
+	// Maps the payload of a slot into memory and verifies its checksum.
+	IO::MappedFile *map(int index, RegionCodec *codec, Error *err = &DefaultError);
+	// Syncs the payload before it updates the header entry, the entry is on
+	// the disk after the next sync of the file.
+	void write(int index, Slice<const uint8_t> data, RegionCodec codec,
+		Error *err = &DefaultError);
+
+	static RegionFile *open(const char *filename, Error *err = &DefaultError);
+};
+
+// Sort key for reads, storage chunks of the same region are next to each
+// other and are ordered by slot.
+int64_t region_locality(const Vec3i &location);
+
+//----------------------------------------------------------------------
+// RegionCache
+//----------------------------------------------------------------------
+
+// Keeps region files of a storage directory open, so that loading or saving
+// a storage chunk is a single mapping or positional write. Used by the I/O
+// workers, which may call it concurrently.
+struct RegionCache {
+	const StorageConfig *config;
+	// guards 'regions' and the entries of region files
+	SDL_mutex *mutex;
+	HashMap<Vec3i, RegionFile*> regions;
+
+	NG_DELETE_COPY_AND_MOVE(RegionCache);
+	explicit RegionCache(const StorageConfig *config);
+	~RegionCache();
+
+	// Region file and the slot index within it for a given storage chunk.
+	// Creates the file if it doesn't exist and 'create' is set, returns
+	// nullptr without an error otherwise, nothing is stored there. Returns
+	// nullptr on failure. Must be called with the mutex locked.
+	RegionFile *region_at(const Vec3i &location, int *index, bool create,
+		Error *err = &DefaultError);
+
+	bool has(const Vec3i &location, Error *err = &DefaultError);
+	IO::MappedFile *map(const Vec3i &location, RegionCodec *codec,
+		Error *err = &DefaultError);
+	void write(const Vec3i &location, Slice<const uint8_t> data,
+		RegionCodec codec, Error *err = &DefaultError);
+	// Flushes the region file of a given storage chunk to the disk.
+	void sync(const Vec3i &location, Error *err = &DefaultError);
+};
+
+} // namespace Map
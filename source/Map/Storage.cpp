@@ -1,56 +1,312 @@
 #include "Map/Storage.h"
+#include "Map/Prefetcher.h"
 #include "Core/Defer.h"
 #include "Math/Noise.h"
 #include "OS/IO.h"
+#include "Core/UniquePtr.h"
+#include "OS/Timer.h"
+#include <SDL2/SDL_atomic.h>
+#include <algorithm>
+
+namespace Map {
+
+// World file, world.ngw:
+//   "NGWF"
+//   uint32 version
+//   uint64 seed
+//   uint64 pristine generator (version 2)
+constexpr uint32_t WORLD_VERSION = 2;
+
+struct WorldFile {
+	uint64_t seed = 0;
+	// Generator::fingerprint of the generator pristine chunks are saved for
+	// (see StorageConfig::store_pristine), 0 if none were
+	uint64_t pristine_generator = 0;
+};
+
+static String world_filename(const StorageConfig *config)
+{
+	return config->directory + "/world.ngw";
+}
+
+// Worlds saved before there was a world file were all made with seed 0, they
+// are recognized by their region files or legacy storage chunks.
+static bool has_saved_storage_chunks(const StorageConfig *config)
+{
+	Error err(EV_QUIET);
+	IO::Directory *dir = IO::open_directory(config->directory.c_str(), &err);
+	if (err)
+		return false;
+	DEFER { IO::close_directory(dir); };
+	for (String name = IO::next_file(dir); name.length() > 0; name = IO::next_file(dir)) {
+		if (IO::fnmatch("*.ngr", name.c_str()) || IO::fnmatch("*.ngc", name.c_str()))
+			return true;
+	}
+	return false;
+}
+
+static void write_world(const StorageConfig *config, const WorldFile &world,
+	Error *err)
+{
+	ByteWriter w;
+	w.write_string("NGWF");
+	w.write_uint32(WORLD_VERSION);
+	w.write_uint64(world.seed);
+	w.write_uint64(world.pristine_generator);
+
+	const String filename = world_filename(config);
+	IO::File *f = IO::open_file(filename.c_str(), IO::FF_WRITE | IO::FF_CREATE, err);
+	if (*err)
+		return;
+	DEFER { IO::close_file(f); };
+	IO::truncate_file(f, 0, err);
+	if (!*err)
+		IO::write_at(f, w.sub(), 0, err);
+	if (!*err)
+		IO::sync_file(f, err);
+}
+
+static void read_world(const StorageConfig *config, WorldFile *world,
+	Error *err)
+{
+	const String filename = world_filename(config);
+	Vector<uint8_t> contents = IO::read_file(filename.c_str(), err);
+	if (*err)
+		return;
+	if (contents.length() < 4 ||
+		slice_cast<const char>(contents.sub(0, 4)) != "NGWF")
+	{
+		err->set("Bad magic, NGWF expected: %s", filename.c_str());
+		return;
+	}
+	ByteReader br(contents.sub(4));
+	const uint32_t version = br.read_uint32(err);
+	if (*err)
+		return;
+	if (version != 1 && version != WORLD_VERSION) {
+		err->set("Unsupported world version %d: %s", version, filename.c_str());
+		return;
+	}
+	world->seed = br.read_uint64(err);
+	if (version >= 2)
+		world->pristine_generator = br.read_uint64(err);
+}
+
+bool open_world(StorageConfig *config, Error *err)
+{
+	if (IO::file_exists(world_filename(config).c_str())) {
+		WorldFile world;
+		read_world(config, &world, err);
+		config->seed = world.seed;
+		return !*err;
+	}
+
+	if (has_saved_storage_chunks(config)) {
+		if (config->seed != 0)
+			warn("%s was made before worlds had seeds, using seed 0",
+				config->directory.c_str());
+		config->seed = 0;
+	}
+	String directory = config->directory;
+	IO::make_directories(directory, err);
+	if (*err)
+		return false;
+	WorldFile world;
+	world.seed = config->seed;
+	write_world(config, world, err);
+	return !*err;
+}
+
+} // namespace Map
 
 struct ELoadMapStorageChunkMessage : RTTIBase<ELoadMapStorageChunkMessage>
 {
 	// in
 	const Map::StorageConfig *config;
+	Map::RegionCache *regions;
 	Vec3i location;
+	// set by the main thread, the read is skipped if the load is cancelled
+	// by the time it starts
+	SDL_atomic_t cancelled = {0};
 	// tmp
-	Vector<uint8_t> contents;
+	UniquePtr<IO::MappedFile> contents;
 	// out
 	Error err;
+	bool skipped = false;
 	Map::StorageChunk chunk = Map::StorageChunk(Vec3i(0));
+	// saved without some of its pristine chunks, by that generator
+	bool has_pristine = false;
+	uint64_t generator = 0;
 };
 
 struct ESaveMapStorageChunkMessage : RTTIBase<ESaveMapStorageChunkMessage>
 {
 	// in
 	const Map::StorageConfig *config;
-	Map::StorageChunk *storage_chunk;
+	Map::RegionCache *regions;
+	Map::StorageChunkSnapshot snapshot;
+	// pristine generator of the world file at the moment
+	uint64_t world_generator = 0;
+	// out
+	bool recorded_generator = false;
+	int64_t bytes = 0;
+	double encode_time = 0;
+	double write_time = 0;
+};
+
+// Payloads are decoded on a worker, the fields are stored into the chunks on
+// the main thread, like the lods of EBuildMapChunkLodsMessage.
+struct EUnpackMapChunksMessage : RTTIBase<EUnpackMapChunksMessage>
+{
+	// in
+	Vec3i location;
+	Vector<int> indices;
+	Vector<Slice<const uint8_t>> payloads;
+	// out
+	Vector<Map::FieldRef> fields; // LODS_N per chunk
+	Vector<int> failed;
+};
+
+// Lods reduced on demand, see Storage::queue_build_lod. Sources are taken on
+// the main thread and results are stored there, the chunks stay readable at
+// other lods meanwhile.
+struct EBuildMapChunkLodsMessage : RTTIBase<EBuildMapChunkLodsMessage>
+{
+	struct Build {
+		int index;
+		int lod;
+		int source_lod;
+		Map::FieldRef source;
+		// out
+		Map::FieldRef field;
+	};
+	Vec3i location;
+	Vector<Build> builds;
 };
 
 static void save_storage_chunk(RTTIObject *data)
 {
 	ESaveMapStorageChunkMessage *msg = ESaveMapStorageChunkMessage::cast(data);
-	msg->storage_chunk->save(*msg->config);
-	printf("Saved chunk %d %d %d\n", VEC3(msg->storage_chunk->location));
+	Timer t;
+	ByteWriter w;
+	msg->snapshot.serialize(&w);
+	msg->encode_time = t.delta();
+	// the world file says which generator makes pristine chunks again before
+	// the first storage chunk which relies on it is written
+	uint64_t generator;
+	if (Map::read_pristine_generator(w.sub(), &generator) &&
+		generator != msg->world_generator)
+	{
+		Map::WorldFile world;
+		world.seed = msg->config->seed;
+		world.pristine_generator = generator;
+		Error err(EV_QUIET);
+		Map::write_world(msg->config, world, &err);
+		if (err)
+			warn("Failed to write the world file: %s", err.description());
+		else
+			msg->recorded_generator = true;
+	}
+	msg->regions->write(msg->snapshot.location, w.sub(), Map::RC_NGSF);
+	msg->regions->sync(msg->snapshot.location);
+	msg->write_time = t.delta();
+	msg->bytes = w.data.length();
+	printf("Saved chunk %d %d %d\n", VEC3(msg->snapshot.location));
+}
+
+static void unpack_chunks(RTTIObject *data)
+{
+	EUnpackMapChunksMessage *msg = EUnpackMapChunksMessage::cast(data);
+	msg->fields.resize(msg->indices.length() * LODS_N);
+	for (int i = 0; i < msg->indices.length(); i++) {
+		Error err(EV_QUIET);
+		Map::Chunk c;
+		Map::unpack_chunk(&c, msg->payloads[i], &err);
+		if (err)
+			msg->failed.append(msg->indices[i]);
+		for (int j = 0; j < LODS_N; j++)
+			msg->fields[i * LODS_N + j] = std::move(c.lods[j]);
+	}
+}
+
+// Storage chunks used to live in separate files, if there is one and the region
+// doesn't have the storage chunk yet, move it to the region.
+static void migrate_legacy_storage_chunk(const Map::StorageConfig *config,
+	Map::RegionCache *regions, const Vec3i &location, Error *err)
+{
+	String filename = String::format("%d_%d_%d.ngc", VEC3(location));
+	String fullpath = config->directory + "/" + filename;
+	if (!IO::file_exists(fullpath.c_str())) {
+		err->set("Storage chunk (%d %d %d) doesn't exist", VEC3(location));
+		return;
+	}
+
+	Vector<uint8_t> contents = IO::read_file(fullpath.c_str(), err);
+	if (*err)
+		return;
+
+	regions->write(location, contents, Map::RC_NGSC, err);
+	if (*err)
+		return;
+	// the region has to keep it before the only other copy is gone
+	regions->sync(location, err);
+	if (*err)
+		return;
+
+	Error rmerr;
+	IO::remove_file(fullpath.c_str(), &rmerr);
+	printf("Migrated %s to a region file\n", filename.c_str());
 }
 
 static void load_storage_chunk(RTTIObject *data)
 {
 	ELoadMapStorageChunkMessage *msg = ELoadMapStorageChunkMessage::cast(data);
-	String filename = String::format("%d_%d_%d.ngc", VEC3(msg->location));
-	String fullpath = msg->config->directory + "/" + filename;
 	msg->err = Error(EV_QUIET);
-	msg->contents = IO::read_file(fullpath.c_str(), &msg->err);
+	if (SDL_AtomicGet(&msg->cancelled)) {
+		msg->skipped = true;
+		return;
+	}
+
+	const bool has = msg->regions->has(msg->location, &msg->err);
+	if (msg->err)
+		return;
+
+	if (!has) {
+		migrate_legacy_storage_chunk(msg->config, msg->regions,
+			msg->location, &msg->err);
+		if (msg->err)
+			return;
+	}
+
+	// the payload is decoded on a CPU worker directly from the mapping
+	Map::RegionCodec codec;
+	msg->contents.reset(msg->regions->map(msg->location, &codec, &msg->err));
 }
 
-static void generate_chunk_lods(RTTIObject *data)
+static void decode_storage_chunk(RTTIObject *data)
 {
 	ELoadMapStorageChunkMessage *msg = ELoadMapStorageChunkMessage::cast(data);
 	msg->chunk = Map::StorageChunk::new_from_buffer(
-		msg->location, msg->contents, &msg->err);
+		msg->location, msg->contents->data, &msg->err);
+	msg->has_pristine = Map::read_pristine_generator(msg->contents->data,
+		&msg->generator);
+	msg->contents = nullptr;
 	if (msg->err)
 		return;
 
 	for (Map::Chunk &c : msg->chunk.chunks) {
-		c.generate_lod_fields();
+		if (!(c.flags & Map::MCF_PACKED))
+			c.reset_lods();
 	}
 }
 
+static void build_chunk_lods(RTTIObject *data)
+{
+	EBuildMapChunkLodsMessage *msg = EBuildMapChunkLodsMessage::cast(data);
+	for (EBuildMapChunkLodsMessage::Build &b : msg->builds)
+		b.field = Map::reduce_lod_field(*b.source, b.source_lod, b.lod);
+}
+
 EMapStorageRequest::EMapStorageRequest(RTTIObject *sender,
 	const Vec3i &location, const Vec3i &size, int lods[8],
 	MapStorageRequestType type):
@@ -73,12 +329,12 @@ EMapStorageRequest::~EMapStorageRequest()
 		break;
 	}
 	map_storage->release_storage_chunks(*this);
-	map_storage->dirty = true;
 }
 
 namespace Map {
 
-constexpr int64_t SAVE_INTERVAL = 30; // seconds
+// speculative loads go after everything requested
+constexpr int PREFETCH_PRIORITY = 1 << 24;
 
 Vec3i Storage::storage_chunk_location(const Vec3i &location) const
 {
@@ -97,36 +353,215 @@ Vec3i Storage::chunk_internal_offset(const Vec3i &location) const
 	return location - loc * STORAGE_CHUNK_SIZE;
 }
 
+void Storage::queue_save_storage_chunk(StorageChunk &msc)
+{
+	dirty_storage_chunks--;
+	msc.dirty = false;
+	msc.last_sync = local_time_seconds;
+
+	auto msg = new (OrDie) ESaveMapStorageChunkMessage;
+	msg->config = config;
+	msg->regions = &regions;
+	msg->snapshot = msc.snapshot();
+	msg->snapshot.store_lods = config->store_lods;
+	msg->snapshot.store_pristine = config->store_pristine;
+	msg->snapshot.generator = generator_fingerprint;
+	msg->world_generator = world_generator;
+	// the snapshot has all the writes so far
+	if (const int64_t *write = unsaved_writes.get(msc.location)) {
+		saving_writes.insert(msc.location, *write);
+		unsaved_writes.remove(msc.location);
+	}
+
+	EWorkerTask wt;
+	wt.data = msg;
+	wt.execute = save_storage_chunk;
+	wt.finalize = fire_and_delete_finalizer<EID_MAP_STORAGE_CHUNK_SAVED>;
+	NG_EventManager->fire(EID_QUEUE_IO_TASK, &wt);
+	msc.flags |= MSCF_SAVING;
+	pending_saves++;
+}
+
 void Storage::update_storage_chunks()
 {
 	for (auto kv : storage_chunks)
 	{
 		StorageChunk &msc = kv.value;
-		const bool can_save = msc.write_reqs == 0;
+		// one save at a time, the snapshot of the previous one might still
+		// refer to the packed payloads
+		const bool can_save = msc.write_reqs == 0 && !(msc.flags & MSCF_SAVING);
 		const bool needs_save = msc.dirty &&
-			((local_time_seconds - msc.last_sync > SAVE_INTERVAL) || force_save);
-		if (needs_save && can_save) {
-			dirty_storage_chunks--;
-			msc.dirty = false;
-			msc.last_sync = local_time_seconds;
-
-			auto msg = new (OrDie) ESaveMapStorageChunkMessage;
-			msg->config = config;
-			msg->storage_chunk = &msc;
-
-			EWorkerTask wt;
-			wt.data = msg;
-			wt.execute = save_storage_chunk;
-			wt.finalize = fire_and_delete_finalizer<EID_MAP_STORAGE_CHUNK_SAVED>;
-			NG_EventManager->fire(EID_QUEUE_IO_TASK, &wt);
-			msc.flags |= MSCF_SAVING;
-			pending_saves++;
+			((local_time_seconds - msc.last_sync > config->save_interval) || force_save);
+		if (needs_save && can_save)
+			queue_save_storage_chunk(msc);
+	}
+	evict_storage_chunks();
+}
+
+void Storage::update_memory_usage()
+{
+	for (int i = 0; i < LODS_N; i++) {
+		resident_lod_bytes[i] = 0;
+		resident_lod_chunks[i] = 0;
+	}
+	resident_packed_bytes = 0;
+	for (auto kv : storage_chunks) {
+		StorageChunk &msc = kv.value;
+		if (msc.memory_dirty)
+			msc.update_memory_usage();
+		for (int i = 0; i < LODS_N; i++) {
+			resident_lod_bytes[i] += msc.lod_bytes[i];
+			resident_lod_chunks[i] += msc.lod_chunks[i];
+		}
+		resident_packed_bytes += msc.packed_bytes;
+	}
+}
+
+int64_t Storage::resident_bytes() const
+{
+	int64_t total = resident_packed_bytes;
+	for (int i = 0; i < LODS_N; i++)
+		total += resident_lod_bytes[i];
+	return total;
+}
+
+void Storage::evict_storage_chunks()
+{
+	update_memory_usage();
+	int64_t excess = resident_bytes() - config->memory_budget;
+	if (excess <= 0)
+		return;
+
+	struct Candidate {
+		int64_t last_request;
+		Vec3i location;
+		bool operator<(const Candidate &r) const { return last_request < r.last_request; }
+	};
+	Vector<Candidate> candidates;
+	for (auto kv : storage_chunks) {
+		StorageChunk &msc = kv.value;
+		if (msc.read_reqs != 0 || msc.write_reqs != 0)
+			continue;
+		if (msc.flags & (MSCF_LOADING | MSCF_SAVING))
+			continue;
+		if (!msc.is_idle())
+			continue;
+		candidates.append({msc.last_request, msc.location});
+	}
+	std::sort(candidates.data(), candidates.data() + candidates.length());
+
+	// reduced lods go first, they are built again from lod 0 when needed
+	bool dropped = false;
+	for (const Candidate &c : candidates) {
+		if (excess <= 0)
+			break;
+
+		StorageChunk *msc = storage_chunks.get(c.location);
+		const int64_t before = msc->memory_usage();
+		const int n = msc->drop_lods();
+		if (n == 0)
+			continue;
+		msc->update_memory_usage();
+		excess -= before - msc->memory_usage();
+		dropped_lods += n;
+		dropped = true;
+	}
+	if (dropped)
+		update_memory_usage();
+	if (excess <= 0)
+		return;
+
+	for (const Candidate &c : candidates) {
+		if (excess <= 0)
+			break;
+
+		StorageChunk *msc = storage_chunks.get(c.location);
+		// Dirty ones have to hit the disk first, they'll be evicted on the next
+		// round if they are still unused.
+		if (msc->dirty) {
+			queue_save_storage_chunk(*msc);
+			excess -= msc->memory_usage();
+			continue;
 		}
+
+		excess -= msc->memory_usage();
+		if (msc->flags & MSCF_SPECULATIVE)
+			prefetch_wasted++;
+		for (int i = 0; i < LODS_N; i++)
+			resident_lod_bytes[i] -= msc->lod_bytes[i];
+		resident_packed_bytes -= msc->packed_bytes;
+		forget_storage_chunk(c.location);
+		storage_chunks.remove(c.location);
+		evicted_storage_chunks++;
 	}
 }
 
+// Pending requests keep pointers to the chunks they have found so far, drop
+// the ones which belong to the storage chunk, they will be looked up again.
+void Storage::forget_storage_chunk(const Vec3i &location)
+{
+	const Vec3i min = location * STORAGE_CHUNK_SIZE;
+	const Vec3i max = min + STORAGE_CHUNK_SIZE - Vec3i(1);
+	for (EMapStorageRequest *req : requests) {
+		const Vec3i req_max = req->location + req->size - Vec3i(1);
+		if (req_max.x < min.x || req_max.y < min.y || req_max.z < min.z ||
+			req->location.x > max.x || req->location.y > max.y ||
+			req->location.z > max.z)
+			continue;
+
+		for (int z = 0; z < req->size.z; z++) {
+		for (int y = 0; y < req->size.y; y++) {
+		for (int x = 0; x < req->size.x; x++) {
+			const Vec3i pos(x, y, z);
+			if (storage_chunk_location(req->location + pos) == location)
+				req->chunks[offset_3d(pos, req->size)] = nullptr;
+		}}}
+		make_ready(req);
+	}
+	wake_requests(location);
+}
+
+void Storage::print_memory_usage()
+{
+	update_memory_usage();
+	printf("Map storage: %d storage chunks, %d evicted, budget: %.1f MB\n",
+		storage_chunks.length(), evicted_storage_chunks,
+		config->memory_budget / (1024.0 * 1024.0));
+	for (int i = 0; i < LODS_N; i++) {
+		printf("  lod %d: %.1f MB, %d non-uniform chunks, %lld built on demand\n",
+			i, resident_lod_bytes[i] / (1024.0 * 1024.0), resident_lod_chunks[i],
+			(long long)built_lods[i]);
+	}
+	printf("  %lld lods dropped under memory pressure\n", (long long)dropped_lods);
+	printf("  packed: %.1f MB\n", resident_packed_bytes / (1024.0 * 1024.0));
+	print_field_pool_stats();
+}
+
+void Storage::print_request_stats()
+{
+	printf("Map storage requests: %d pending, %d ready, %lld positions scanned, "
+		"%lld skipped\n",
+		requests.length(), ready_requests.length(),
+		(long long)scanned_positions, (long long)skipped_positions);
+}
+
+void Storage::print_prefetch_stats()
+{
+	printf("Map storage prefetch: %d issued, %d pending, %d hits, %d misses, "
+		"%d cancelled, %d wasted\n",
+		prefetch_issued, prefetches.length(), prefetch_hits, prefetch_misses,
+		prefetch_cancelled, prefetch_wasted);
+}
+
+// see EMapStorageRequest::lods
+static int request_octant(const Vec3i &pos)
+{
+	return ((pos.z > 0) << 2) | ((pos.y > 0) << 1) | (pos.x > 0);
+}
+
 void Storage::update(double delta)
 {
+	NG_ASSERT(opened);
 	local_time += delta;
 	if (local_time >= 1.0) {
 		local_time_seconds++;
@@ -134,11 +569,20 @@ void Storage::update(double delta)
 		update_storage_chunks();
 	}
 
-	if (!dirty)
+	ticks++;
+	if (ready_requests.length() == 0)
 		return;
 
-	for (int i = 0; i < requests.length();) {
-		EMapStorageRequest *req = requests[i];
+	// everything else would have been looked at by a full rescan
+	for (EMapStorageRequest *req : requests) {
+		if (!req->ready)
+			skipped_positions += volume(req->size);
+	}
+
+	Vector<EMapStorageRequest*> ready = std::move(ready_requests);
+	for (EMapStorageRequest *req : ready) {
+		req->ready = false;
+		scanned_positions += volume(req->size);
 		const Vec3i origin = req->location;
 		bool complete = true;
 
@@ -152,7 +596,7 @@ void Storage::update(double delta)
 				continue;
 			}
 
-			if (location.y < 0 || location.y >= 16) {
+			if (!chunk_in_world(location)) {
 				continue;
 			}
 
@@ -161,24 +605,41 @@ void Storage::update(double delta)
 			StorageChunk *msc = storage_chunks.get(storage_loc);
 			if (!msc) {
 				msc = storage_chunks.insert(storage_loc, StorageChunk(storage_loc));
-				queue_load_storage_chunk(storage_loc);
+				queue_load_storage_chunk(storage_loc, req->priority);
+				prefetch_misses++;
+				wait_for(req, storage_loc);
 				complete = false;
 				continue;
 			}
 
+			msc->last_request = ticks;
+			if (msc->flags & MSCF_SPECULATIVE) {
+				msc->flags &= ~MSCF_SPECULATIVE;
+				prefetch_hits++;
+				ELoadMapStorageChunkMessage **pending = prefetches.get(storage_loc);
+				if (pending)
+					SDL_AtomicSet(&(*pending)->cancelled, 0);
+			}
 			if (msc->flags & MSCF_LOADING) {
+				wait_for(req, storage_loc);
 				complete = false;
 				continue;
 			}
 
-			// cannot satisfy write requests while saving
-			if (req->type == MSRT_WRITE && (msc->flags & MSCF_SAVING)) {
+			const int index = offset_3d(offset, STORAGE_CHUNK_SIZE);
+			Chunk &mc = msc->chunks[index];
+			if (mc.flags & MCF_PACKED) {
+				if (is_pristine_payload(msc->packed_payload(index)))
+					generate_pristine_chunk(msc, index);
+				else if (!(mc.flags & MCF_UNPACKING))
+					queue_unpack_chunk(msc, index);
+				wait_for(req, storage_loc);
 				complete = false;
 				continue;
 			}
 
-			Chunk &mc = msc->chunks[offset_3d(offset, STORAGE_CHUNK_SIZE)];
 			if (mc.flags & MCF_GENERATING) {
+				wait_for(req, storage_loc);
 				complete = false;
 				continue;
 			}
@@ -187,6 +648,14 @@ void Storage::update(double delta)
 			switch (req->type) {
 			case MSRT_READ:
 				if (mc.writer) {
+					wait_for(req, storage_loc);
+					complete = false;
+					continue;
+				}
+				if (!mc.has_lod(req->lods[request_octant(pos)])) {
+					if (!(mc.flags & MCF_BUILDING_LOD))
+						queue_build_lod(msc, index, req->lods[request_octant(pos)]);
+					wait_for(req, storage_loc);
 					complete = false;
 					continue;
 				}
@@ -195,6 +664,7 @@ void Storage::update(double delta)
 				break;
 			case MSRT_WRITE:
 				if (mc.readers > 0) {
+					wait_for(req, storage_loc);
 					complete = false;
 					continue;
 				}
@@ -204,6 +674,13 @@ void Storage::update(double delta)
 			}
 		}}}
 		if (complete) {
+			stop_waiting(req);
+			for (int i = 0; i < requests.length(); i++) {
+				if (requests[i] == req) {
+					requests.quick_remove(i);
+					break;
+				}
+			}
 			for (Chunk *mc : req->chunks) {
 				if (!mc)
 					continue;
@@ -213,21 +690,35 @@ void Storage::update(double delta)
 					break;
 				case MSRT_WRITE:
 					mc->writer = true;
+					mc->flags &= ~MCF_PRISTINE;
 					break;
 				}
 			}
 			grab_storage_chunks(*req);
 			NG_EventManager->fire(EID_MAP_STORAGE_RESPONSE, req, req->sender);
-			requests.quick_remove(i);
-		} else {
-			i++;
 		}
 	}
 
-	dirty = false;
+	for (EUnpackMapChunksMessage *msg : unpack_batches) {
+		EWorkerTask task;
+		task.data = msg;
+		task.execute = unpack_chunks;
+		task.finalize = fire_and_delete_finalizer<EID_MAP_CHUNKS_UNPACKED>;
+		NG_EventManager->fire(EID_QUEUE_CPU_TASK, &task);
+	}
+	unpack_batches.clear();
+
+	for (EBuildMapChunkLodsMessage *msg : lod_batches) {
+		EWorkerTask task;
+		task.data = msg;
+		task.execute = build_chunk_lods;
+		task.finalize = fire_and_delete_finalizer<EID_MAP_CHUNK_LODS_BUILT>;
+		NG_EventManager->fire(EID_QUEUE_CPU_TASK, &task);
+	}
+	lod_batches.clear();
 }
 
-Storage::Storage(const StorageConfig *config): config(config)
+Storage::Storage(const StorageConfig *config): config(config), regions(config)
 {
 	NG_EventManager->register_handler(EID_MAP_STORAGE_CHUNK_SAVED,
 		PASS_TO_METHOD(Storage, handle_map_storage_chunk_saved),
@@ -238,12 +729,27 @@ Storage::Storage(const StorageConfig *config): config(config)
 	NG_EventManager->register_handler(EID_MAP_STORAGE_CHUNK_LOADED,
 		PASS_TO_METHOD(Storage, handle_map_storage_chunk_loaded),
 		this, false);
+	NG_EventManager->register_handler(EID_MAP_CHUNKS_UNPACKED,
+		PASS_TO_METHOD(Storage, handle_map_chunks_unpacked),
+		this, false);
+	NG_EventManager->register_handler(EID_MAP_CHUNK_LODS_BUILT,
+		PASS_TO_METHOD(Storage, handle_map_chunk_lods_built),
+		this, false);
 	NG_EventManager->register_handler(EID_MAP_CHUNK_GENERATED,
 		PASS_TO_METHOD(Storage, handle_map_chunk_generated),
 		this, false);
+	NG_EventManager->register_handler(EID_MAP_CHUNKS_GENERATED,
+		PASS_TO_METHOD(Storage, handle_map_chunks_generated),
+		this, false);
+	NG_EventManager->register_handler(EID_MAP_GENERATOR_CHANGED,
+		PASS_TO_METHOD(Storage, handle_map_generator_changed),
+		this, false);
 	NG_EventManager->register_handler(EID_MAP_STORAGE_REQUEST,
 		PASS_TO_METHOD(Storage, handle_map_storage_request),
 		this, false);
+	NG_EventManager->register_handler(EID_MAP_STORAGE_PREFETCH,
+		PASS_TO_METHOD(Storage, handle_map_storage_prefetch),
+		this, false);
 }
 
 Storage::~Storage()
@@ -251,6 +757,29 @@ Storage::~Storage()
 	NG_EventManager->unregister_handlers(this);
 }
 
+bool Storage::open(Error *err)
+{
+	WorldFile world;
+	if (IO::file_exists(world_filename(config).c_str())) {
+		read_world(config, &world, err);
+		if (*err)
+			return false;
+	}
+	if (world.pristine_generator != 0 &&
+		world.pristine_generator != generator_fingerprint)
+	{
+		err->set("%s has pristine chunks of another generator (saved: "
+			"%016llx, current: %016llx), open it with the terrain it was "
+			"made with", config->directory.c_str(),
+			(unsigned long long)world.pristine_generator,
+			(unsigned long long)generator_fingerprint);
+		return false;
+	}
+	world_generator = world.pristine_generator;
+	opened = true;
+	return true;
+}
+
 static void grab_release_storage_chunks(Storage &storage,
 	const EMapStorageRequest &req, bool grab)
 {
@@ -274,12 +803,18 @@ static void grab_release_storage_chunks(Storage &storage,
 				if (!sc->dirty)
 					storage.dirty_storage_chunks++;
 				sc->dirty = true;
+				sc->memory_dirty = true;
+				if (!storage.unsaved_writes.get(addr))
+					storage.unsaved_writes.insert(addr, storage.writes);
 			}
 			break;
 		case MSRT_READ:
 			sc->read_reqs += diff;
 			break;
 		}
+		// readers or the writer are gone
+		if (!grab)
+			storage.wake_requests(addr);
 	}}}
 }
 
@@ -292,74 +827,252 @@ void Storage::grab_storage_chunks(const EMapStorageRequest &req)
 void Storage::release_storage_chunks(const EMapStorageRequest &req)
 {
 	grab_release_storage_chunks(*this, req, false);
+	if (req.type == MSRT_WRITE)
+		writes++;
 	requests_alive--;
 }
 
+void Storage::update_saved_writes()
+{
+	saved_writes = writes;
+	for (auto kv : unsaved_writes)
+		saved_writes = min(saved_writes, kv.value);
+	for (auto kv : saving_writes)
+		saved_writes = min(saved_writes, kv.value);
+}
+
 bool Storage::can_quit()
 {
 	return (requests.length() == 0) &&
 		(pending_saves == 0) &&
 		(requests_alive == 0) &&
+		(prefetches.length() == 0) &&
 		(dirty_storage_chunks == 0);
 }
 
+void Storage::handle_map_storage_prefetch(RTTIObject *event)
+{
+	EMapStoragePrefetch *msg = EMapStoragePrefetch::cast(event);
+
+	// cancel speculative loads which are off the trajectory now, unless
+	// something has requested them in the meantime
+	for (auto kv : prefetches) {
+		const StorageChunk *msc = storage_chunks.get(kv.key);
+		if (!(msc->flags & MSCF_SPECULATIVE))
+			continue;
+		bool wanted = false;
+		for (const Vec3i &l : msg->locations) {
+			if (l == kv.key) {
+				wanted = true;
+				break;
+			}
+		}
+		SDL_AtomicSet(&kv.value->cancelled, wanted ? 0 : 1);
+	}
+
+	for (int i = 0; i < msg->locations.length(); i++) {
+		const Vec3i &location = msg->locations[i];
+		if (!storage_chunk_in_world(location))
+			continue;
+		if (storage_chunks.get(location))
+			continue;
+
+		StorageChunk *msc = storage_chunks.insert(location, StorageChunk(location));
+		msc->flags |= MSCF_SPECULATIVE;
+		msc->last_request = ticks;
+		prefetches.insert(location,
+			queue_load_storage_chunk(location, PREFETCH_PRIORITY + i));
+		prefetch_issued++;
+	}
+}
+
 void Storage::handle_map_storage_request(RTTIObject *event)
 {
 	EMapStorageRequest *msg = EMapStorageRequest::cast(event);
 	msg->map_storage = this;
 	requests.append(msg);
-	dirty = true;
+	make_ready(msg);
 }
 
-void Storage::handle_map_chunk_generated(RTTIObject *event)
+void Storage::store_generated_chunk(StorageChunk *msc, const Vec3i &location,
+	FieldRef *fields)
 {
-	EMapChunkGenerated *msg = EMapChunkGenerated::cast(event);
-	StorageChunk *msc = storage_chunk_at(msg->location);
-
-	const Vec3i lpos = chunk_internal_offset(msg->location);
+	const Vec3i lpos = chunk_internal_offset(location);
 	Chunk &mc = msc->chunks[offset_3d(lpos, STORAGE_CHUNK_SIZE)];
 	for (int i = 0; i < LODS_N; i++)
-		mc.lods[i] = std::move(msg->fields[i]);
+		mc.lods[i] = std::move(fields[i]);
 	mc.flags &= ~MCF_GENERATING;
+	mc.flags |= MCF_PRISTINE;
 
+	msc->memory_dirty = true;
+	// it can be generated again, nothing to save
+	if (!config->store_pristine)
+		return;
+	if (!msc->dirty)
+		dirty_storage_chunks++;
 	msc->dirty = true;
-	dirty = true;
+}
+
+void Storage::handle_map_chunk_generated(RTTIObject *event)
+{
+	EMapChunkGenerated *msg = EMapChunkGenerated::cast(event);
+	StorageChunk *msc = storage_chunk_at(msg->location);
+	store_generated_chunk(msc, msg->location, msg->fields);
+	wake_requests(msc->location);
+}
+
+void Storage::handle_map_chunks_generated(RTTIObject *event)
+{
+	EMapChunksGenerated *msg = EMapChunksGenerated::cast(event);
+	const Vec3i min_storage = storage_chunk_location(msg->location);
+	const Vec3i max_storage = storage_chunk_location(
+		msg->location + msg->size - Vec3i(1));
+	for (int i = 0, n = volume(msg->size); i < n; i++) {
+		const Vec3i location = msg->location + offset_to_3d(i, msg->size);
+		store_generated_chunk(storage_chunk_at(location), location,
+			&msg->fields[i * LODS_N]);
+	}
+	for (int z = min_storage.z; z <= max_storage.z; z++) {
+	for (int y = min_storage.y; y <= max_storage.y; y++) {
+	for (int x = min_storage.x; x <= max_storage.x; x++) {
+		wake_requests(Vec3i(x, y, z));
+	}}}
+}
+
+// Packed payloads are referenced by unpack tasks and by snapshots of
+// pending saves, release them once nobody needs them.
+static void release_packed(StorageChunk *msc)
+{
+	if (msc->packed_n == 0 && !(msc->flags & MSCF_SAVING)) {
+		msc->packed = Vector<uint8_t>();
+		msc->packed_fields = Vector<PackedField>();
+		msc->memory_dirty = true;
+	}
 }
 
 void Storage::handle_map_storage_chunk_saved(RTTIObject *data)
 {
 	ESaveMapStorageChunkMessage *msg = ESaveMapStorageChunkMessage::cast(data);
-	msg->storage_chunk->flags &= ~MSCF_SAVING;
+	StorageChunk *msc = storage_chunks.get(msg->snapshot.location);
+	msc->flags &= ~MSCF_SAVING;
+	release_packed(msc);
 	pending_saves--;
-	dirty = true;
+	if (msg->recorded_generator)
+		world_generator = msg->snapshot.generator;
+	saved_storage_chunks++;
+	saved_bytes += msg->bytes;
+	save_encode_time += msg->encode_time;
+	save_write_time += msg->write_time;
+
+	saving_writes.remove(msc->location);
+	const int64_t last_saved_writes = saved_writes;
+	update_saved_writes();
+	if (saved_writes != last_saved_writes)
+		NG_EventManager->fire(EID_MAP_STORAGE_CHECKPOINT, this);
+}
+
+void Storage::handle_map_chunks_unpacked(RTTIObject *data)
+{
+	EUnpackMapChunksMessage *msg = EUnpackMapChunksMessage::cast(data);
+	StorageChunk *msc = storage_chunks.get(msg->location);
+	for (int i = 0; i < msg->indices.length(); i++) {
+		Chunk &mc = msc->chunks[msg->indices[i]];
+		for (int j = 0; j < LODS_N; j++)
+			mc.lods[j] = std::move(msg->fields[i * LODS_N + j]);
+		mc.flags &= ~(MCF_PACKED | MCF_UNPACKING);
+		msc->packed_n--;
+	}
+	msc->memory_dirty = true;
+	for (int index : msg->failed) {
+		const Vec3i p = offset_to_3d(index, STORAGE_CHUNK_SIZE);
+		warn("Failed to unpack chunk (%d %d %d), regenerating",
+			VEC3(msg->location * STORAGE_CHUNK_SIZE + p));
+		msc->chunks[index].flags |= MCF_GENERATING;
+		EGenerateMapChunkRequest req;
+		req.location = msg->location * STORAGE_CHUNK_SIZE + p;
+		NG_EventManager->fire(EID_GENERATE_MAP_CHUNK_REQUEST, &req);
+	}
+	release_packed(msc);
+	wake_requests(msg->location);
+}
+
+void Storage::handle_map_generator_changed(RTTIObject *event)
+{
+	EMapGeneratorChanged *msg = EMapGeneratorChanged::cast(event);
+	generator_fingerprint = msg->fingerprint;
+}
+
+void Storage::handle_map_chunk_lods_built(RTTIObject *data)
+{
+	EBuildMapChunkLodsMessage *msg = EBuildMapChunkLodsMessage::cast(data);
+	StorageChunk *msc = storage_chunks.get(msg->location);
+	for (EBuildMapChunkLodsMessage::Build &b : msg->builds) {
+		Chunk &mc = msc->chunks[b.index];
+		mc.flags &= ~MCF_BUILDING_LOD;
+		// written in the meantime, requests will ask for the lod again
+		if (mc.lods[b.source_lod] != b.source)
+			continue;
+		mc.lods[b.lod] = std::move(b.field);
+		built_lods[b.lod]++;
+	}
+	msc->memory_dirty = true;
+	wake_requests(msg->location);
 }
 
 void Storage::handle_map_storage_chunk_loaded(RTTIObject *event)
 {
 	ELoadMapStorageChunkMessage *msg = ELoadMapStorageChunkMessage::cast(event);
 	StorageChunk &msc = storage_chunks[msg->location];
+	// Pristine chunks of another generator would not match their stored
+	// neighbours. Storage::open refuses such worlds, this catches storage
+	// chunks saved before the world file recorded the generator.
+	if (!msg->err && msg->has_pristine &&
+		msg->generator != generator_fingerprint)
+	{
+		warn("Storage chunk (%d %d %d) has pristine chunks of another "
+			"generator (saved: %016llx, current: %016llx), generating it "
+			"again", VEC3(msg->location), (unsigned long long)msg->generator,
+			(unsigned long long)generator_fingerprint);
+		msg->err.set();
+	}
 	if (!msg->err) {
+		const uint8_t flags = msc.flags;
+		const int64_t last_request = msc.last_request;
 		msc = std::move(msg->chunk);
+		msc.flags = flags;
+		msc.last_request = last_request;
 	} else {
-		for (int x = 0; x < STORAGE_CHUNK_SIZE.x; x++) {
-		for (int y = 0; y < STORAGE_CHUNK_SIZE.y; y++) {
-		for (int z = 0; z < STORAGE_CHUNK_SIZE.z; z++) {
-			const Vec3i p(x, y, z);
-			const Vec3i loc = msg->location * STORAGE_CHUNK_SIZE + p;
-			Chunk &mc = msc.chunks[offset_3d(p, STORAGE_CHUNK_SIZE)];
+		for (Chunk &mc : msc.chunks)
 			mc.flags |= MCF_GENERATING;
-			EGenerateMapChunkRequest req;
-			req.location = loc;
-			NG_EventManager->fire(EID_GENERATE_MAP_CHUNK_REQUEST, &req);
-		}}}
+		EGenerateMapChunksRequest req;
+		req.location = msg->location * STORAGE_CHUNK_SIZE;
+		req.size = STORAGE_CHUNK_SIZE;
+		NG_EventManager->fire(EID_GENERATE_MAP_CHUNKS_REQUEST, &req);
 	}
 	msc.flags &= ~MSCF_LOADING;
-	dirty = true;
+	wake_requests(msg->location);
 }
 
 void Storage::handle_map_storage_chunk_preloaded(RTTIObject *event)
 {
 	ELoadMapStorageChunkMessage *msg = ELoadMapStorageChunkMessage::cast(event);
+	prefetches.remove(msg->location);
+	if (msg->skipped) {
+		StorageChunk *msc = storage_chunks.get(msg->location);
+		if (SDL_AtomicGet(&msg->cancelled)) {
+			storage_chunks.remove(msg->location);
+			prefetch_cancelled++;
+		} else {
+			// wanted again after the read was skipped
+			const bool speculative = msc->flags & MSCF_SPECULATIVE;
+			auto retry = queue_load_storage_chunk(msg->location,
+				speculative ? PREFETCH_PRIORITY : 0);
+			if (speculative)
+				prefetches.insert(msg->location, retry);
+		}
+		delete msg;
+		return;
+	}
 	if (msg->err) {
 		handle_map_storage_chunk_loaded(event);
 		return;
@@ -369,22 +1082,146 @@ void Storage::handle_map_storage_chunk_preloaded(RTTIObject *event)
 
 	EWorkerTask task;
 	task.data = event;
-	task.execute = generate_chunk_lods;
+	task.execute = decode_storage_chunk;
 	task.finalize = fire_and_delete_finalizer<EID_MAP_STORAGE_CHUNK_LOADED>;
 	NG_EventManager->fire(EID_QUEUE_CPU_TASK, &task);
 }
 
-void Storage::queue_load_storage_chunk(const Vec3i &location)
+void Storage::make_ready(EMapStorageRequest *req)
+{
+	if (req->ready)
+		return;
+	req->ready = true;
+	ready_requests.append(req);
+}
+
+void Storage::wait_for(EMapStorageRequest *req, const Vec3i &location)
+{
+	for (const Vec3i &l : req->blocked_on) {
+		if (l == location)
+			return;
+	}
+	req->blocked_on.append(location);
+	Vector<EMapStorageRequest*> *list = waiters.get(location);
+	if (!list)
+		list = waiters.insert(location, Vector<EMapStorageRequest*>());
+	list->append(req);
+}
+
+// Normally wake_requests empties the wait lists, but a request can complete
+// while it is still on some of them if it raced with another one.
+void Storage::stop_waiting(EMapStorageRequest *req)
+{
+	for (const Vec3i &l : req->blocked_on) {
+		Vector<EMapStorageRequest*> *list = waiters.get(l);
+		for (int i = 0; i < list->length(); i++) {
+			if ((*list)[i] == req) {
+				list->quick_remove(i);
+				break;
+			}
+		}
+		if (list->length() == 0)
+			waiters.remove(l);
+	}
+	req->blocked_on.clear();
+}
+
+void Storage::wake_requests(const Vec3i &location)
+{
+	Vector<EMapStorageRequest*> *list = waiters.get(location);
+	if (!list)
+		return;
+	for (EMapStorageRequest *req : *list) {
+		for (int i = 0; i < req->blocked_on.length(); i++) {
+			if (req->blocked_on[i] == location) {
+				req->blocked_on.quick_remove(i);
+				break;
+			}
+		}
+		make_ready(req);
+	}
+	waiters.remove(location);
+}
+
+void Storage::queue_unpack_chunk(StorageChunk *msc, int index)
+{
+	EUnpackMapChunksMessage *msg = nullptr;
+	for (EUnpackMapChunksMessage *m : unpack_batches) {
+		if (m->location == msc->location) {
+			msg = m;
+			break;
+		}
+	}
+	if (!msg) {
+		msg = new (OrDie) EUnpackMapChunksMessage;
+		msg->location = msc->location;
+		unpack_batches.append(msg);
+	}
+
+	Chunk &mc = msc->chunks[index];
+	mc.flags |= MCF_UNPACKING;
+	msg->indices.append(index);
+	msg->payloads.append(msc->packed_payload(index));
+}
+
+// Reduces a lod of the chunk from the finest one it has, requests for other
+// lods of the chunk go on meanwhile.
+void Storage::queue_build_lod(StorageChunk *msc, int index, int lod)
+{
+	EBuildMapChunkLodsMessage *msg = nullptr;
+	for (EBuildMapChunkLodsMessage *m : lod_batches) {
+		if (m->location == msc->location) {
+			msg = m;
+			break;
+		}
+	}
+	if (!msg) {
+		msg = new (OrDie) EBuildMapChunkLodsMessage;
+		msg->location = msc->location;
+		lod_batches.append(msg);
+	}
+
+	Chunk &mc = msc->chunks[index];
+	mc.flags |= MCF_BUILDING_LOD;
+	EBuildMapChunkLodsMessage::Build b;
+	b.index = index;
+	b.lod = lod;
+	b.source_lod = mc.lod_source(lod);
+	b.source = mc.lods[b.source_lod];
+	msg->builds.append(std::move(b));
+}
+
+// Pristine chunks of a saved storage chunk are generated instead of unpacked.
+void Storage::generate_pristine_chunk(StorageChunk *msc, int index)
+{
+	Chunk &mc = msc->chunks[index];
+	mc.flags &= ~MCF_PACKED;
+	mc.flags |= MCF_GENERATING;
+	msc->packed_n--;
+	release_packed(msc);
+
+	EGenerateMapChunkRequest req;
+	req.location = msc->location * STORAGE_CHUNK_SIZE +
+		offset_to_3d(index, STORAGE_CHUNK_SIZE);
+	NG_EventManager->fire(EID_GENERATE_MAP_CHUNK_REQUEST, &req);
+}
+
+ELoadMapStorageChunkMessage *Storage::queue_load_storage_chunk(
+	const Vec3i &location, int priority)
 {
 	auto data = new (OrDie) ELoadMapStorageChunkMessage;
 	data->config = config;
+	data->regions = &regions;
 	data->location = location;
 
 	EWorkerTask task;
 	task.data = data;
 	task.execute = load_storage_chunk;
 	task.finalize = fire_finalizer<EID_MAP_STORAGE_CHUNK_PRELOADED>;
-	NG_EventManager->fire(EID_QUEUE_IO_TASK, &task);
+	task.priority = priority;
+	task.locality = region_locality(location);
+	NG_EventManager->fire(EID_QUEUE_IO_READ_TASK, &task);
+	return data;
 }
 
 } // namespace Map
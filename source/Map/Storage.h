@@ -12,6 +12,10 @@ struct Storage;
 
 } // namespace Map
 
+struct EUnpackMapChunksMessage;
+struct ELoadMapStorageChunkMessage;
+struct EBuildMapChunkLodsMessage;
+
 enum MapStorageRequestType {
 	MSRT_READ,
 	MSRT_WRITE,
@@ -23,9 +27,18 @@ struct EMapStorageRequest : RTTIBase<EMapStorageRequest>
 	MapStorageRequestType type;
 	Vec3i location;
 	Vec3i size;
+	// lod of the chunks of a read request by the octant they are in, bit 0
+	// is x > 0, bit 1 is y > 0 and bit 2 is z > 0, relative to 'location'
 	int lods[8];
+	// storage chunks missing for this request are read in that order, lower
+	// goes first
+	int priority = 0;
 	Vector<Map::Chunk*> chunks;
 	RTTIObject *sender;
+	// queued for the next Storage::update
+	bool ready = false;
+	// storage chunks the request is waiting for, see Storage::waiters
+	Vector<Vec3i> blocked_on;
 
 	EMapStorageRequest(RTTIObject *sender,
 		const Vec3i &location, const Vec3i &size, int lods[8],
@@ -39,29 +52,80 @@ struct EChunksUpdated : RTTIBase<EChunksUpdated>
 	Vec3i max;
 };
 
-static inline int compute_hash(const Vec3i &key)
-{
-	return ::compute_hash(Slice<const Vec3i>(&key, 1));
-}
-
 //----------------------------------------------------------------------
 // MapStorage
 //----------------------------------------------------------------------
 
 namespace Map {
 
+// Reads world.ngw of the storage directory, or writes it for a new world.
+// An existing world keeps the seed it was made with, config->seed is replaced
+// by it.
+bool open_world(StorageConfig *config, Error *err = &DefaultError);
+
 struct Storage : RTTIBase<Storage>
 {
 	int pending_saves = 0;
 	bool force_save = false;
-	bool dirty = false;
 	Vector<EMapStorageRequest*> requests;
+	// Requests are only looked at when something they wait for changes.
+	// These are the ones to look at during the next update.
+	Vector<EMapStorageRequest*> ready_requests;
+	// blocked requests by the storage chunk they wait for
+	HashMap<Vec3i, Vector<EMapStorageRequest*>> waiters;
+	// chunk positions looked at by update and the ones a full rescan of all
+	// requests would have looked at on top of that
+	int64_t scanned_positions = 0;
+	int64_t skipped_positions = 0;
+	// chunk unpack tasks collected during update, one per storage chunk
+	Vector<EUnpackMapChunksMessage*> unpack_batches;
+	// lod builds collected during update, one per storage chunk
+	Vector<EBuildMapChunkLodsMessage*> lod_batches;
 	const StorageConfig *config;
+	RegionCache regions;
 	HashMap<Vec3i, StorageChunk> storage_chunks;
 	int64_t local_time_seconds = 0;
 	double local_time = 0;
 	int requests_alive = 0;
 	int dirty_storage_chunks = 0;
+	// Write requests released so far, the first 'saved_writes' of them have
+	// all their storage chunks on the disk. Storage chunks which are dirty or
+	// being saved map to the first of their writes which isn't.
+	int64_t writes = 0;
+	int64_t saved_writes = 0;
+	HashMap<Vec3i, int64_t> unsaved_writes;
+	HashMap<Vec3i, int64_t> saving_writes;
+	int evicted_storage_chunks = 0;
+	// update counter, used to find least recently requested storage chunks
+	int64_t ticks = 0;
+	// memory taken by resident storage chunks, see update_memory_usage
+	int64_t resident_lod_bytes[LODS_N] = {};
+	// non-uniform chunks which have the lod at the moment
+	int resident_lod_chunks[LODS_N] = {};
+	// lods reduced on demand and dropped under memory pressure since start
+	int64_t built_lods[LODS_N] = {};
+	int64_t dropped_lods = 0;
+	int64_t resident_packed_bytes = 0;
+	// speculative loads which are not done yet, see EMapStoragePrefetch
+	HashMap<Vec3i, ELoadMapStorageChunkMessage*> prefetches;
+	int prefetch_issued = 0;
+	// requests which found their storage chunk prefetched or not loaded at all
+	int prefetch_hits = 0;
+	int prefetch_misses = 0;
+	// speculative loads cancelled before the read
+	int prefetch_cancelled = 0;
+	// speculative loads which were read, but evicted before any request
+	int prefetch_wasted = 0;
+	// finished saves, times are in seconds summed over I/O tasks
+	int saved_storage_chunks = 0;
+	int64_t saved_bytes = 0;
+	double save_encode_time = 0;
+	double save_write_time = 0;
+	// of the generator pristine chunks come from, see Generator::fingerprint
+	uint64_t generator_fingerprint = 0;
+	// the one the world file has, pristine chunks on the disk were saved for
+	uint64_t world_generator = 0;
+	bool opened = false;
 
 	// returns the address of the storage chunk for a given chunk at 'location'
 	Vec3i storage_chunk_location(const Vec3i &location) const;
@@ -71,25 +135,56 @@ struct Storage : RTTIBase<Storage>
 	StorageChunk *storage_chunk_at(const Vec3i &location);
 
 	void update_storage_chunks();
+	void update_saved_writes();
+	void update_memory_usage();
+	int64_t resident_bytes() const;
+	void evict_storage_chunks();
+	void forget_storage_chunk(const Vec3i &location);
+	void print_memory_usage();
+	void print_prefetch_stats();
+	void print_request_stats();
 	void update(double delta);
 
 	NG_DELETE_COPY_AND_MOVE(Storage);
 	Storage(const StorageConfig *config);
 	~Storage();
 
+	// Checks the world file against the generator, once the terrain is set
+	// and before the first update. A world with pristine chunks of another
+	// generator can't be opened, they would not match the edited ones.
+	bool open(Error *err = &DefaultError);
+
 	void grab_storage_chunks(const EMapStorageRequest &req);
 	void release_storage_chunks(const EMapStorageRequest &req);
 
 	bool can_quit();
 
 	void handle_map_storage_request(RTTIObject *event);
+	void handle_map_storage_prefetch(RTTIObject *event);
 	void handle_map_chunk_generated(RTTIObject *event);
+	void handle_map_chunks_generated(RTTIObject *event);
 	void handle_map_storage_chunk_saved(RTTIObject *event);
 	void handle_map_storage_chunk_loaded(RTTIObject *event);
 	void handle_map_storage_chunk_preloaded(RTTIObject *event);
+	void handle_map_chunks_unpacked(RTTIObject *event);
+	void handle_map_chunk_lods_built(RTTIObject *event);
+	void handle_map_generator_changed(RTTIObject *event);
 
 	// events
-	void queue_load_storage_chunk(const Vec3i &location);
+	ELoadMapStorageChunkMessage *queue_load_storage_chunk(const Vec3i &location,
+		int priority);
+	void queue_save_storage_chunk(StorageChunk &msc);
+	void store_generated_chunk(StorageChunk *msc, const Vec3i &location,
+		FieldRef *fields);
+	void queue_unpack_chunk(StorageChunk *msc, int index);
+	void queue_build_lod(StorageChunk *msc, int index, int lod);
+	void generate_pristine_chunk(StorageChunk *msc, int index);
+
+	// wait lists
+	void make_ready(EMapStorageRequest *req);
+	void wait_for(EMapStorageRequest *req, const Vec3i &location);
+	void stop_waiting(EMapStorageRequest *req);
+	void wake_requests(const Vec3i &location);
 };
 
 } // namespace Map
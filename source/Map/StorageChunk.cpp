@@ -1,29 +1,360 @@
 #include "Map/StorageChunk.h"
 #include "Math/Noise.h"
 #include "OS/IO.h"
+#include "Core/UniquePtr.h"
+#include "Core/HashMap.h"
 
 namespace Map {
 
-void StorageChunk::save(const StorageConfig &config, Error *err) const
+// NGSF layout:
+//   "NGSF"
+//   uint32 version
+//   uint32 flags
+//   uint64 generator fingerprint, see Generator::fingerprint
+//   int32 chunk size (x, y, z)
+//   int32 storage chunk size (x, y, z)
+//   LZ4 block with PackedField entries, one per chunk
+//   field payloads
+//
+// Each chunk field is an independent payload: a codec byte, data and seqs
+// lengths and then either raw data and seqs arrays (small fields, mostly
+// uniform chunks) or two separate LZ4 blocks, which are decompressed straight
+// into the final vectors. Offsets are relative to the first payload, identical
+// payloads are stored once.
+//
+// If the codec byte of the lod 0 field has SFC_LODS_FLAG set, the rest of the
+// lods follow it in the same format, loading such a chunk doesn't need to
+// generate them. NGSF_LODS header flag is set if the storage chunk was saved
+// with lods, but older payloads may still lack them.
+//
+// SFC_PRISTINE payloads are just the header with zero lengths, the chunk is
+// generated again when loaded. NGSF_PRISTINE is set if there are such,
+// the generator fingerprint tells which generator can make them again.
+//
+// Version 3 had no generator fingerprint. Version 2 had no offsets table,
+// field headers were in a single LZ4 block followed by LZ4 blocks of all the
+// fields.
+constexpr uint32_t NGSF_VERSION = 4;
+
+enum StorageFieldCodec {
+	SFC_RAW = 0,
+	SFC_LZ4 = 1,
+	SFC_PRISTINE = 2,
+	SFC_CODEC_MASK = 0x7F,
+	SFC_LODS_FLAG = 0x80,
+};
+
+enum StorageChunkFileFlags {
+	NGSF_LODS = 1 << 0,
+	NGSF_PRISTINE = 1 << 1,
+};
+
+constexpr int RAW_FIELD_MAX_BYTES = 64;
+constexpr int FIELD_HEADER_SIZE = 9;
+
+static void serialize_field(ByteWriter *headers, ByteWriter *blocks,
+	const HermiteRLEField &f, int flags = 0)
 {
-	ByteWriter w;
-	ByteWriter tmp;
-	String filename = String::format("%d_%d_%d.ngc", VEC3(location));
-	String fullpath = config.directory + "/" + filename;
-	w.write_string("NGSC");
+	auto data = slice_cast<const uint8_t>(f.data.sub());
+	auto seqs = slice_cast<const uint8_t>(f.seqs.sub());
+	const bool raw = data.length + seqs.length <= RAW_FIELD_MAX_BYTES;
+	headers->write_uint8((raw ? SFC_RAW : SFC_LZ4) | flags);
+	headers->write_int32(f.data.length());
+	headers->write_int32(f.seqs.length());
+	if (raw) {
+		headers->write(data);
+		headers->write(seqs);
+	} else {
+		blocks->write_compressed(data);
+		blocks->write_compressed(seqs);
+	}
+}
+
+// returns codec flags
+static int deserialize_field(ByteReader *headers, ByteReader *blocks,
+	HermiteRLEField *f, const Vec3i &size, Error *err)
+{
+	const int codec_and_flags = headers->read_uint8(err);
+	const int data_n = headers->read_int32(err);
+	const int seqs_n = headers->read_int32(err);
+	if (*err)
+		return 0;
+
+	// there can't be more runs than there are cells in the field
+	const int max_n = volume(size) + 1;
+	if (data_n < 0 || data_n > max_n || seqs_n < 0 || seqs_n > max_n) {
+		err->set("Malformed field header (data: %d, seqs: %d)", data_n, seqs_n);
+		return 0;
+	}
+
+	const int codec = codec_and_flags & SFC_CODEC_MASK;
+	f->size = size;
+	f->data.resize(data_n);
+	f->seqs.resize(seqs_n);
+	auto data = slice_cast<uint8_t>(f->data.sub());
+	auto seqs = slice_cast<uint8_t>(f->seqs.sub());
+	switch (codec) {
+	case SFC_RAW:
+		headers->read(data, err);
+		headers->read(seqs, err);
+		break;
+	case SFC_LZ4:
+		blocks->read_compressed(data, err);
+		blocks->read_compressed(seqs, err);
+		break;
+	default:
+		err->set("Unknown field codec: %d", codec);
+		break;
+	}
+	return codec_and_flags & ~SFC_CODEC_MASK;
+}
+
+static void serialize_pristine_chunk(ByteWriter *out)
+{
+	out->write_uint8(SFC_PRISTINE);
+	out->write_int32(0);
+	out->write_int32(0);
+}
+
+bool is_pristine_payload(Slice<const uint8_t> payload)
+{
+	return payload.length > 0 && (payload[0] & SFC_CODEC_MASK) == SFC_PRISTINE;
+}
+
+bool read_pristine_generator(Slice<const uint8_t> contents, uint64_t *generator)
+{
+	*generator = 0;
+	if (contents.length < 4 || slice_cast<const char>(contents.sub(0, 4)) != "NGSF")
+		return false;
+
+	Error err(EV_QUIET);
+	ByteReader br(contents.sub(4));
+	const uint32_t version = br.read_uint32(&err);
+	const uint32_t flags = br.read_uint32(&err);
+	if (err || !(flags & NGSF_PRISTINE))
+		return false;
+	// older files with pristine chunks don't say which generator made them,
+	// they match none
+	if (version == NGSF_VERSION)
+		*generator = br.read_uint64(&err);
+	return true;
+}
+
+static bool has_all_lods(const FieldRef *lods)
+{
+	for (int i = 0; i < LODS_N; i++) {
+		if (lods[i]->data.length() == 0)
+			return false;
+	}
+	return true;
+}
+
+static void serialize_chunk(ByteWriter *out, const FieldRef *lods,
+	bool store_lods)
+{
+	// chunks without lod 0 have no lods at all, the ones which don't have
+	// all of them reduced yet are saved without
+	if (!store_lods || !has_all_lods(lods)) {
+		serialize_field(out, out, *lods[0]);
+		return;
+	}
+
+	serialize_field(out, out, *lods[0], SFC_LODS_FLAG);
+	for (int i = 1; i < LODS_N; i++)
+		serialize_field(out, out, *lods[i]);
+}
+
+static bool deserialize_shared_field(ByteReader *headers, ByteReader *blocks,
+	FieldRef *f, const Vec3i &size, int *flags, Error *err)
+{
+	HermiteRLEField tmp;
+	*flags = deserialize_field(headers, blocks, &tmp, size, err);
+	if (*err)
+		return false;
+	*f = intern_field(std::move(tmp));
+	return true;
+}
+
+void unpack_chunk(Chunk *chunk, Slice<const uint8_t> payload, Error *err)
+{
+	ByteReader br(payload);
+	int flags;
+	if (!deserialize_shared_field(&br, &br, &chunk->lods[0],
+		lod_field_size(0), &flags, err))
+	{
+		chunk->lods[0].clear();
+		return;
+	}
+	if (!(flags & SFC_LODS_FLAG)) {
+		chunk->reset_lods();
+		return;
+	}
+
+	for (int i = 1; i < LODS_N; i++) {
+		if (!deserialize_shared_field(&br, &br, &chunk->lods[i],
+			lod_field_size(i), &flags, err))
+		{
+			for (FieldRef &f : chunk->lods)
+				f.clear();
+			return;
+		}
+	}
+}
+
+void StorageChunkSnapshot::serialize(ByteWriter *out) const
+{
+	const int chunks_n = volume(STORAGE_CHUNK_SIZE);
+	Vector<PackedField> table(chunks_n);
+	// distinct payloads by their contents, colliding ones are stored twice
+	HashMap<ContentHash, PackedField> distinct;
+	ByteWriter payloads;
+	bool has_pristine = false;
+	for (int i = 0; i < chunks_n; i++) {
+		const int offset = payloads.data.length();
+		if (packed[i].length != 0) {
+			payloads.write(packed[i]);
+			has_pristine |= is_pristine_payload(packed[i]);
+		} else if (!store_pristine && pristine[i]) {
+			serialize_pristine_chunk(&payloads);
+			has_pristine = true;
+		} else {
+			serialize_chunk(&payloads, &fields[i * LODS_N], store_lods);
+		}
+
+		PackedField pf;
+		pf.offset = offset;
+		pf.length = payloads.data.length() - offset;
+		table[i] = pf;
+
+		auto payload = payloads.sub().sub(offset);
+		const ContentHash hash = content_hash(payload);
+		const PackedField *same = distinct.get(hash);
+		if (!same) {
+			distinct.insert(hash, pf);
+			continue;
+		}
+		auto candidate = payloads.sub().sub(same->offset, same->offset + same->length);
+		if (candidate == payload) {
+			table[i] = *same;
+			payloads.data.resize(offset);
+		}
+	}
+
+	ByteWriter &w = *out;
+	w.write_string("NGSF");
+	w.write_uint32(NGSF_VERSION);
+	w.write_uint32((store_lods ? NGSF_LODS : 0) |
+		(has_pristine ? NGSF_PRISTINE : 0));
+	w.write_uint64(generator);
 	w.write_int32(CHUNK_SIZE.x);
 	w.write_int32(CHUNK_SIZE.y);
 	w.write_int32(CHUNK_SIZE.z);
 	w.write_int32(STORAGE_CHUNK_SIZE.x);
 	w.write_int32(STORAGE_CHUNK_SIZE.y);
 	w.write_int32(STORAGE_CHUNK_SIZE.z);
+	w.write_compressed(slice_cast<const uint8_t>(table.sub()));
+	w.write(payloads.sub());
+}
+
+void StorageChunkSnapshot::save(RegionCache *regions, Error *err) const
+{
+	ByteWriter w;
+	serialize(&w);
+	regions->write(location, w.sub(), RC_NGSF, err);
+}
+
+Slice<const uint8_t> StorageChunk::packed_payload(int index) const
+{
+	const PackedField &pf = packed_fields[index];
+	return packed.sub(pf.offset, pf.offset + pf.length);
+}
+
+void StorageChunk::update_memory_usage()
+{
+	for (int i = 0; i < LODS_N; i++) {
+		lod_bytes[i] = 0;
+		lod_chunks[i] = 0;
+	}
+	for (const Chunk &c : chunks) {
+		// the fields are on their way from a worker, they are counted once
+		// stored, which marks the memory usage dirty again
+		if (c.flags & (MCF_GENERATING | MCF_UNPACKING))
+			continue;
+		const bool uniform = c.is_uniform();
+		for (int i = 0; i < LODS_N; i++) {
+			if (c.lods[i])
+				lod_bytes[i] += c.lods[i]->byte_length() / c.lods[i].refs();
+			if (!uniform && c.has_lod(i))
+				lod_chunks[i]++;
+		}
+	}
+	packed_bytes = packed.byte_length() + packed_fields.byte_length();
+	memory_dirty = false;
+}
 
-	for (const auto &c : chunks) {
-		const HermiteRLEField &f = c.lods[0];
-		f.serialize(&tmp);
+int StorageChunk::drop_lods()
+{
+	int n = 0;
+	for (Chunk &c : chunks) {
+		if (c.is_uniform())
+			continue;
+		for (int i = 1; i < LODS_N; i++) {
+			if (c.has_lod(i)) {
+				c.lods[i].clear();
+				n++;
+			}
+		}
 	}
-	w.write_compressed(tmp.sub());
-	IO::write_file(fullpath.c_str(), w.sub(), err);
+	if (n != 0)
+		memory_dirty = true;
+	return n;
+}
+
+int64_t StorageChunk::memory_usage() const
+{
+	int64_t total = packed_bytes;
+	for (int i = 0; i < LODS_N; i++)
+		total += lod_bytes[i];
+	return total;
+}
+
+bool StorageChunk::is_idle() const
+{
+	for (const Chunk &c : chunks) {
+		if (c.flags & (MCF_GENERATING | MCF_UNPACKING | MCF_BUILDING_LOD))
+			return false;
+	}
+	return true;
+}
+
+StorageChunkSnapshot StorageChunk::snapshot() const
+{
+	StorageChunkSnapshot s;
+	s.location = location;
+	s.packed.resize(chunks.length(), Slice<const uint8_t>());
+	s.fields.resize(chunks.length() * LODS_N);
+	s.pristine.resize(chunks.length(), 0);
+	for (int i = 0; i < chunks.length(); i++) {
+		const Chunk &c = chunks[i];
+		s.pristine[i] = (c.flags & MCF_PRISTINE) != 0;
+		if (c.flags & MCF_PACKED) {
+			s.packed[i] = packed_payload(i);
+			continue;
+		}
+		for (int j = 0; j < LODS_N; j++)
+			s.fields[i * LODS_N + j] = c.lods[j];
+	}
+	return s;
+}
+
+void StorageChunk::serialize(ByteWriter *out) const
+{
+	snapshot().serialize(out);
+}
+
+void StorageChunk::save(RegionCache *regions, Error *err) const
+{
+	snapshot().save(regions, err);
 }
 
 StorageChunk::StorageChunk(const Vec3i &location):
@@ -32,52 +363,53 @@ StorageChunk::StorageChunk(const Vec3i &location):
 }
 
 StorageChunk StorageChunk::new_from_file(const Vec3i &location,
-	const StorageConfig &config, Error *err)
+	RegionCache *regions, Error *err)
 {
-	String filename = String::format("%d_%d_%d.ngc", VEC3(location));
-	String fullpath = config.directory + "/" + filename;
-
-	auto contents = IO::read_file(fullpath.c_str(), err);
+	RegionCodec codec;
+	UniquePtr<IO::MappedFile> contents(regions->map(location, &codec, err));
 	if (*err)
 		return StorageChunk(location);
 
-	return new_from_buffer(location, contents, err);
+	return new_from_buffer(location, contents->data, err);
 }
 
-StorageChunk StorageChunk::new_from_buffer(const Vec3i &location,
-	const Vector<uint8_t> &contents, Error *err)
+static bool read_sizes(ByteReader *br, Error *err)
 {
-	if (contents.length() < 4 || slice_cast<const char>(contents.sub(0, 4)) != "NGSC") {
-		err->set("Bad magic, NGSC expected");
-		return StorageChunk(location);
-	}
-
-	ByteReader br(contents.sub(4));
 	Vec3i chunk_size, storage_chunk_size;
 
-	chunk_size.x = br.read_int32(err);
-	chunk_size.y = br.read_int32(err);
-	chunk_size.z = br.read_int32(err);
+	chunk_size.x = br->read_int32(err);
+	chunk_size.y = br->read_int32(err);
+	chunk_size.z = br->read_int32(err);
 	if (*err)
-		return StorageChunk(location);
+		return false;
 
 	if (chunk_size != CHUNK_SIZE) {
 		err->set("Mismatching chunk sizes, file: (%d %d %d), expected: (%d %d %d)",
 			VEC3(chunk_size), VEC3(CHUNK_SIZE));
-		return StorageChunk(location);
+		return false;
 	}
 
-	storage_chunk_size.x = br.read_int32(err);
-	storage_chunk_size.y = br.read_int32(err);
-	storage_chunk_size.z = br.read_int32(err);
+	storage_chunk_size.x = br->read_int32(err);
+	storage_chunk_size.y = br->read_int32(err);
+	storage_chunk_size.z = br->read_int32(err);
 	if (*err)
-		return StorageChunk(location);
+		return false;
 
 	if (storage_chunk_size != STORAGE_CHUNK_SIZE) {
 		err->set("Mismatching storage chunk sizes, file: (%d %d %d), expected: (%d %d %d)",
 			VEC3(storage_chunk_size), VEC3(STORAGE_CHUNK_SIZE));
-		return StorageChunk(location);
+		return false;
 	}
+	return true;
+}
+
+// The original format: sizes followed by a single LZ4 block with all the
+// serialized fields.
+static StorageChunk new_from_legacy_buffer(const Vec3i &location,
+	ByteReader br, Error *err)
+{
+	if (!read_sizes(&br, err))
+		return StorageChunk(location);
 
 	auto tmp = br.read_compressed(err);
 	if (*err)
@@ -85,15 +417,88 @@ StorageChunk StorageChunk::new_from_buffer(const Vec3i &location,
 
 	StorageChunk msc(location);
 	br = ByteReader(tmp);
-	for (int i = 0, n = volume(storage_chunk_size); i < n; i++) {
-		Chunk &c = msc.chunks[i];
-		c.lods[0].deserialize(&br, CHUNK_SIZE + Vec3i(1), err);
+	for (Chunk &c : msc.chunks) {
+		HermiteRLEField f;
+		f.deserialize(&br, CHUNK_SIZE + Vec3i(1), err);
 		if (*err)
 			return StorageChunk(location);
+		c.lods[0] = intern_field(std::move(f));
 	}
 
 	return msc;
 }
 
-} // namespace Map
+StorageChunk StorageChunk::new_from_buffer(const Vec3i &location,
+	Slice<const uint8_t> contents, Error *err)
+{
+	if (contents.length >= 4 && slice_cast<const char>(contents.sub(0, 4)) == "NGSC")
+		return new_from_legacy_buffer(location, ByteReader(contents.sub(4)), err);
+
+	if (contents.length < 4 || slice_cast<const char>(contents.sub(0, 4)) != "NGSF") {
+		err->set("Bad magic, NGSF expected");
+		return StorageChunk(location);
+	}
+
+	ByteReader br(contents.sub(4));
+	const uint32_t version = br.read_uint32(err);
+	br.read_uint32(err); // flags
+	if (*err)
+		return StorageChunk(location);
+
+	if (version != 2 && version != 3 && version != NGSF_VERSION) {
+		err->set("Unsupported storage chunk version: %d", version);
+		return StorageChunk(location);
+	}
+
+	if (version == NGSF_VERSION)
+		br.read_uint64(err); // generator, see read_pristine_generator
+	if (*err)
+		return StorageChunk(location);
+
+	if (!read_sizes(&br, err))
+		return StorageChunk(location);
 
+	if (version == 2) {
+		auto headers = br.read_compressed(err);
+		if (*err)
+			return StorageChunk(location);
+
+		StorageChunk msc(location);
+		ByteReader hr(headers);
+		for (Chunk &c : msc.chunks) {
+			int flags;
+			if (!deserialize_shared_field(&hr, &br, &c.lods[0],
+				lod_field_size(0), &flags, err))
+			{
+				return StorageChunk(location);
+			}
+		}
+		return msc;
+	}
+
+	// Only the offsets table is decoded here, fields stay compressed until
+	// a request touches them.
+	StorageChunk msc(location);
+	msc.packed_fields.resize(msc.chunks.length());
+	br.read_compressed(slice_cast<uint8_t>(msc.packed_fields.sub()), err);
+	if (*err)
+		return StorageChunk(location);
+
+	for (const PackedField &pf : msc.packed_fields) {
+		if (pf.length < FIELD_HEADER_SIZE || pf.offset > (uint32_t)br.data.length ||
+			pf.length > br.data.length - pf.offset)
+		{
+			err->set("Malformed field entry (offset: %d, length: %d)",
+				pf.offset, pf.length);
+			return StorageChunk(location);
+		}
+	}
+
+	msc.packed = br.data;
+	msc.packed_n = msc.chunks.length();
+	for (Chunk &c : msc.chunks)
+		c.flags |= MCF_PACKED;
+	return msc;
+}
+
+} // namespace Map
@@ -2,6 +2,7 @@
 
 #include "Map/Config.h"
 #include "Map/Chunk.h"
+#include "Map/RegionFile.h"
 #include "Core/Vector.h"
 #include "OS/WorkerPool.h"
 
@@ -14,27 +15,94 @@ namespace Map {
 enum StorageChunkFlags {
 	MSCF_LOADING = 1 << 0,
 	MSCF_SAVING = 1 << 1,
+	// loaded by the prefetcher and not requested yet
+	MSCF_SPECULATIVE = 1 << 2,
+};
+
+// Location of an encoded chunk field within StorageChunk::packed.
+struct PackedField {
+	uint32_t offset = 0;
+	uint32_t length = 0;
+};
+
+// Decodes a packed field into 'chunk', with its lods if they were saved, can
+// be called from any thread.
+void unpack_chunk(Chunk *chunk, Slice<const uint8_t> payload,
+	Error *err = &DefaultError);
+
+// The chunk was saved without its fields, see StorageConfig::store_pristine.
+bool is_pristine_payload(Slice<const uint8_t> payload);
+
+// Whether a serialized storage chunk may have pristine chunks, 'generator' is
+// set to the fingerprint of the generator which makes them then, 0 if the
+// file predates fingerprints. See Generator::fingerprint.
+bool read_pristine_generator(Slice<const uint8_t> contents, uint64_t *generator);
+
+// Storage chunk contents as seen at the moment of its creation, used to
+// serialize storage chunks on the I/O worker. Chunks which were packed at the
+// time refer to their payloads, which are copied as is, the rest hold their
+// fields, edits made in the meantime replace the chunk's handles only.
+struct StorageChunkSnapshot {
+	Vec3i location;
+	Vector<Slice<const uint8_t>> packed;
+	Vector<FieldRef> fields; // LODS_N per chunk
+	// write lods[1..] of unpacked chunks, see StorageConfig::store_lods
+	bool store_lods = true;
+	// MCF_PRISTINE of each chunk and whether to write such chunks anyway,
+	// see StorageConfig::store_pristine
+	Vector<uint8_t> pristine;
+	bool store_pristine = true;
+	// fingerprint of the generator which makes pristine chunks again
+	uint64_t generator = 0;
+
+	void serialize(ByteWriter *out) const;
+	void save(RegionCache *regions, Error *err = &DefaultError) const;
 };
 
 struct StorageChunk {
 	Vector<Chunk> chunks;
 	Vec3i location;
 
+	// Field payloads as they were loaded from the disk. Chunks with MCF_PACKED
+	// flag are decoded from here on demand, the buffer is released once all
+	// of them are unpacked.
+	Vector<uint8_t> packed;
+	Vector<PackedField> packed_fields;
+	int packed_n = 0;
+
 	// need to drop it to the hard drive?
 	bool dirty = false;
 	uint8_t flags = MSCF_LOADING;
 	int64_t last_sync = 0;
 	int write_reqs = 0;
 	int read_reqs = 0;
+	// Storage::ticks when it was requested the last time
+	int64_t last_request = 0;
+
+	// memory taken by the fields of each lod and by packed payloads, cached
+	// until one of the chunks changes, shared fields count by their share
+	bool memory_dirty = true;
+	int lod_bytes[LODS_N] = {};
+	int lod_chunks[LODS_N] = {};
+	int packed_bytes = 0;
 
-	void save(const StorageConfig &config, Error *err = &DefaultError) const;
+	Slice<const uint8_t> packed_payload(int index) const;
+	void update_memory_usage();
+	// drops lods[1..] of non-uniform chunks, returns how many
+	int drop_lods();
+	int64_t memory_usage() const;
+	// no chunk is being generated, unpacked or reduced
+	bool is_idle() const;
+	StorageChunkSnapshot snapshot() const;
+	void serialize(ByteWriter *out) const;
+	void save(RegionCache *regions, Error *err = &DefaultError) const;
 
 	explicit StorageChunk(const Vec3i &location);
 
 	static StorageChunk new_from_file(const Vec3i &location,
-		const StorageConfig &config, Error *err = &DefaultError);
-	static StorageChunk new_from_buffer(const Vec3i &location, const Vector<uint8_t> &buf,
-		Error *err = &DefaultError);
+		RegionCache *regions, Error *err = &DefaultError);
+	static StorageChunk new_from_buffer(const Vec3i &location,
+		Slice<const uint8_t> buf, Error *err = &DefaultError);
 };
 
 } // namespace Map
@@ -0,0 +1,492 @@
+#include "Map/TerrainGraph.h"
+#include "Math/Utils.h"
+#include "Math/Random.h"
+#include <cmath>
+#include <cstring>
+
+namespace Map {
+
+static const char *op_names[TOP_N] = {
+	"x", "y", "z", "const",
+	"add", "sub", "mul", "min", "max", "mad", "clamp", "blend",
+	"fbm2", "fbm3", "slope", "material", "random",
+};
+
+// number of required inputs: a, b, c
+static const int op_inputs[TOP_N] = {
+	0, 0, 0, 0,
+	2, 2, 2, 2, 2, 1, 1, 3,
+	2, 3, 1, 1, 2,
+};
+
+// Perlin noise with unit gradients stays well within that.
+static const float NOISE_BOUND = 1.0f;
+
+TerrainOpCode terrain_op_from_name(const char *name)
+{
+	for (int i = 0; i < TOP_N; i++) {
+		if (strcmp(op_names[i], name) == 0)
+			return (TerrainOpCode)i;
+	}
+	return TOP_N;
+}
+
+static void mark_cone(const Vector<TerrainOp> &ops, int i, Vector<uint8_t> *marks)
+{
+	if (i < 0 || (*marks)[i])
+		return;
+	(*marks)[i] = 1;
+	mark_cone(ops, ops[i].a, marks);
+	mark_cone(ops, ops[i].b, marks);
+	mark_cone(ops, ops[i].c, marks);
+}
+
+bool TerrainGraph::compile(Error *err)
+{
+	cones.clear();
+	cones_offset.clear();
+	uses_y.clear();
+	column_ops.clear();
+	if (!n2d || !n3d) {
+		err->set("terrain graph: noise generators are not set");
+		return false;
+	}
+
+	for (int i = 0; i < ops.length(); i++) {
+		const TerrainOp &op = ops[i];
+		if (op.code < 0 || op.code >= TOP_N) {
+			err->set("terrain graph: op %d: unknown op", i);
+			return false;
+		}
+		const int inputs[] = {op.a, op.b, op.c};
+		for (int j = 0; j < 3; j++) {
+			const bool required = j < op_inputs[op.code];
+			const bool optional = (op.code == TOP_MATERIAL && j == 1) ||
+				(op.code == TOP_RANDOM && j == 2);
+			if (!required && !optional && inputs[j] != -1) {
+				err->set("terrain graph: op %d (%s): unexpected input %d",
+					i, op_names[op.code], j);
+				return false;
+			}
+			if ((required || inputs[j] != -1) &&
+				(inputs[j] < 0 || inputs[j] >= i))
+			{
+				err->set("terrain graph: op %d (%s): input %d is not an earlier op",
+					i, op_names[op.code], j);
+				return false;
+			}
+		}
+		if ((op.code == TOP_FBM2 || op.code == TOP_FBM3) &&
+			(op.n < 1 || op.n > 16))
+		{
+			err->set("terrain graph: op %d (%s): octaves must be in [1, 16]",
+				i, op_names[op.code]);
+			return false;
+		}
+		if (op.code == TOP_MATERIAL &&
+			(op.n < 0 || op.m < 0 || op.n + op.m > rules.length()))
+		{
+			err->set("terrain graph: op %d (material): invalid rules", i);
+			return false;
+		}
+	}
+	if (density < 0 || density >= ops.length()) {
+		err->set("terrain graph: density is not set");
+		return false;
+	}
+	if (material < -1 || material >= ops.length()) {
+		err->set("terrain graph: invalid material op");
+		return false;
+	}
+
+	for (int i = 0; i < ops.length(); i++) {
+		const TerrainOp &op = ops[i];
+		uses_y.append(op.code == TOP_Y ||
+			(op.a >= 0 && uses_y[op.a]) ||
+			(op.b >= 0 && uses_y[op.b]) ||
+			(op.c >= 0 && uses_y[op.c]));
+		if (!uses_y[i])
+			column_ops.append(i);
+	}
+
+	// The heightfield under a slope is evaluated once more, shifted along z.
+	Vector<uint8_t> marks;
+	for (int i = 0; i < ops.length(); i++) {
+		cones_offset.append(cones.length());
+		if (ops[i].code != TOP_SLOPE)
+			continue;
+		marks.clear();
+		marks.resize(ops.length(), 0);
+		mark_cone(ops, ops[i].a, &marks);
+		for (int j = 0; j < i; j++) {
+			if (!marks[j])
+				continue;
+			if (ops[j].code == TOP_SLOPE || ops[j].code == TOP_MATERIAL) {
+				err->set("terrain graph: op %d (slope): input depends on a %s",
+					i, op_names[ops[j].code]);
+				return false;
+			}
+			cones.append(j);
+		}
+	}
+	cones_offset.append(cones.length());
+	return true;
+}
+
+namespace {
+
+// Rows are stored in two banks, the second one is used by slopes.
+struct RowsView {
+	TerrainRows *rows;
+	int ops_n;
+	int n;
+
+	float *row(int bank, int i) { return rows->data.data() + (bank * ops_n + i) * n; }
+	float *tmp() { return rows->data.data() + 2 * ops_n * n; }
+	int reg(int bank, int i) const { return bank * ops_n + i; }
+	bool constant(int bank, int i) const
+	{
+		const int r = reg(bank, i);
+		return rows->affine[r] && rows->step[r] == 0.0f;
+	}
+};
+
+} // anonymous namespace
+
+static void set_affine(RowsView *v, int bank, int i, float base, float step)
+{
+	const int r = v->reg(bank, i);
+	v->rows->affine[r] = 1;
+	v->rows->base[r] = base;
+	v->rows->step[r] = step;
+}
+
+static void eval_op(const TerrainGraph &g, RowsView *v, int bank, int i,
+	const Vec3 &p, float step)
+{
+	const TerrainOp &op = g.ops[i];
+	const int n = v->n;
+	float *out = v->row(bank, i);
+	const float *a = op.a >= 0 ? v->row(bank, op.a) : nullptr;
+	const float *b = op.b >= 0 ? v->row(bank, op.b) : nullptr;
+	const float *c = op.c >= 0 ? v->row(bank, op.c) : nullptr;
+	const TerrainRows *rows = v->rows;
+	const int ra = v->reg(bank, op.a), rb = v->reg(bank, op.b);
+	v->rows->affine[v->reg(bank, i)] = 0;
+
+	switch (op.code) {
+	case TOP_X:
+		for (int j = 0; j < n; j++)
+			out[j] = p.x + step * (float)j;
+		set_affine(v, bank, i, p.x, step);
+		return;
+	case TOP_Y:
+	case TOP_Z:
+	case TOP_CONST: {
+		const float value = op.code == TOP_Y ? p.y : op.code == TOP_Z ? p.z : op.k[0];
+		for (int j = 0; j < n; j++)
+			out[j] = value;
+		set_affine(v, bank, i, value, 0.0f);
+		return;
+	}
+	case TOP_ADD:
+		for (int j = 0; j < n; j++)
+			out[j] = a[j] + b[j];
+		if (rows->affine[ra] && rows->affine[rb]) {
+			set_affine(v, bank, i, rows->base[ra] + rows->base[rb],
+				rows->step[ra] + rows->step[rb]);
+		}
+		return;
+	case TOP_SUB:
+		for (int j = 0; j < n; j++)
+			out[j] = a[j] - b[j];
+		if (rows->affine[ra] && rows->affine[rb]) {
+			set_affine(v, bank, i, rows->base[ra] - rows->base[rb],
+				rows->step[ra] - rows->step[rb]);
+		}
+		return;
+	case TOP_MUL:
+		for (int j = 0; j < n; j++)
+			out[j] = a[j] * b[j];
+		if (v->constant(bank, op.a) || v->constant(bank, op.b)) {
+			if (rows->affine[ra] && rows->affine[rb]) {
+				set_affine(v, bank, i, rows->base[ra] * rows->base[rb],
+					rows->step[ra] * rows->base[rb] +
+					rows->step[rb] * rows->base[ra]);
+			}
+		}
+		return;
+	case TOP_MIN:
+		for (int j = 0; j < n; j++)
+			out[j] = min(a[j], b[j]);
+		break;
+	case TOP_MAX:
+		for (int j = 0; j < n; j++)
+			out[j] = max(a[j], b[j]);
+		break;
+	case TOP_MAD:
+		for (int j = 0; j < n; j++)
+			out[j] = a[j] * op.k[0] + op.k[1];
+		if (rows->affine[ra]) {
+			set_affine(v, bank, i, rows->base[ra] * op.k[0] + op.k[1],
+				rows->step[ra] * op.k[0]);
+		}
+		return;
+	case TOP_CLAMP:
+		for (int j = 0; j < n; j++)
+			out[j] = clamp(a[j], op.k[0], op.k[1]);
+		break;
+	case TOP_BLEND:
+		for (int j = 0; j < n; j++)
+			out[j] = lerp(a[j], b[j], clamp(c[j], 0.0f, 1.0f));
+		break;
+	case TOP_FBM2:
+	case TOP_FBM3: {
+		const bool fbm3 = op.code == TOP_FBM3;
+		// get_row needs coordinates affine along the row
+		const bool fast = rows->affine[ra] && v->constant(bank, op.b) &&
+			(!fbm3 || v->constant(bank, op.c));
+		float *tmp = v->tmp();
+		float freq = op.k[0], amp = op.k[1];
+		for (int j = 0; j < n; j++)
+			out[j] = 0.0f;
+		for (int o = 0; o < op.n; o++) {
+			if (fast && fbm3) {
+				g.n3d->get_row(tmp, n, rows->base[ra] * freq,
+					rows->step[ra] * freq, b[0] * freq, c[0] * freq);
+			} else if (fast) {
+				g.n2d->get_row(tmp, n, rows->base[ra] * freq,
+					rows->step[ra] * freq, b[0] * freq);
+			} else if (fbm3) {
+				for (int j = 0; j < n; j++)
+					tmp[j] = g.n3d->get(a[j] * freq, b[j] * freq, c[j] * freq);
+			} else {
+				for (int j = 0; j < n; j++)
+					tmp[j] = g.n2d->get(a[j] * freq, b[j] * freq);
+			}
+			for (int j = 0; j < n; j++)
+				out[j] += tmp[j] * amp;
+			freq *= op.k[2];
+			amp *= op.k[3];
+		}
+		break;
+	}
+	case TOP_SLOPE: {
+		// The input's dependencies are evaluated again one step further
+		// along z, x neighbours are in the row already.
+		const Vec3 pz = p + Vec3(0, 0, step);
+		for (int j = g.cones_offset[i]; j < g.cones_offset[i+1]; j++)
+			eval_op(g, v, 1, g.cones[j], pz, step);
+		const float *az = v->row(1, op.a);
+		for (int j = 0; j < n; j++) {
+			if (step <= 0.0f) {
+				out[j] = 0.0f;
+				continue;
+			}
+			const int j0 = max(j-1, 0), j1 = min(j+1, n-1);
+			const float dx = j0 == j1 ? 0.0f : (a[j1] - a[j0]) / (step * (j1 - j0));
+			const float dz = (az[j] - a[j]) / step;
+			out[j] = std::sqrt(dx * dx + dz * dz);
+		}
+		return;
+	}
+	case TOP_MATERIAL:
+		for (int j = 0; j < n; j++) {
+			float m = op.k[0];
+			for (int r = op.n; r < op.n + op.m; r++) {
+				const TerrainMaterialRule &rule = g.rules[r];
+				if (a[j] < rule.min_height || a[j] >= rule.max_height)
+					continue;
+				if (b && (b[j] < rule.min_slope || b[j] >= rule.max_slope))
+					continue;
+				m = rule.material;
+				break;
+			}
+			out[j] = m;
+		}
+		break;
+	case TOP_RANDOM:
+		for (int j = 0; j < n; j++) {
+			const Vec3i cell(
+				(int)std::floor(a[j] * op.k[0]),
+				(int)std::floor(b[j] * op.k[0]),
+				c ? (int)std::floor(c[j] * op.k[0]) : 0);
+			out[j] = RandomStream(random_key(g.seed, cell, op.n)).next_float();
+		}
+		break;
+	case TOP_N:
+		break;
+	}
+
+	// elementwise ops of constant rows are constant
+	const int inputs[] = {op.a, op.b, op.c};
+	for (int in : inputs) {
+		if (in >= 0 && !v->constant(bank, in))
+			return;
+	}
+	set_affine(v, bank, i, out[0], 0.0f);
+}
+
+static void prepare_rows(TerrainRows *rows, int ops_n, int n)
+{
+	rows->data.resize((2 * ops_n + 1) * n);
+	rows->affine.resize(2 * ops_n);
+	rows->base.resize(2 * ops_n);
+	rows->step.resize(2 * ops_n);
+}
+
+void TerrainGraph::eval_row(float *density_out, int *material_out, int n,
+	const Vec3 &p, float step, TerrainRows *rows) const
+{
+	const int ops_n = ops.length();
+	prepare_rows(rows, ops_n, n);
+
+	const bool same_column = rows->last_graph == this &&
+		rows->last_n == n && rows->last_step == step &&
+		rows->last_p.x == p.x && rows->last_p.z == p.z;
+	rows->last_graph = this;
+	rows->last_p = p;
+	rows->last_step = step;
+	rows->last_n = n;
+
+	RowsView v = {rows, ops_n, n};
+	for (int i = 0; i < ops_n; i++) {
+		if (same_column && !uses_y[i])
+			continue;
+		eval_op(*this, &v, 0, i, p, step);
+	}
+
+	const float *d = v.row(0, density);
+	for (int j = 0; j < n; j++)
+		density_out[j] = d[j];
+	if (material == -1) {
+		for (int j = 0; j < n; j++)
+			material_out[j] = 1;
+	} else {
+		const float *m = v.row(0, material);
+		for (int j = 0; j < n; j++)
+			material_out[j] = m[j];
+	}
+}
+
+void TerrainGraph::store_column_row(TerrainColumn *column, int zrow,
+	int rows_n, const TerrainRows &rows) const
+{
+	const int n = rows.last_n;
+	const int cops_n = column_ops.length();
+	if (column->n != n || column->rows_n != rows_n) {
+		column->n = n;
+		column->rows_n = rows_n;
+		column->data.resize(rows_n * cops_n * n);
+		column->affine.resize(rows_n * cops_n);
+		column->base.resize(rows_n * cops_n);
+		column->step.resize(rows_n * cops_n);
+	}
+	for (int k = 0; k < cops_n; k++) {
+		const int i = column_ops[k], c = zrow * cops_n + k;
+		memcpy(&column->data[c * n], &rows.data[i * n], n * sizeof(float));
+		column->affine[c] = rows.affine[i];
+		column->base[c] = rows.base[i];
+		column->step[c] = rows.step[i];
+	}
+}
+
+void TerrainGraph::load_column_row(TerrainRows *rows, const TerrainColumn &column,
+	int zrow, const Vec3 &p, float step) const
+{
+	const int n = column.n;
+	const int cops_n = column_ops.length();
+	prepare_rows(rows, ops.length(), n);
+	for (int k = 0; k < cops_n; k++) {
+		const int i = column_ops[k], c = zrow * cops_n + k;
+		memcpy(&rows->data[i * n], &column.data[c * n], n * sizeof(float));
+		rows->affine[i] = column.affine[c];
+		rows->base[i] = column.base[c];
+		rows->step[i] = column.step[c];
+	}
+	rows->last_graph = this;
+	rows->last_p = p;
+	rows->last_step = step;
+	rows->last_n = n;
+}
+
+namespace {
+
+struct Interval {
+	float min;
+	float max;
+};
+
+} // anonymous namespace
+
+static Interval mul_interval(const Interval &a, const Interval &b)
+{
+	const float p[] = {a.min * b.min, a.min * b.max, a.max * b.min, a.max * b.max};
+	Interval out = {p[0], p[0]};
+	for (float v : p) {
+		if (std::isnan(v))
+			return {-INFINITY, INFINITY};
+		out.min = min(out.min, v);
+		out.max = max(out.max, v);
+	}
+	return out;
+}
+
+DensityBounds TerrainGraph::bounds(const Vec3 &bmin, const Vec3 &bmax) const
+{
+	// the box is widened a bit to cover rounding of the sample positions
+	const float EPS = 1.0f / 1024.0f;
+	Vector<Interval> iv(ops.length());
+	for (int i = 0; i < ops.length(); i++) {
+		const TerrainOp &op = ops[i];
+		const Interval a = op.a >= 0 ? iv[op.a] : Interval{0, 0};
+		const Interval b = op.b >= 0 ? iv[op.b] : Interval{0, 0};
+		Interval &out = iv[i];
+		switch (op.code) {
+		case TOP_X: out = {bmin.x - EPS, bmax.x + EPS}; break;
+		case TOP_Y: out = {bmin.y - EPS, bmax.y + EPS}; break;
+		case TOP_Z: out = {bmin.z - EPS, bmax.z + EPS}; break;
+		case TOP_CONST: out = {op.k[0], op.k[0]}; break;
+		case TOP_ADD: out = {a.min + b.min, a.max + b.max}; break;
+		case TOP_SUB: out = {a.min - b.max, a.max - b.min}; break;
+		case TOP_MUL: out = mul_interval(a, b); break;
+		case TOP_MIN: out = {min(a.min, b.min), min(a.max, b.max)}; break;
+		case TOP_MAX: out = {max(a.min, b.min), max(a.max, b.max)}; break;
+		case TOP_MAD:
+			out = mul_interval(a, {op.k[0], op.k[0]});
+			out = {out.min + op.k[1], out.max + op.k[1]};
+			break;
+		case TOP_CLAMP:
+			out = {clamp(a.min, op.k[0], op.k[1]), clamp(a.max, op.k[0], op.k[1])};
+			break;
+		case TOP_BLEND: out = {min(a.min, b.min), max(a.max, b.max)}; break;
+		case TOP_FBM2:
+		case TOP_FBM3: {
+			float sum = 0.0f, amp = op.k[1];
+			for (int o = 0; o < op.n; o++, amp *= op.k[3])
+				sum += std::fabs(amp);
+			sum *= NOISE_BOUND;
+			out = {-sum, sum};
+			break;
+		}
+		case TOP_SLOPE: out = {0.0f, INFINITY}; break;
+		case TOP_MATERIAL:
+			out = {op.k[0], op.k[0]};
+			for (int r = op.n; r < op.n + op.m; r++) {
+				out.min = min(out.min, (float)rules[r].material);
+				out.max = max(out.max, (float)rules[r].material);
+			}
+			break;
+		case TOP_RANDOM: out = {0.0f, 1.0f}; break;
+		case TOP_N:
+			break;
+		}
+	}
+
+	int m = 1;
+	if (material != -1)
+		m = iv[material].min == iv[material].max ? (int)iv[material].min : -1;
+	return {iv[density].min, iv[density].max, m};
+}
+
+} // namespace Map
@@ -0,0 +1,133 @@
+#pragma once
+
+#include "Core/Vector.h"
+#include "Core/Error.h"
+#include "Math/Vec.h"
+#include "Math/Noise.h"
+
+// Conservative range of densities over a box of points, 'm' is the material
+// of all solid points or -1 if it varies.
+struct DensityBounds {
+	float min;
+	float max;
+	int m;
+};
+
+namespace Map {
+
+// Every op writes one register (its own index) and reads registers of the
+// ops before it. Coordinates are in chunks, density is negative inside the
+// terrain.
+enum TerrainOpCode {
+	TOP_X,        // sample coordinates
+	TOP_Y,
+	TOP_Z,
+	TOP_CONST,    // k[0]
+	TOP_ADD,      // a + b
+	TOP_SUB,      // a - b
+	TOP_MUL,      // a * b
+	TOP_MIN,      // min(a, b)
+	TOP_MAX,      // max(a, b)
+	TOP_MAD,      // a * k[0] + k[1]
+	TOP_CLAMP,    // clamp(a, k[0], k[1])
+	TOP_BLEND,    // lerp(a, b, clamp(c, 0, 1))
+	TOP_FBM2,     // 'n' octaves of Noise2D at (a, b), see TerrainOp::k
+	TOP_FBM3,     // 'n' octaves of Noise3D at (a, b, c)
+	TOP_SLOPE,    // slope of the heightfield 'a', which may only depend on x and z
+	TOP_MATERIAL, // first matching rule of [n, n+m) for height 'a' and slope 'b' or k[0]
+	TOP_RANDOM,   // [0, 1) per lattice cell of (a, b, c) * k[0] and the world seed, 'n' picks the stream
+
+	TOP_N,
+};
+
+struct TerrainOp {
+	TerrainOpCode code = TOP_CONST;
+	int a = -1;
+	int b = -1;
+	int c = -1;
+	int n = 0;
+	int m = 0;
+	// fbm: frequency, amplitude, lacunarity, gain
+	float k[4] = {0, 0, 0, 0};
+};
+
+// Matches when min <= value < max for both the height and the slope.
+struct TerrainMaterialRule {
+	float min_height;
+	float max_height;
+	float min_slope;
+	float max_slope;
+	int material;
+};
+
+// Per thread evaluation state of a TerrainGraph, rows of all registers.
+struct TerrainRows {
+	Vector<float> data;
+	// registers which are affine in the sample index: base + step * i
+	Vector<uint8_t> affine;
+	Vector<float> base;
+	Vector<float> step;
+
+	// rows of ops which don't depend on y are kept if the next row only
+	// differs in y, see TerrainGraph::eval_row
+	const struct TerrainGraph *last_graph = nullptr;
+	Vec3 last_p;
+	float last_step = 0.0f;
+	int last_n = 0;
+};
+
+// Rows of the ops which don't depend on y for every z row of a chunk column,
+// the same for all chunks stacked along y. See ColumnCache.
+struct TerrainColumn {
+	int n = 0; // samples per row
+	int rows_n = 0; // z rows
+	Vector<float> data;
+	Vector<uint8_t> affine;
+	Vector<float> base;
+	Vector<float> step;
+};
+
+// Data-driven density function. Built from a description (see
+// scripts/terrain.lua), validated by compile() and then evaluated a row of
+// samples at a time, so the dispatch is per op and row rather than per
+// sample. Noise over affine coordinates goes through Noise*D::get_row.
+struct TerrainGraph {
+	Vector<TerrainOp> ops;
+	Vector<TerrainMaterialRule> rules;
+	int density = -1;
+	int material = -1;
+
+	// computed by compile(), for every TOP_SLOPE the ops its input depends
+	// on, [cones_offset[i], cones_offset[i+1]) in 'cones'
+	Vector<int> cones;
+	Vector<int> cones_offset;
+	// computed by compile(), ops which depend on the y coordinate and the
+	// ones which don't
+	Vector<uint8_t> uses_y;
+	Vector<int> column_ops;
+
+	const Noise2D *n2d = nullptr;
+	const Noise3D *n3d = nullptr;
+	uint64_t seed = 0;
+
+	int add(const TerrainOp &op) { ops.append(op); return ops.length() - 1; }
+	bool compile(Error *err = &DefaultError);
+
+	// Evaluates 'n' samples starting at 'p', 'step' apart along x. Heightfield
+	// parts of the graph are reused between rows which only differ in y.
+	void eval_row(float *density_out, int *material_out, int n,
+		const Vec3 &p, float step, TerrainRows *rows) const;
+	DensityBounds bounds(const Vec3 &min, const Vec3 &max) const;
+
+	// Saves the y independent rows after the first eval_row of a z row, or
+	// restores them before it, eval_row then starts with the y dependent ops.
+	void store_column_row(TerrainColumn *column, int zrow, int rows_n,
+		const TerrainRows &rows) const;
+	void load_column_row(TerrainRows *rows, const TerrainColumn &column,
+		int zrow, const Vec3 &p, float step) const;
+};
+
+// Returns TOP_N if the name is unknown.
+TerrainOpCode terrain_op_from_name(const char *name);
+
+} // namespace Map
@@ -1,6 +1,9 @@
 #include "Math/Noise.h"
 #include "Core/Memory.h"
 #include <random>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static inline float lerp(float a, float b, float v)
 {
@@ -186,3 +189,171 @@ float Noise2D::get(float x, float y) const
 	float fy = Smooth(y - origins[0].y);
 	return lerp(vx0, vx1, fy);
 }
+
+//------------------------------------------------------------------------------
+// Rows
+//------------------------------------------------------------------------------
+
+// The batch versions repeat the exact sequence of float operations of get(),
+// so that the results don't depend on whether SSE is used or not. Lookups
+// are done per lane, the rest is 4 points at a time.
+
+#ifdef __SSE2__
+
+static inline __m128 lerp4(__m128 a, __m128 b, __m128 v)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	return _mm_add_ps(_mm_mul_ps(a, _mm_sub_ps(one, v)), _mm_mul_ps(b, v));
+}
+
+static inline __m128 smooth4(__m128 v)
+{
+	const __m128 two = _mm_set1_ps(2.0f);
+	const __m128 three = _mm_set1_ps(3.0f);
+	return _mm_mul_ps(_mm_mul_ps(v, v), _mm_sub_ps(three, _mm_mul_ps(two, v)));
+}
+
+// floor for values within the int range
+static inline __m128 floor4(__m128 v)
+{
+	const __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+	const __m128 fix = _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0f));
+	return _mm_sub_ps(t, fix);
+}
+
+static inline __m128 row_positions(float x, float step, int i)
+{
+	const __m128 idx = _mm_cvtepi32_ps(_mm_setr_epi32(i, i+1, i+2, i+3));
+	return _mm_add_ps(_mm_set1_ps(x), _mm_mul_ps(_mm_set1_ps(step), idx));
+}
+
+#endif
+
+void Noise3D::get_row(float *out, int n, float x, float step, float y, float z) const
+{
+	int i = 0;
+#ifdef __SSE2__
+	const float y0f = std::floor(y);
+	const float z0f = std::floor(z);
+	const int y0 = y0f;
+	const int z0 = z0f;
+	const int pyz[4] = {
+		m_permutations[y0 & 255] + m_permutations[z0 & 255],
+		m_permutations[y0 & 255] + m_permutations[(z0+1) & 255],
+		m_permutations[(y0+1) & 255] + m_permutations[z0 & 255],
+		m_permutations[(y0+1) & 255] + m_permutations[(z0+1) & 255],
+	};
+	const __m128 dy[2] = {
+		_mm_set1_ps(y - (y0f + 0.0f)),
+		_mm_set1_ps(y - (y0f + 1.0f)),
+	};
+	const __m128 dz[2] = {
+		_mm_set1_ps(z - (z0f + 0.0f)),
+		_mm_set1_ps(z - (z0f + 1.0f)),
+	};
+	const __m128 fy = smooth4(dy[0]);
+	const __m128 fz = smooth4(dz[0]);
+
+	for (; i + 4 <= n; i += 4) {
+		const __m128 xs = row_positions(x, step, i);
+		const __m128 x0f = floor4(xs);
+		const __m128 dx[2] = {
+			_mm_sub_ps(xs, _mm_add_ps(x0f, _mm_set1_ps(0.0f))),
+			_mm_sub_ps(xs, _mm_add_ps(x0f, _mm_set1_ps(1.0f))),
+		};
+		alignas(16) int x0[4];
+		_mm_store_si128((__m128i*)x0, _mm_cvttps_epi32(x0f));
+
+		// corners in the order of get_gradients: x, y, z bits from high to low
+		__m128 vals[8];
+		for (int c = 0; c < 8; c++) {
+			const int cx = c >> 2, cyz = c & 3;
+			alignas(16) float gx[4], gy[4], gz[4];
+			for (int l = 0; l < 4; l++) {
+				const int idx = m_permutations[(x0[l] + cx) & 255] + pyz[cyz];
+				const Vec3 &g = m_gradients[idx & 255];
+				gx[l] = g.x;
+				gy[l] = g.y;
+				gz[l] = g.z;
+			}
+			vals[c] = _mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(_mm_load_ps(gx), dx[cx]),
+				_mm_mul_ps(_mm_load_ps(gy), dy[cyz >> 1])),
+				_mm_mul_ps(_mm_load_ps(gz), dz[cyz & 1]));
+		}
+
+		const __m128 vz0 = lerp4(vals[0], vals[1], fz);
+		const __m128 vz1 = lerp4(vals[2], vals[3], fz);
+		const __m128 vz2 = lerp4(vals[4], vals[5], fz);
+		const __m128 vz3 = lerp4(vals[6], vals[7], fz);
+		const __m128 vy0 = lerp4(vz0, vz1, fy);
+		const __m128 vy1 = lerp4(vz2, vz3, fy);
+		_mm_storeu_ps(out + i, lerp4(vy0, vy1, smooth4(dx[0])));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = get(x + step * (float)i, y, z);
+}
+
+void Noise3D::get_block(float *out, const Vec3i &size, const Vec3 &p,
+	const Vec3 &step) const
+{
+	for (int z = 0; z < size.z; z++) {
+	for (int y = 0; y < size.y; y++) {
+		get_row(out, size.x, p.x, step.x,
+			p.y + step.y * (float)y, p.z + step.z * (float)z);
+		out += size.x;
+	}}
+}
+
+void Noise2D::get_row(float *out, int n, float x, float step, float y) const
+{
+	int i = 0;
+#ifdef __SSE2__
+	const float y0f = floorf(y);
+	const int y0 = y0f;
+	const int py[2] = {
+		m_permutations[y0 & 255],
+		m_permutations[(y0+1) & 255],
+	};
+	const __m128 dy[2] = {
+		_mm_set1_ps(y - (y0f + 0.0f)),
+		_mm_set1_ps(y - (y0f + 1.0f)),
+	};
+	const __m128 fy = smooth4(dy[0]);
+
+	for (; i + 4 <= n; i += 4) {
+		const __m128 xs = row_positions(x, step, i);
+		const __m128 x0f = floor4(xs);
+		const __m128 dx[2] = {
+			_mm_sub_ps(xs, _mm_add_ps(x0f, _mm_set1_ps(0.0f))),
+			_mm_sub_ps(xs, _mm_add_ps(x0f, _mm_set1_ps(1.0f))),
+		};
+		alignas(16) int x0[4];
+		_mm_store_si128((__m128i*)x0, _mm_cvttps_epi32(x0f));
+
+		// corners in the order of get_gradients: x bit is the low one
+		__m128 vals[4];
+		for (int c = 0; c < 4; c++) {
+			const int cx = c & 1, cy = c >> 1;
+			alignas(16) float gx[4], gy[4];
+			for (int l = 0; l < 4; l++) {
+				const int idx = m_permutations[(x0[l] + cx) & 255] + py[cy];
+				const Vec2 &g = m_gradients[idx & 255];
+				gx[l] = g.x;
+				gy[l] = g.y;
+			}
+			vals[c] = _mm_add_ps(
+				_mm_mul_ps(_mm_load_ps(gx), dx[cx]),
+				_mm_mul_ps(_mm_load_ps(gy), dy[cy]));
+		}
+
+		const __m128 fx = smooth4(dx[0]);
+		const __m128 vx0 = lerp4(vals[0], vals[1], fx);
+		const __m128 vx1 = lerp4(vals[2], vals[3], fx);
+		_mm_storeu_ps(out + i, lerp4(vx0, vx1, fy));
+	}
+#endif
+	for (; i < n; i++)
+		out[i] = get(x + step * (float)i, y);
+}
@@ -12,6 +12,14 @@ struct Noise3D {
 		float x, float y, float z) const;
 
 	float get(float x, float y, float z) const;
+
+	// Evaluates 'n' points (x + step*i, y, z), results are bit-identical to
+	// get(). Uses SSE2 when available.
+	void get_row(float *out, int n, float x, float step, float y, float z) const;
+	// Evaluates a block of size.x * size.y * size.z points starting at 'p',
+	// 'step' apart, x-major like offset_3d.
+	void get_block(float *out, const Vec3i &size, const Vec3 &p,
+		const Vec3 &step) const;
 };
 
 struct Noise2D {
@@ -22,4 +30,7 @@ struct Noise2D {
 	Vec2 get_gradient(int x, int y) const;
 	void get_gradients(Vec2 *origins, Vec2 *grads, float x, float y) const;
 	float get(float x, float y) const;
+
+	// Evaluates 'n' points (x + step*i, y), same as Noise3D::get_row.
+	void get_row(float *out, int n, float x, float step, float y) const;
 };
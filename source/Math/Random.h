@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Math/Vec.h"
+#include <cstdint>
+
+// Finalizer of SplitMix64, every bit of the input affects every bit of the
+// output.
+static inline uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+// Key of the stream for a given world seed, location (e.g. a chunk or a
+// lattice cell) and purpose, so that different features of the same location
+// don't share numbers.
+static inline uint64_t random_key(uint64_t seed, const Vec3i &location,
+	uint32_t stream = 0)
+{
+	uint64_t h = mix64(seed ^ 0x6A09E667F3BCC909ULL);
+	h = mix64(h ^ (uint32_t)location.x);
+	h = mix64(h ^ ((uint64_t)(uint32_t)location.y << 32));
+	h = mix64(h ^ (uint32_t)location.z);
+	return mix64(h ^ ((uint64_t)stream << 32));
+}
+
+// Counter-based random numbers: the n-th value is a function of the key and
+// n only. Streams keyed by the world seed and a location produce the same
+// values no matter which worker uses them or in what order, unlike a shared
+// generator.
+struct RandomStream {
+	uint64_t key = 0;
+	uint64_t counter = 0;
+
+	RandomStream() = default;
+	explicit RandomStream(uint64_t key): key(key) {}
+
+	uint64_t at(uint64_t n) const { return mix64(key + (n + 1) * 0x9E3779B97F4A7C15ULL); }
+	uint64_t next_uint64() { return at(counter++); }
+	uint32_t next_uint32() { return next_uint64() >> 32; }
+
+	// [0, 1)
+	float next_float() { return (next_uint64() >> 40) * (1.0f / 16777216.0f); }
+
+	// [lo, hi]
+	int next_int(int lo, int hi)
+	{
+		const uint64_t range = (uint64_t)((int64_t)hi - lo + 1);
+		return lo + (int)((next_uint32() * range) >> 32);
+	}
+};
@@ -11,20 +11,30 @@ enum EventID {
 
 	EID_MAP_STORAGE_REQUEST,
 	EID_MAP_STORAGE_RESPONSE,
+	EID_MAP_STORAGE_PREFETCH,
 
 	EID_GENERATE_MAP_CHUNK_REQUEST,
 	EID_MAP_CHUNK_GENERATED_INTERNAL,
 	EID_MAP_CHUNK_GENERATED,
+	EID_GENERATE_MAP_CHUNKS_REQUEST,
+	EID_MAP_CHUNKS_GENERATED_INTERNAL,
+	EID_MAP_CHUNKS_GENERATED,
+	EID_MAP_GENERATOR_CHANGED,
 
 	EID_MAP_STORAGE_CHUNK_SAVED,
+	EID_MAP_STORAGE_CHECKPOINT,
 	EID_MAP_STORAGE_CHUNK_LOADED,
 	EID_MAP_STORAGE_CHUNK_PRELOADED,
+	EID_MAP_CHUNKS_UNPACKED,
+	EID_MAP_CHUNK_LODS_BUILT,
 	EID_MAP_CHUNK_GEOMETRY_GENERATED,
+	EID_MAP_CHUNK_GEOMETRY_STORED,
 
 	EID_CHUNKS_UPDATED,
 
 	EID_QUEUE_CPU_TASK,
 	EID_QUEUE_IO_TASK,
+	EID_QUEUE_IO_READ_TASK,
 };
 
 struct EventHandler {
@@ -2,7 +2,10 @@
 #include "Core/Defer.h"
 
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <cstdio>
+#include <cerrno>
+#include <fcntl.h>
 #include <linux/limits.h>
 #include <unistd.h>
 #include <fnmatch.h>
@@ -54,6 +57,177 @@ void write_file(const char *filename, Slice<const uint8_t> data, Error *err)
 	}
 }
 
+//----------------------------------------------------------------------
+// Files
+//----------------------------------------------------------------------
+
+struct File {
+	int fd;
+	String filename;
+};
+
+File *open_file(const char *filename, int flags, Error *err)
+{
+	int oflags = 0;
+	if ((flags & FF_READ) && (flags & FF_WRITE))
+		oflags = O_RDWR;
+	else if (flags & FF_WRITE)
+		oflags = O_WRONLY;
+	else
+		oflags = O_RDONLY;
+	if (flags & FF_CREATE)
+		oflags |= O_CREAT;
+
+	const int fd = ::open(filename, oflags, 0666);
+	if (fd == -1) {
+		err->set("failed to open file: %s (errno: %d)", filename, errno);
+		return nullptr;
+	}
+
+	File *f = new (OrDie) File;
+	f->fd = fd;
+	f->filename = filename;
+	return f;
+}
+
+void close_file(File *f)
+{
+	::close(f->fd);
+	delete f;
+}
+
+int64_t file_size(File *f, Error *err)
+{
+	struct stat st;
+	if (-1 == fstat(f->fd, &st)) {
+		err->set("failed to get the size of the file: %s",
+			f->filename.c_str());
+		return 0;
+	}
+	return st.st_size;
+}
+
+void read_at(File *f, Slice<uint8_t> out, int64_t offset, Error *err)
+{
+	int done = 0;
+	while (done < out.length) {
+		const ssize_t n = ::pread(f->fd, out.data + done,
+			out.length - done, offset + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			err->set("failed to read %d bytes at %lld from the file: %s",
+				out.length, (long long)offset, f->filename.c_str());
+			return;
+		}
+		done += n;
+	}
+}
+
+void write_at(File *f, Slice<const uint8_t> data, int64_t offset, Error *err)
+{
+	int done = 0;
+	while (done < data.length) {
+		const ssize_t n = ::pwrite(f->fd, data.data + done,
+			data.length - done, offset + done);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			err->set("failed to write %d bytes at %lld to the file: %s",
+				data.length, (long long)offset, f->filename.c_str());
+			return;
+		}
+		done += n;
+	}
+}
+
+void sync_file(File *f, Error *err)
+{
+	if (-1 == ::fsync(f->fd))
+		err->set("failed to sync the file: %s", f->filename.c_str());
+}
+
+void truncate_file(File *f, int64_t size, Error *err)
+{
+	if (-1 == ::ftruncate(f->fd, size))
+		err->set("failed to truncate the file: %s", f->filename.c_str());
+}
+
+bool file_exists(const char *filename)
+{
+	struct stat st;
+	return stat(filename, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+void remove_file(const char *filename, Error *err)
+{
+	if (-1 == ::unlink(filename))
+		err->set("failed to remove file: %s (errno: %d)", filename, errno);
+}
+
+void rename_file(const char *from, const char *to, Error *err)
+{
+	if (-1 == ::rename(from, to))
+		err->set("failed to rename file: %s to %s (errno: %d)", from, to, errno);
+}
+
+//----------------------------------------------------------------------
+// MappedFile
+//----------------------------------------------------------------------
+
+MappedFile::~MappedFile()
+{
+	if (addr)
+		munmap(addr, length);
+}
+
+static MappedFile *map_fd(int fd, const char *filename, int64_t offset,
+	int length, Error *err)
+{
+	MappedFile *mf = new (OrDie) MappedFile;
+	if (length == 0)
+		return mf;
+
+	// mmap wants the offset to be a multiple of the page size
+	const int64_t page_size = sysconf(_SC_PAGESIZE);
+	const int64_t aligned_offset = offset - offset % page_size;
+	const int64_t delta = offset - aligned_offset;
+
+	void *addr = mmap(nullptr, delta + length, PROT_READ, MAP_SHARED,
+		fd, aligned_offset);
+	if (addr == MAP_FAILED) {
+		err->set("failed to map %d bytes at %lld of the file: %s (errno: %d)",
+			length, (long long)offset, filename, errno);
+		delete mf;
+		return nullptr;
+	}
+
+	mf->addr = addr;
+	mf->length = delta + length;
+	mf->data = Slice<const uint8_t>((const uint8_t*)addr + delta, length);
+	return mf;
+}
+
+MappedFile *map_file(const char *filename, Error *err)
+{
+	File *f = open_file(filename, FF_READ, err);
+	if (*err)
+		return nullptr;
+	DEFER { close_file(f); };
+
+	const int64_t size = file_size(f, err);
+	if (*err)
+		return nullptr;
+
+	// the mapping stays valid after the descriptor is closed
+	return map_fd(f->fd, filename, 0, size, err);
+}
+
+MappedFile *map_file(File *f, int64_t offset, int length, Error *err)
+{
+	return map_fd(f->fd, f->filename.c_str(), offset, length, err);
+}
+
 //----------------------------------------------------------------------
 // Path-related Utils
 //----------------------------------------------------------------------
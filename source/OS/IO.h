@@ -15,6 +15,58 @@ Vector<uint8_t> read_file(const char *filename, Error *err = &DefaultError);
 void write_file(const char *filename, Slice<const uint8_t> data,
 	Error *err = &DefaultError);
 
+//----------------------------------------------------------------------
+// Files
+//----------------------------------------------------------------------
+
+enum FileFlags {
+	FF_READ   = 1 << 0,
+	FF_WRITE  = 1 << 1,
+	FF_CREATE = 1 << 2,
+};
+
+// Unbuffered file handle for positional I/O, keep it open and reuse it
+// instead of reopening the file for each read or write.
+struct File;
+
+File *open_file(const char *filename, int flags, Error *err = &DefaultError);
+void close_file(File *f);
+int64_t file_size(File *f, Error *err = &DefaultError);
+
+// Reads exactly 'out.length' bytes at a given offset, short reads are errors.
+void read_at(File *f, Slice<uint8_t> out, int64_t offset,
+	Error *err = &DefaultError);
+void write_at(File *f, Slice<const uint8_t> data, int64_t offset,
+	Error *err = &DefaultError);
+void sync_file(File *f, Error *err = &DefaultError);
+void truncate_file(File *f, int64_t size, Error *err = &DefaultError);
+
+bool file_exists(const char *filename);
+void remove_file(const char *filename, Error *err = &DefaultError);
+// Replaces 'to' if it exists, atomically on POSIX.
+void rename_file(const char *from, const char *to, Error *err = &DefaultError);
+
+//----------------------------------------------------------------------
+// MappedFile
+//----------------------------------------------------------------------
+
+// Read-only memory mapping of a file or a range of it. 'data' points to the
+// requested range, which doesn't have to be page-aligned. Use it with a
+// ByteReader to parse the contents without copying them out of the page cache.
+struct MappedFile {
+	Slice<const uint8_t> data;
+	void *addr = nullptr;
+	size_t length = 0;
+
+	NG_DELETE_COPY_AND_MOVE(MappedFile);
+	MappedFile() = default;
+	~MappedFile();
+};
+
+MappedFile *map_file(const char *filename, Error *err = &DefaultError);
+MappedFile *map_file(File *f, int64_t offset, int length,
+	Error *err = &DefaultError);
+
 //----------------------------------------------------------------------
 // Path-related Utils
 //----------------------------------------------------------------------
@@ -1,18 +1,28 @@
 #include "OS/WorkerPool.h"
 #include "OS/IO.h"
+#include "Math/Utils.h"
 #include "Script/Lua.h"
 #include <SDL2/SDL.h>
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 
-static int worker_thread(void *data)
-{
-	Worker *w = (Worker*)data;
-	printf("%s on duty\n", w->name.c_str());
+constexpr int DEFAULT_IO_READERS_N = 2;
+constexpr int IO_READ_BATCH_N = 8;
 
-	// init worker lua vm
+static void init_worker_vm()
+{
 	LuaVM *vm = NG_WorkerLuaWM.get();
 	vm->init_worker();
 	vm->do_file("boot.lua");
 	vm->on_event = InterLua::Global(vm->L, "global")["OnEvent"];
+}
+
+static int worker_thread(void *data)
+{
+	Worker *w = (Worker*)data;
+	printf("%s on duty\n", w->name.c_str());
+	init_worker_vm();
 
 	while (true) {
 		WorkerTaskInternal task = w->incoming->pop();
@@ -26,6 +36,74 @@ static int worker_thread(void *data)
 	return 0;
 }
 
+static int io_reader_thread(void *data)
+{
+	Worker *w = (Worker*)data;
+	printf("%s on duty\n", w->name.c_str());
+	init_worker_vm();
+
+	Vector<ReadTaskInternal> batch;
+	while (true) {
+		w->reads->pop_batch(&batch, IO_READ_BATCH_N);
+		if (batch.first().task.execute == nullptr)
+			break;
+		for (const ReadTaskInternal &rt : batch) {
+			(*rt.task.execute)(rt.task.data);
+			w->outgoing->push(rt.task);
+		}
+	}
+
+	printf("%s shutting down\n", w->name.c_str());
+	return 0;
+}
+
+ReadQueue::ReadQueue():
+	mutex(SDL_CreateMutex()), cond(SDL_CreateCond())
+{
+	NG_ASSERT(mutex != nullptr);
+	NG_ASSERT(cond != nullptr);
+}
+
+ReadQueue::~ReadQueue()
+{
+	SDL_DestroyMutex(mutex);
+	SDL_DestroyCond(cond);
+}
+
+void ReadQueue::push(const WorkerTaskInternal &task, int priority, int64_t locality)
+{
+	SDL_LockMutex(mutex);
+	DEFER { SDL_UnlockMutex(mutex); };
+	heap.push({task, priority, locality, seq++});
+	SDL_CondSignal(cond);
+}
+
+void ReadQueue::pop_batch(Vector<ReadTaskInternal> *out, int max)
+{
+	out->clear();
+	{
+		SDL_LockMutex(mutex);
+		DEFER { SDL_UnlockMutex(mutex); };
+		while (heap.length() == 0)
+			SDL_CondWait(cond, mutex);
+
+		// quit requests are queued with the lowest priority, so that pending
+		// reads are done first, and are never batched
+		out->append(heap.pop());
+		if (out->first().task.execute == nullptr)
+			return;
+		while (out->length() < max && heap.length() > 0 &&
+			heap.m_data[0].task.execute != nullptr)
+			out->append(heap.pop());
+	}
+	std::sort(out->data(), out->data() + out->length(),
+		[](const ReadTaskInternal &a, const ReadTaskInternal &b) {
+			if (a.locality != b.locality)
+				return a.locality < b.locality;
+			return a.seq < b.seq;
+		});
+}
+
 void WorkerPool::finalize_tasks()
 {
 	AsyncQueue<WorkerTaskInternal> &q = m_impl->from_workers;
@@ -42,7 +120,7 @@ void WorkerPool::finalize_tasks()
 	to_finalize.clear();
 }
 
-WorkerPool::WorkerPool(int ncpu)
+WorkerPool::WorkerPool(int ncpu, int nio)
 {
 	if (NG_WorkerPool)
 		die("There can only be one WorkerPool");
@@ -52,6 +130,11 @@ WorkerPool::WorkerPool(int ncpu)
 		ncpu = SDL_GetCPUCount();
 	if (IO::get_environment("NEXTGAME_CPU_N") == "1")
 		ncpu = 1;
+	if (nio == 0)
+		nio = DEFAULT_IO_READERS_N;
+	const String nio_env = IO::get_environment("NEXTGAME_IO_N");
+	if (nio_env != "")
+		nio = max(1, atoi(nio_env.c_str()));
 
 	m_impl = new (OrDie) WorkerPoolImpl;
 
@@ -72,12 +155,24 @@ WorkerPool::WorkerPool(int ncpu)
 	wpi->io_worker.thread = SDL_CreateThread(worker_thread,
 		wpi->io_worker.name.c_str(), &wpi->io_worker);
 
+	wpi->io_readers.resize(nio);
+	i = 0;
+	for (Worker &w : wpi->io_readers) {
+		w.name = String::format("NG I/O Reader #%d", i++);
+		w.reads = &wpi->to_io_readers;
+		w.outgoing = &wpi->from_workers;
+		w.thread = SDL_CreateThread(io_reader_thread, w.name.c_str(), &w);
+	}
+
 	NG_EventManager->register_handler(EID_QUEUE_CPU_TASK,
 		PASS_TO_METHOD(WorkerPool, handle_queue_cpu_task),
 		this, false);
 	NG_EventManager->register_handler(EID_QUEUE_IO_TASK,
 		PASS_TO_METHOD(WorkerPool, handle_queue_io_task),
 		this, false);
+	NG_EventManager->register_handler(EID_QUEUE_IO_READ_TASK,
+		PASS_TO_METHOD(WorkerPool, handle_queue_io_read_task),
+		this, false);
 }
 
 WorkerPool::~WorkerPool()
@@ -85,10 +180,14 @@ WorkerPool::~WorkerPool()
 	for (int i = 0; i < m_impl->cpu_workers.length(); i++)
 		m_impl->to_cpu_workers.push(WorkerTaskInternal());
 	m_impl->to_io_worker.push(WorkerTaskInternal());
+	for (int i = 0; i < m_impl->io_readers.length(); i++)
+		m_impl->to_io_readers.push(WorkerTaskInternal(), INT_MAX, 0);
 
 	for (Worker &w : m_impl->cpu_workers)
 		SDL_WaitThread(w.thread, nullptr);
 	SDL_WaitThread(m_impl->io_worker.thread, nullptr);
+	for (Worker &w : m_impl->io_readers)
+		SDL_WaitThread(w.thread, nullptr);
 	delete m_impl;
 
 	NG_EventManager->unregister_handlers(this);
@@ -117,4 +216,15 @@ void WorkerPool::handle_queue_io_task(RTTIObject *event)
 	m_impl->to_io_worker.push(wti);
 }
 
+void WorkerPool::handle_queue_io_read_task(RTTIObject *event)
+{
+	EWorkerTask *wt = EWorkerTask::cast(event);
+
+	WorkerTaskInternal wti;
+	wti.data = wt->data;
+	wti.execute = wt->execute;
+	wti.finalize = wt->finalize;
+	m_impl->to_io_readers.push(wti, wt->priority, wt->locality);
+}
+
 WorkerPool *NG_WorkerPool = nullptr;
@@ -2,6 +2,7 @@
 
 #include "Core/Vector.h"
 #include "Core/String.h"
+#include "Core/Heap.h"
 #include "OS/WorkerTask.h"
 #include "OS/AsyncQueue.h"
 
@@ -13,18 +14,55 @@ struct WorkerTaskInternal {
 	void (*finalize)(RTTIObject *data) = nullptr;
 };
 
+struct ReadTaskInternal {
+	WorkerTaskInternal task;
+	int priority;
+	int64_t locality;
+	int64_t seq;
+
+	bool operator<(const ReadTaskInternal &r) const
+	{
+		if (priority != r.priority)
+			return priority < r.priority;
+		return seq < r.seq;
+	}
+};
+
+// Pending I/O reads. Readers take the most urgent reads in batches and
+// execute each batch in locality order, which keeps reads of the same region
+// file together.
+struct ReadQueue {
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	Heap<ReadTaskInternal> heap;
+	int64_t seq = 0;
+
+	void push(const WorkerTaskInternal &task, int priority, int64_t locality);
+	// Blocks until there is something to read, a batch with a nullptr
+	// 'execute' task means quit.
+	void pop_batch(Vector<ReadTaskInternal> *out, int max);
+
+	NG_DELETE_COPY_AND_MOVE(ReadQueue);
+	ReadQueue();
+	~ReadQueue();
+};
+
 struct Worker {
 	String name;
 	AsyncQueue<WorkerTaskInternal> *incoming;
 	AsyncQueue<WorkerTaskInternal> *outgoing;
+	ReadQueue *reads = nullptr;
 	SDL_Thread *thread;
 	int n;
 };
 
 struct WorkerPoolImpl {
+	// writes go through a single worker, in the order they were queued
 	Worker io_worker;
+	Vector<Worker> io_readers;
 	Vector<Worker> cpu_workers;
 	AsyncQueue<WorkerTaskInternal> to_io_worker;
+	ReadQueue to_io_readers;
 	AsyncQueue<WorkerTaskInternal> to_cpu_workers;
 	AsyncQueue<WorkerTaskInternal> from_workers;
 };
@@ -39,13 +77,15 @@ struct WorkerPool :	RTTIBase<WorkerPool>
 	WorkerPoolImpl *m_impl = nullptr;
 	void finalize_tasks();
 
-	// ncpu == 0 means auto detect
+	// ncpu == 0 means auto detect, nio == 0 means default number of I/O
+	// readers
 	WorkerPool(): WorkerPool(0) {}
-	explicit WorkerPool(int ncpu);
+	explicit WorkerPool(int ncpu, int nio = 0);
 	~WorkerPool();
 
 	void handle_queue_cpu_task(RTTIObject *event);
 	void handle_queue_io_task(RTTIObject *event);
+	void handle_queue_io_read_task(RTTIObject *event);
 };
 
 extern WorkerPool *NG_WorkerPool;
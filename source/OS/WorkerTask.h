@@ -8,6 +8,11 @@ struct EWorkerTask : RTTIBase<EWorkerTask>
 	RTTIObject *data = nullptr;
 	void (*execute)(RTTIObject *data) = nullptr;
 	void (*finalize)(RTTIObject *data) = nullptr;
+
+	// I/O reads only (EID_QUEUE_IO_READ_TASK). Lower priority goes first,
+	// reads with close locality keys touch nearby data, e.g. the same file.
+	int priority = 0;
+	int64_t locality = 0;
 };
 
 template <EventID EID>
@@ -0,0 +1,259 @@
+// Headless world pregeneration. Generates and saves a box of storage chunks
+// without a window or a GL context, on all cores. Storage chunks which are
+// in the region files already are skipped, so an interrupted run continues
+// where it stopped.
+//
+// usage: nextgame-pregen [--seed <seed>] <directory> <min x> <min y> <min z> <max x> <max y> <max z> [terrain]
+//
+// The box is in storage chunks, inclusive. The terrain description defaults
+// to terrain/default.lua of the base directory, NEXTGAME_TERRAIN works as in
+// the game. The seed of a new world defaults to 0, an existing world keeps the
+// one it was made with.
+
+#include <SDL2/SDL.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "Core/Utils.h"
+#include "OOP/EventManager.h"
+#include "OS/WorkerPool.h"
+#include "OS/Timer.h"
+#include "Script/Lua.h"
+#include "Geometry/Global.h"
+#include "Map/Storage.h"
+#include "Map/Generator.h"
+#include "Map/LuaTerrainGraph.h"
+
+// Storage chunks being generated at once. Each one is split into plenty of
+// CPU tasks already, the second one keeps the workers busy while the first
+// one is finishing.
+static const int REQUESTS_IN_FLIGHT = 2;
+
+// seconds between progress lines
+static const double REPORT_INTERVAL = 5.0;
+
+static Map::Generator *pregen_generator = nullptr;
+
+static void SetTerrainGraph(InterLua::Ref args)
+{
+	auto graph = Map::terrain_graph_from_lua(args);
+	Error err;
+	if (!pregen_generator->set_graph(std::move(graph), &err))
+		printf("terrain graph is not used: %s\n", err.description());
+}
+
+struct Pregen : RTTIBase<Pregen>
+{
+	// storage chunks to generate, in the order of requests
+	Vector<Vec3i> queue;
+	int next = 0;
+	int in_flight = 0;
+	int done = 0;
+
+	NG_DELETE_COPY_AND_MOVE(Pregen);
+	Pregen();
+	~Pregen();
+
+	void issue_requests();
+	bool finished() const { return done == queue.length(); }
+	void handle_map_storage_response(RTTIObject *event);
+};
+
+Pregen::Pregen()
+{
+	NG_EventManager->register_handler(EID_MAP_STORAGE_RESPONSE,
+		PASS_TO_METHOD(Pregen, handle_map_storage_response), this, false);
+}
+
+Pregen::~Pregen()
+{
+	NG_EventManager->unregister_handlers(this);
+}
+
+void Pregen::issue_requests()
+{
+	int lods[8] = {0,0,0,0,0,0,0,0};
+	while (in_flight < REQUESTS_IN_FLIGHT && next < queue.length()) {
+		auto req = new (OrDie) EMapStorageRequest(this,
+			queue[next++] * STORAGE_CHUNK_SIZE, STORAGE_CHUNK_SIZE, lods);
+		NG_EventManager->fire(EID_MAP_STORAGE_REQUEST, req);
+		in_flight++;
+	}
+}
+
+void Pregen::handle_map_storage_response(RTTIObject *event)
+{
+	// the storage generated the missing chunks and saves them on its own,
+	// nothing to do with the contents
+	EMapStorageRequest *req = EMapStorageRequest::cast(event);
+	delete req;
+	in_flight--;
+	done++;
+}
+
+static bool parse_int(const char *s, int *out)
+{
+	char *end;
+	const long v = strtol(s, &end, 10);
+	if (*s == '\0' || *end != '\0')
+		return false;
+	*out = v;
+	return true;
+}
+
+static bool parse_uint64(const char *s, uint64_t *out)
+{
+	char *end;
+	const unsigned long long v = strtoull(s, &end, 10);
+	if (*s == '\0' || *s == '-' || *end != '\0')
+		return false;
+	*out = v;
+	return true;
+}
+
+static void print_usage()
+{
+	printf("usage: nextgame-pregen [--seed <seed>] <directory> "
+		"<min x> <min y> <min z> <max x> <max y> <max z> [terrain]\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t seed = 0;
+	bool has_seed = false;
+	if (argc >= 3 && strcmp(argv[1], "--seed") == 0) {
+		if (!parse_uint64(argv[2], &seed)) {
+			print_usage();
+			return 1;
+		}
+		has_seed = true;
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc != 8 && argc != 9) {
+		print_usage();
+		return 1;
+	}
+	Vec3i min, max;
+	for (int i = 0; i < 3; i++) {
+		if (!parse_int(argv[2+i], &min[i]) || !parse_int(argv[5+i], &max[i])) {
+			print_usage();
+			return 1;
+		}
+	}
+
+	EventManager event_manager;
+	WorkerPool worker_pool;
+	LuaVM lua_vm(LUA_VM_GLOBAL);
+
+	Map::StorageConfig storage_config;
+	storage_config.directory = argv[1];
+	storage_config.seed = seed;
+	{
+		Error err;
+		if (!Map::open_world(&storage_config, &err)) {
+			printf("Failed to open the world: %s\n", err.description());
+			return 1;
+		}
+		if (has_seed && storage_config.seed != seed) {
+			printf("%s was made with seed %llu, not %llu\n", argv[1],
+				(unsigned long long)storage_config.seed,
+				(unsigned long long)seed);
+			return 1;
+		}
+	}
+	Map::Storage storage(&storage_config);
+	Map::Generator generator(&storage_config);
+	pregen_generator = &generator;
+
+	lua_vm.init_common();
+	InterLua::Global(lua_vm.L, "global")["MODE"] = "pregen";
+	InterLua::GlobalNamespace(lua_vm.L).Namespace("global").
+		Function("SetTerrainGraph", SetTerrainGraph).
+	End();
+	lua_vm.do_file("boot.lua");
+	if (argc == 9)
+		lua_vm.do_format("require('terrain').LoadTerrain('%s')", argv[8]);
+	else
+		lua_vm.do_format("require('terrain').LoadTerrain(global.BASE_DIR..'/terrain/default.lua')");
+	{
+		Error err;
+		if (!storage.open(&err)) {
+			printf("Failed to open the world: %s\n", err.description());
+			return 1;
+		}
+	}
+
+	// resume, skip whatever is saved already
+	Pregen pregen;
+	int skipped = 0;
+	Timer t_scan;
+	for (int z = min.z; z <= max.z; z++) {
+	for (int y = min.y; y <= max.y; y++) {
+	for (int x = min.x; x <= max.x; x++) {
+		const Vec3i location(x, y, z);
+		if (!Map::storage_chunk_in_world(location)) {
+			printf("Storage chunk %d %d %d is out of the world, skipping\n",
+				VEC3(location));
+			continue;
+		}
+		Error err(EV_QUIET);
+		const bool has = storage.regions.has(location, &err);
+		if (err) {
+			printf("Failed to open the region of %d %d %d: %s\n",
+				VEC3(location), err.description());
+			return 1;
+		}
+		if (has) {
+			skipped++;
+			continue;
+		}
+		pregen.queue.append(location);
+	}}}
+	const double scan_time = t_scan.elapsed();
+	printf("Pregenerating %d storage chunks, %d saved already\n",
+		pregen.queue.length(), skipped);
+
+	// with force_save dirty storage chunks are saved on every storage tick,
+	// once a second, the saved ones are evicted once the budget is reached
+	storage.force_save = true;
+
+	Timer t_total;
+	Timer t_frame;
+	double last_report = 0;
+	while (!pregen.finished() || !storage.can_quit()) {
+		pregen.issue_requests();
+		storage.update(t_frame.delta());
+		NG_WorkerPool->finalize_tasks();
+
+		const double now = t_total.elapsed();
+		if (now - last_report >= REPORT_INTERVAL) {
+			last_report = now;
+			printf("%d/%d storage chunks generated, %d saved, %.1f chunks/sec\n",
+				pregen.done, pregen.queue.length(), storage.saved_storage_chunks,
+				generator.generated_chunks / now);
+		}
+		SDL_Delay(1);
+	}
+
+	const double total = t_total.elapsed();
+	const int n = storage.saved_storage_chunks;
+	const int64_t chunks = generator.generated_chunks;
+	printf("Pregenerated %d storage chunks (%lld chunks) in %.2f sec\n",
+		n, (long long)chunks, total);
+	if (total > 0) {
+		printf("  %.2f storage chunks/sec, %.1f chunks/sec\n",
+			n / total, chunks / total);
+	}
+	printf("  bytes written: %lld (%.1f MB, %.1f KB per storage chunk)\n",
+		(long long)storage.saved_bytes, storage.saved_bytes / (1024.0 * 1024.0),
+		n ? storage.saved_bytes / 1024.0 / n : 0.0);
+	printf("  resume scan: %.2f sec\n", scan_time);
+	printf("  generate: %.2f sec over CPU tasks (%.3f ms per chunk)\n",
+		generator.generate_time,
+		chunks ? generator.generate_time * 1000.0 / chunks : 0.0);
+	printf("  encode: %.2f sec, write and sync: %.2f sec over I/O tasks\n",
+		storage.save_encode_time, storage.save_write_time);
+	generator.column_cache->print_stats();
+	return 0;
+}
@@ -32,6 +32,7 @@
 #include "Map/Generator.h"
 #include "Map/Mutator.h"
 #include "Map/Map.h"
+#include "Map/LuaTerrainGraph.h"
 #include "OS/WorkerPool.h"
 #include "OS/IO.h"
 #include "Physics/Bullet.h"
@@ -357,16 +358,28 @@ Game::Game()
 
 	// MapConfig
 	map_config.visible_range = Vec3i(9, 4, 9);
+	map_config.mesh_cache_directory = "testworld/meshes";
 
 	// MapStorageConfig
 	map_storage_config.directory = "testworld";
+	map_storage_config.seed = (uint32_t)env.seed;
+	{
+		Error err;
+		if (!Map::open_world(&map_storage_config, &err))
+			die("Failed to open the world: %s", err.description());
+		if (map_storage_config.seed != (uint32_t)env.seed) {
+			warn("%s was made with seed %llu, env.seed is ignored",
+				map_storage_config.directory.c_str(),
+				(unsigned long long)map_storage_config.seed);
+		}
+	}
 	map_storage = make_unique<Map::Storage>(&map_storage_config);
 
 	// MapGenerator
-	map_generator = make_unique<Map::Generator>();
+	map_generator = make_unique<Map::Generator>(&map_storage_config);
 
 	// MapMutator
-	map_mutator = make_unique<Map::Mutator>();
+	map_mutator = make_unique<Map::Mutator>(&map_storage_config);
 
 	// Map
 	map = make_unique<Map::Map>(&map_config, &world_offset, bullet.get());
@@ -384,6 +397,11 @@ Game::Game()
 	character_controller->set_gravity(0.0f);
 
 	NG_LuaVM->do_file("init.lua");
+	{
+		Error err;
+		if (!map_storage->open(&err))
+			die("Failed to open the world: %s", err.description());
+	}
 	NG_LuaVM->on_event = InterLua::Global(NG_LuaVM->L, "global")["OnEvent"];
 	if (!NG_LuaVM->on_event) {
 		die("Lua init script must set global.OnEvent with a valid funciton");
@@ -453,6 +471,7 @@ bool Game::can_quit()
 {
 	return
 		map_storage->can_quit() &&
+		map_mutator->can_quit() &&
 	map->can_quit();
 }
 
@@ -503,10 +522,19 @@ static void AddMaterialPack(InterLua::Ref args)
 	mbuf.dump(7);
 }
 
+static void SetTerrainGraph(InterLua::Ref args)
+{
+	auto graph = Map::terrain_graph_from_lua(args);
+	Error err;
+	if (!NG_Game->map_generator->set_graph(std::move(graph), &err))
+		printf("terrain graph is not used: %s\n", err.description());
+}
+
 void Game::register_lua_functions()
 {
 	InterLua::GlobalNamespace(NG_LuaVM->L).Namespace("global").
 		Function("AddMaterialPack", AddMaterialPack).
+		Function("SetTerrainGraph", SetTerrainGraph).
 	End();
 }
 
@@ -970,6 +998,11 @@ void Game::info()
 			tris_visible += mesh->indices.length() / 3;
 	}
 	printf("Visible triangles: %d\n", tris_visible);
+	map_storage->print_memory_usage();
+	map_storage->print_prefetch_stats();
+	map_storage->print_request_stats();
+	map_generator->column_cache->print_stats();
+	map->mesh_cache.print_stats();
 
 	const Vec3 orig = character_controller->interpolated_position();
 	debug_draw.line(orig, orig+Vec3_X(5), Vec3_X());
@@ -0,0 +1,27 @@
+-- Default terrain, see scripts/terrain.lua for the available nodes.
+-- Coordinates are in chunks, materials refer to materials/terrain.lua.
+
+-- low frequency domain warp breaks up the regularity of the hills
+local wx = warp(x, {x = x, z = z, octaves = 2, frequency = 1/24, amplitude = 1.5})
+
+local height = fbm2{
+	x = wx, z = z,
+	octaves = 5,
+	frequency = 1/6,
+	amplitude = 1,
+}
+
+-- hills get rocky 3D detail, lowlands stay smooth
+local rocks = fbm3{x = x, y = y, z = z, frequency = 32/6, amplitude = 0.25}
+local surface = blend(height, height * 2 + rocks, (height - 0.1) * 10)
+
+return {
+	density = y - 2.5 - surface,
+	material = material{
+		height = y,
+		slope = slope(height),
+		default = 1,
+		{material = 3, min_slope = 1.5},
+		{material = 3, min_height = 3.1},
+	},
+}
@@ -0,0 +1,150 @@
+#include "stf.h"
+#include "Geometry/HermiteField.h"
+#include "Math/Noise.h"
+
+STF_SUITE_NAME("Geometry.HermiteFieldToMesh")
+
+static const Vec3i GRID(5);
+static const int LARGEST_LOD = 2;
+
+struct Grid {
+	// lods of every chunk of the grid
+	HermiteRLEField fields[5*5*5][LARGEST_LOD+1];
+};
+
+// Rolling hills crossing the middle layer of chunks, or 3D noise caves with a
+// surface in most voxel lines.
+static void make_grid(Grid *g, bool caves = false)
+{
+	const Noise2D n2d(0);
+	const Noise3D n3d(1);
+	const Vec3i fsize = CHUNK_SIZE + Vec3i(1);
+	for (int i = 0; i < volume(GRID); i++) {
+		const Vec3i cp = offset_to_3d(i, GRID);
+		HermiteField f(fsize);
+		for (int z = 0; z < fsize.z; z++) {
+		for (int x = 0; x < fsize.x; x++) {
+			const float wx = (cp.x * CHUNK_SIZE.x + x) / 64.0f;
+			const float wz = (cp.z * CHUNK_SIZE.z + z) / 64.0f;
+			const float h = CHUNK_SIZE.y * 1.5f + 12.0f * n2d.get(wx, wz);
+			for (int y = 0; y < fsize.y; y++) {
+				const float wy = cp.y * CHUNK_SIZE.y + y;
+				HermiteData &hd = f.get(Vec3i(x, y, z));
+				hd = HermiteData_Air();
+				if (caves ? n3d.get(wx, wy / 64.0f, wz) > 0 : wy < h)
+					hd.material = 1;
+				if (wy < h && wy + 1 >= h)
+					hd.y_edge = (h - wy) * 255.0f;
+			}
+		}}
+		g->fields[i][0] = HermiteRLEField(f);
+		for (int lod = 1; lod <= LARGEST_LOD; lod++) {
+			HermiteField reduced(CHUNK_SIZE / Vec3i(lod_factor(lod)) + Vec3i(1));
+			reduce_field(&reduced, f);
+			g->fields[i][lod] = HermiteRLEField(reduced);
+			f = std::move(reduced);
+		}
+	}
+}
+
+// Meshes the grid the way a ChunkMesh task does, one call per 2x2x2 group of
+// chunks, with a lod per octant. Neighbouring octants differ by a lod at most.
+static void mesh_grid(Vector<V3N3M1_terrain> &vertices, Vector<uint32_t> &indices,
+	const Grid &g, const int (&octant_lods)[8], bool reference = false)
+{
+	const Vec3i size = GRID - Vec3i(1);
+	for (int z = 0; z < size.z; z++) {
+	for (int y = 0; y < size.y; y++) {
+	for (int x = 0; x < size.x; x++) {
+		int lods[8];
+		const HermiteRLEField *fields[8];
+		const Vec3i pos(x, y, z);
+		for (int i = 0; i < 8; i++) {
+			const Vec3i lpos = pos + rel22(i);
+			const int octant = ((lpos.z > 0)<<2) | ((lpos.y > 0)<<1) | (lpos.x > 0);
+			lods[i] = octant_lods[octant];
+			fields[i] = &g.fields[offset_3d(lpos, GRID)][lods[i]];
+		}
+		const Vec3 base = ToVec3(CHUNK_SIZE * pos) * CUBE_SIZE;
+		if (reference) {
+			hermite_rle_fields_to_mesh_reference(vertices, indices, fields,
+				lods, LARGEST_LOD, base);
+		} else {
+			hermite_rle_fields_to_mesh(vertices, indices, fields, lods,
+				LARGEST_LOD, base);
+		}
+	}}}
+}
+
+// The fast paths skip voxel lines and cubes without a surface, they give the
+// same mesh as the reference which visits all of them.
+STF_FUNC(check_reference, const Grid &g, const int (&octant_lods)[8])
+{
+	Vector<V3N3M1_terrain> vertices[2];
+	Vector<uint32_t> indices[2];
+	for (int i = 0; i < 2; i++)
+		mesh_grid(vertices[i], indices[i], g, octant_lods, i == 1);
+	STF_ASSERT(indices[0].length() > 0);
+	STF_ASSERT(slice_cast<const uint8_t>(vertices[0].sub()) ==
+		slice_cast<const uint8_t>(vertices[1].sub()));
+	STF_ASSERT(slice_cast<const uint8_t>(indices[0].sub()) ==
+		slice_cast<const uint8_t>(indices[1].sub()));
+}
+
+STF_TEST("hermite_rle_fields_to_mesh same lod reference") {
+	Grid *g = new (OrDie) Grid;
+	for (bool caves : {false, true}) {
+		make_grid(g, caves);
+		for (int lod = 0; lod <= LARGEST_LOD; lod++) {
+			int octant_lods[8];
+			for (int &l : octant_lods)
+				l = lod;
+			STF_CALL(check_reference, *g, octant_lods);
+		}
+	}
+	delete g;
+}
+
+STF_TEST("hermite_rle_fields_to_mesh mixed lod reference") {
+	Grid *g = new (OrDie) Grid;
+	const int octant_lods[][8] = {
+		{0, 0, 0, 0, 1, 1, 1, 1},
+		{1, 1, 1, 1, 0, 0, 0, 0},
+		{0, 1, 1, 1, 1, 1, 1, 1},
+		{0, 1, 0, 1, 0, 1, 0, 1},
+		{1, 0, 1, 0, 1, 0, 1, 0},
+		{1, 2, 1, 2, 1, 2, 1, 2},
+		{2, 1, 2, 1, 2, 1, 2, 1},
+	};
+	for (bool caves : {false, true}) {
+		make_grid(g, caves);
+		for (const auto &lods : octant_lods)
+			STF_CALL(check_reference, *g, lods);
+	}
+	delete g;
+}
+
+STF_TEST("hermite_rle_fields_to_mesh mixed lods") {
+	Grid *g = new (OrDie) Grid;
+	make_grid(g);
+	const int octant_lods[][8] = {
+		{0, 0, 0, 0, 0, 0, 0, 0},
+		{0, 0, 0, 0, 1, 1, 1, 1},
+		{1, 2, 1, 2, 1, 2, 1, 2},
+	};
+
+	for (const auto &lods : octant_lods) {
+		// the temporary buffers are reused between calls, a second pass
+		// gives the same mesh
+		Vector<V3N3M1_terrain> vertices[2];
+		Vector<uint32_t> indices[2];
+		for (int i = 0; i < 2; i++)
+			mesh_grid(vertices[i], indices[i], *g, lods);
+		STF_ASSERT(indices[0].length() > 0);
+		STF_ASSERT(slice_cast<const uint8_t>(vertices[0].sub()) ==
+			slice_cast<const uint8_t>(vertices[1].sub()));
+		STF_ASSERT(slice_cast<const uint8_t>(indices[0].sub()) ==
+			slice_cast<const uint8_t>(indices[1].sub()));
+	}
+	delete g;
+}
@@ -0,0 +1,146 @@
+#include "stf.h"
+#include "Map/MeshCache.h"
+#include "OS/IO.h"
+#include <cstdio>
+
+using namespace Map;
+
+STF_SUITE_NAME("Map.MeshCache")
+
+static MeshKey make_key(const Vec3i &location, int lod)
+{
+	MeshKey key;
+	key.location = location;
+	for (int &l : key.lods)
+		l = lod;
+	return key;
+}
+
+// 'groups' groups of a quad each
+static MeshData make_mesh(int groups, float z)
+{
+	MeshData m;
+	for (int i = 0; i < groups; i++) {
+		const int basev = m.vertices.length();
+		const int basei = m.indices.length();
+		for (int j = 0; j < 4; j++)
+			m.vertices.append({Vec3(i + j % 2, j / 2, z), 0, 1});
+		for (int j : {0, 1, 2, 2, 1, 3})
+			m.indices.append(j);
+		m.base_vertex.append(basev);
+		m.base_index.append(basei);
+		m.count.append(6);
+	}
+	return m;
+}
+
+static int64_t write_mesh(const MeshCache &mc, const MeshKey &key, uint64_t version)
+{
+	MeshData m = make_mesh(1, key.location.x);
+	ByteWriter w;
+	serialize_mesh(&w, key, version, Slice<const MeshData>(&m, 1));
+	IO::write_file(mc.filename(key).c_str(), w.sub());
+	return w.data.length();
+}
+
+STF_TEST("MeshCache serialization") {
+	MeshData parts[2] = {make_mesh(2, 0.0f), make_mesh(3, 1.0f)};
+	const MeshKey key = make_key(Vec3i(4, -2, 8), 1);
+	ByteWriter w;
+	serialize_mesh(&w, key, 42, parts);
+
+	// parts come back as a single mesh, bases are relative to it
+	Error err(EV_QUIET);
+	const MeshData m = deserialize_mesh(w.sub(), key, 42, &err);
+	STF_ASSERT(!err);
+	STF_ASSERT(m.vertices.length() == 20 && m.indices.length() == 30);
+	STF_ASSERT(m.count.length() == 5);
+	STF_ASSERT(m.base_vertex[2] == 8 && m.base_index[2] == 12);
+	STF_ASSERT(m.vertices[8].position.z == 1.0f);
+
+	// another version of the chunks, another key, damaged contents
+	Error verr(EV_QUIET);
+	deserialize_mesh(w.sub(), key, 43, &verr);
+	STF_ASSERT(verr);
+	Error kerr(EV_QUIET);
+	deserialize_mesh(w.sub(), make_key(Vec3i(4, -2, 8), 2), 42, &kerr);
+	STF_ASSERT(kerr);
+	w.data[w.data.length() - 1] ^= 1;
+	Error cerr(EV_QUIET);
+	deserialize_mesh(w.sub(), key, 42, &cerr);
+	STF_ASSERT(cerr);
+}
+
+STF_TEST("MeshCache eviction and invalidation") {
+	Config config;
+	config.mesh_cache_directory = "mesh_cache_test";
+	const MeshKey a = make_key(Vec3i(0, 0, 0), 0);
+	const MeshKey b = make_key(Vec3i(8, 0, 0), 0);
+	const MeshKey c = make_key(Vec3i(16, 0, 0), 0);
+	{
+		MeshCache mc(&config);
+		STF_ASSERT(mc.enabled());
+		const int64_t length = write_mesh(mc, a, 1);
+		mc.budget = length * 2;
+		mc.insert(a, 1, length);
+		mc.insert(b, 1, write_mesh(mc, b, 1));
+		STF_ASSERT(mc.lookup(a, 1) && !mc.lookup(a, 2));
+
+		// 'b' is the least recently used one
+		mc.insert(c, 1, write_mesh(mc, c, 1));
+		STF_ASSERT(mc.evicted == 1 && !mc.lookup(b, 1));
+		STF_ASSERT(!IO::file_exists(mc.filename(b).c_str()));
+
+		// 'c' is made of chunks 15..16 along x
+		mc.invalidate(Vec3i(15, 0, 0), Vec3i(15, 0, 0));
+		STF_ASSERT(!mc.lookup(c, 1) && mc.entries.length() == 1);
+		STF_ASSERT(!IO::file_exists(mc.filename(c).c_str()));
+
+		// a file the index doesn't know about
+		write_mesh(mc, b, 1);
+	}
+
+	// the index is saved on exit, unknown files are removed on start
+	MeshCache mc(&config);
+	STF_ASSERT(mc.entries.length() == 1 && mc.lookup(a, 1));
+	STF_ASSERT(!IO::file_exists(mc.filename(b).c_str()));
+	Error err(EV_QUIET);
+	const MeshData m = load_mesh_file(mc.filename(a).c_str(), a, 1, &err);
+	STF_ASSERT(!err && m.indices.length() == 6);
+
+	mc.remove(a);
+	mc.directory = "";
+	IO::remove_file("mesh_cache_test/index");
+	remove("mesh_cache_test");
+}
+
+STF_TEST("MeshCache index after a crash") {
+	Config config;
+	config.mesh_cache_directory = "mesh_cache_test";
+	const MeshKey a = make_key(Vec3i(0, 0, 0), 0);
+	const MeshKey b = make_key(Vec3i(8, 0, 0), 0);
+	const MeshKey c = make_key(Vec3i(16, 0, 0), 0);
+	{
+		MeshCache mc(&config);
+		mc.insert(a, 1, write_mesh(mc, a, 1));
+		mc.insert(b, 1, write_mesh(mc, b, 1));
+		STF_ASSERT(mc.filename(a) != mc.filename(b));
+		write_mesh_index(mc.directory, mc.serialize_index());
+
+		// stored and removed after the index was written, then no clean exit
+		mc.insert(c, 1, write_mesh(mc, c, 1));
+		mc.remove(b);
+		mc.directory = "";
+	}
+
+	// the index is trusted as far as the files are there
+	MeshCache mc(&config);
+	STF_ASSERT(mc.entries.length() == 1 && mc.lookup(a, 1));
+	STF_ASSERT(!mc.lookup(b, 1) && !mc.lookup(c, 1));
+	STF_ASSERT(!IO::file_exists(mc.filename(c).c_str()));
+
+	mc.remove(a);
+	mc.directory = "";
+	IO::remove_file("mesh_cache_test/index");
+	remove("mesh_cache_test");
+}
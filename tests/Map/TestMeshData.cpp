@@ -0,0 +1,92 @@
+#include "stf.h"
+#include "Map/MeshData.h"
+#include "Math/Noise.h"
+
+using namespace Map;
+
+STF_SUITE_NAME("Map.MeshData")
+
+// The chunks of a largest lod mesh, 4x4x4 groups.
+static const Vec3i BOX(5);
+
+// Rolling hills crossing the middle layer of chunks.
+static void make_chunks(Vector<Chunk> *chunks)
+{
+	const Noise2D n2d(0);
+	const Vec3i fsize = CHUNK_SIZE + Vec3i(1);
+	chunks->resize(volume(BOX));
+	for (int i = 0; i < volume(BOX); i++) {
+		const Vec3i cp = offset_to_3d(i, BOX);
+		HermiteField f(fsize);
+		for (int z = 0; z < fsize.z; z++) {
+		for (int x = 0; x < fsize.x; x++) {
+			const float wx = (cp.x * CHUNK_SIZE.x + x) / 64.0f;
+			const float wz = (cp.z * CHUNK_SIZE.z + z) / 64.0f;
+			const float h = CHUNK_SIZE.y * 2.5f + 12.0f * n2d.get(wx, wz);
+			for (int y = 0; y < fsize.y; y++) {
+				const float wy = cp.y * CHUNK_SIZE.y + y;
+				HermiteData &hd = f.get(Vec3i(x, y, z));
+				hd = HermiteData_Air();
+				if (wy < h)
+					hd.material = 1;
+				if (wy < h && wy + 1 >= h)
+					hd.y_edge = (h - wy) * 255.0f;
+			}
+		}}
+		Chunk &c = (*chunks)[i];
+		c.lods[0] = intern_field(HermiteRLEField(f));
+		c.generate_lod_fields();
+	}
+}
+
+static bool same_bytes(const MeshData &a, const MeshData &b)
+{
+	return
+		slice_cast<const uint8_t>(a.vertices.sub()) ==
+			slice_cast<const uint8_t>(b.vertices.sub()) &&
+		slice_cast<const uint8_t>(a.indices.sub()) ==
+			slice_cast<const uint8_t>(b.indices.sub()) &&
+		slice_cast<const uint8_t>(a.count.sub()) ==
+			slice_cast<const uint8_t>(b.count.sub()) &&
+		slice_cast<const uint8_t>(a.base_vertex.sub()) ==
+			slice_cast<const uint8_t>(b.base_vertex.sub()) &&
+		slice_cast<const uint8_t>(a.base_index.sub()) ==
+			slice_cast<const uint8_t>(b.base_index.sub());
+}
+
+STF_TEST("merge_mesh_parts") {
+	Vector<Chunk> chunks;
+	make_chunks(&chunks);
+	Vector<Chunk*> box;
+	for (Chunk &c : chunks)
+		box.append(&c);
+
+	const Vec3i groups = BOX - Vec3i(1);
+	const int octant_lods[][8] = {
+		{2, 2, 2, 2, 2, 2, 2, 2},
+		{1, 2, 1, 2, 1, 2, 1, 2},
+		{0, 1, 0, 1, 1, 1, 1, 1},
+	};
+	for (const auto &lods : octant_lods) {
+		// a part per row of groups, as a largest lod mesh is split, and
+		// parts of different sizes
+		const int splits[][5] = {
+			{0, 1, 2, 3, 4},
+			{0, 1, 3, 4, 4},
+			{0, 4, 4, 4, 4},
+		};
+
+		MeshData whole;
+		mesh_chunk_groups(&whole, box, BOX, lods, 0, groups.z);
+		STF_ASSERT(whole.count.length() > 0);
+
+		for (const auto &split : splits) {
+			MeshData parts[4];
+			for (int i = 0; i < 4; i++)
+				mesh_chunk_groups(&parts[i], box, BOX, lods, split[i], split[i+1]);
+			MeshData merged;
+			merge_mesh_parts(&merged, parts);
+			STF_ASSERT(same_bytes(merged, whole));
+		}
+	}
+}
@@ -0,0 +1,210 @@
+#include "stf.h"
+#include "Map/StorageChunk.h"
+#include "Math/Noise.h"
+#include <cmath>
+
+using namespace Map;
+
+STF_SUITE_NAME("Map.StorageChunk")
+
+static void make_uniform(Chunk *c, uint8_t material)
+{
+	HermiteData hd = HermiteData_Air();
+	hd.material = material;
+	HermiteRLEField f;
+	f.data.append(hd);
+	f.seqs.pappend(0, 0, true);
+	f.finalize(CHUNK_SIZE + Vec3i(1));
+	c->lods[0] = intern_field(std::move(f));
+	c->generate_lod_fields();
+}
+
+// Rolling hills through the middle layer of chunks, solid below, air above.
+// All chunks are pristine, 'edited' of them are not. With 'amplitude' 0 the
+// hills are a plane, the same surface field in every chunk.
+static StorageChunk make_storage_chunk(int edited, float amplitude = 12.0f)
+{
+	const Noise2D n2d(0);
+	const Vec3i fsize = CHUNK_SIZE + Vec3i(1);
+	const int surface = STORAGE_CHUNK_SIZE.y / 2;
+	StorageChunk msc(Vec3i(0));
+	for (int i = 0; i < msc.chunks.length(); i++) {
+		Chunk &c = msc.chunks[i];
+		c.flags = MCF_PRISTINE;
+		const Vec3i cp = offset_to_3d(i, STORAGE_CHUNK_SIZE);
+		if (cp.y != surface) {
+			make_uniform(&c, cp.y < surface ? 1 : 0);
+			continue;
+		}
+
+		HermiteField f(fsize);
+		for (int z = 0; z < fsize.z; z++) {
+		for (int x = 0; x < fsize.x; x++) {
+			const float wx = (cp.x * CHUNK_SIZE.x + x) / 64.0f;
+			const float wz = (cp.z * CHUNK_SIZE.z + z) / 64.0f;
+			const float h = 16.5f + amplitude * n2d.get(wx, wz);
+			for (int y = 0; y < fsize.y; y++) {
+				HermiteData &hd = f.get(Vec3i(x, y, z));
+				hd = HermiteData_Air();
+				if (y < h)
+					hd.material = 1;
+				if (y < h && y + 1 >= h)
+					hd.y_edge = (h - y) * 255.0f;
+			}
+		}}
+		c.lods[0] = intern_field(HermiteRLEField(f));
+		c.generate_lod_fields();
+	}
+	for (int i = 0; i < edited; i++) {
+		const Vec3i cp(i * 3 % 16, surface, i * 7 % 16);
+		msc.chunks[offset_3d(cp, STORAGE_CHUNK_SIZE)].flags = 0;
+	}
+	return msc;
+}
+
+STF_TEST("StorageChunk pristine chunks") {
+	const StorageChunk msc = make_storage_chunk(4);
+	StorageChunkSnapshot s = msc.snapshot();
+	s.store_pristine = false;
+	s.generator = 0x1234567890ABCDEFULL;
+	ByteWriter w;
+	s.serialize(&w);
+
+	Error err(EV_QUIET);
+	StorageChunk loaded = StorageChunk::new_from_buffer(Vec3i(0), w.sub(), &err);
+	STF_ASSERT(!err);
+	// only the generator which made the pristine chunks can make them again
+	uint64_t generator;
+	STF_ASSERT(read_pristine_generator(w.sub(), &generator));
+	STF_ASSERT(generator == s.generator);
+	for (int i = 0; i < msc.chunks.length(); i++) {
+		const bool pristine = msc.chunks[i].flags & MCF_PRISTINE;
+		STF_ASSERT(is_pristine_payload(loaded.packed_payload(i)) == pristine);
+		if (pristine)
+			continue;
+		Chunk c;
+		unpack_chunk(&c, loaded.packed_payload(i), &err);
+		STF_ASSERT(!err);
+		STF_ASSERT(slice_cast<const uint8_t>(c.lods[0]->data.sub()) ==
+			slice_cast<const uint8_t>(msc.chunks[i].lods[0]->data.sub()));
+		STF_ASSERT(slice_cast<const uint8_t>(c.lods[0]->seqs.sub()) ==
+			slice_cast<const uint8_t>(msc.chunks[i].lods[0]->seqs.sub()));
+	}
+}
+
+STF_TEST("StorageChunk without pristine chunks") {
+	// a storage chunk which writes out all of its chunks doesn't depend on
+	// the generator, with or without store_pristine
+	StorageChunk msc = make_storage_chunk(0);
+	for (Chunk &c : msc.chunks)
+		c.flags = 0;
+	for (bool store_pristine : {false, true}) {
+		StorageChunkSnapshot s = msc.snapshot();
+		s.store_pristine = store_pristine;
+		s.generator = 0x1234567890ABCDEFULL;
+		ByteWriter w;
+		s.serialize(&w);
+		uint64_t generator;
+		STF_ASSERT(!read_pristine_generator(w.sub(), &generator));
+	}
+}
+
+STF_TEST("StorageChunk shared fields") {
+	const StorageChunk msc = make_storage_chunk(0);
+	const FieldPoolStats before = field_pool_stats();
+	STF_ASSERT(before.fields < msc.chunks.length());
+
+	// loading a storage chunk which is in memory already adds no fields,
+	// unpacked chunks share the buffers of the resident ones
+	ByteWriter w;
+	msc.serialize(&w);
+	Error err(EV_QUIET);
+	StorageChunk loaded = StorageChunk::new_from_buffer(Vec3i(0), w.sub(), &err);
+	STF_ASSERT(!err);
+	for (int i = 0; i < msc.chunks.length(); i++) {
+		Chunk &c = loaded.chunks[i];
+		unpack_chunk(&c, loaded.packed_payload(i), &err);
+		STF_ASSERT(!err);
+		for (int j = 0; j < LODS_N; j++)
+			STF_ASSERT(c.lods[j] == msc.chunks[i].lods[j]);
+	}
+	STF_ASSERT(field_pool_stats().fields == before.fields);
+
+	// an edit replaces the handle, the snapshot keeps the old field
+	StorageChunkSnapshot s = msc.snapshot();
+	const FieldRef old = loaded.chunks[0].lods[0];
+	HermiteRLEField edited;
+	edited.data = old->data.sub();
+	edited.seqs = old->seqs.sub();
+	edited.size = old->size;
+	edited.data[0].material = 7;
+	loaded.chunks[0].lods[0] = intern_field(std::move(edited));
+	STF_ASSERT(loaded.chunks[0].lods[0] != old);
+	STF_ASSERT(s.fields[0] == old);
+	STF_ASSERT(msc.chunks[0].lods[0]->data[0].material != 7);
+}
+
+STF_TEST("StorageChunk lods on demand") {
+	StorageChunk msc = make_storage_chunk(0);
+	const int surface = offset_3d(Vec3i(0, STORAGE_CHUNK_SIZE.y / 2, 0),
+		STORAGE_CHUNK_SIZE);
+	const int air = offset_3d(Vec3i(0, STORAGE_CHUNK_SIZE.y - 1, 0),
+		STORAGE_CHUNK_SIZE);
+	Chunk &c = msc.chunks[surface];
+	FieldRef all[LODS_N];
+	for (int i = 0; i < LODS_N; i++)
+		all[i] = c.lods[i];
+
+	c.reset_lods();
+	for (int i = 1; i < LODS_N; i++)
+		STF_ASSERT(!c.has_lod(i) && c.lod_source(i) == 0);
+	// reducing several steps at once gives what a step at a time does
+	c.lods[LAST_LOD] = reduce_lod_field(*c.lods[0], 0, LAST_LOD);
+	STF_ASSERT(c.lods[LAST_LOD] == all[LAST_LOD]);
+	c.lods[1] = reduce_lod_field(*c.lods[0], 0, 1);
+	STF_ASSERT(c.lod_source(2) == 1);
+	STF_ASSERT(reduce_lod_field(*c.lods[1], 1, 2) == all[2]);
+
+	// uniform chunks keep all the lods, the rest keeps lod 0 only
+	int non_uniform = 0;
+	for (const Chunk &mc : msc.chunks)
+		non_uniform += !mc.is_uniform();
+	STF_ASSERT(msc.drop_lods() == non_uniform * (LODS_N - 1));
+	STF_ASSERT(!c.has_lod(1) && c.has_lod(0));
+	STF_ASSERT(msc.chunks[air].has_lod(LAST_LOD));
+	msc.update_memory_usage();
+	STF_ASSERT(msc.lod_chunks[0] == non_uniform);
+	STF_ASSERT(msc.lod_chunks[LAST_LOD] == 0);
+	STF_ASSERT(msc.lod_bytes[LAST_LOD] < msc.lod_bytes[0]);
+
+	// saved without lods, those come back on demand after loading
+	ByteWriter w;
+	msc.serialize(&w);
+	Error err(EV_QUIET);
+	StorageChunk loaded = StorageChunk::new_from_buffer(Vec3i(0), w.sub(), &err);
+	STF_ASSERT(!err);
+	Chunk lc;
+	unpack_chunk(&lc, loaded.packed_payload(surface), &err);
+	STF_ASSERT(!err);
+	STF_ASSERT(lc.lods[0] == c.lods[0] && !lc.has_lod(1));
+}
+
+STF_TEST("StorageChunk identical payloads") {
+	// a plane cuts all the surface chunks the same way, each distinct payload
+	// is written once however large it is: air, ground and the surface
+	const StorageChunk plane = make_storage_chunk(0, 0.0f);
+	ByteWriter w;
+	plane.serialize(&w);
+	Error err(EV_QUIET);
+	const StorageChunk loaded = StorageChunk::new_from_buffer(Vec3i(0), w.sub(), &err);
+	STF_ASSERT(!err);
+	Vector<uint32_t> offsets;
+	for (const PackedField &pf : loaded.packed_fields) {
+		bool seen = false;
+		for (uint32_t offset : offsets)
+			seen = seen || offset == pf.offset;
+		if (!seen)
+			offsets.append(pf.offset);
+	}
+	STF_ASSERT(offsets.length() == 3);
+}
@@ -0,0 +1,260 @@
+#include "stf.h"
+#include "Core/Vector.h"
+#include "Map/TerrainGraph.h"
+#include <cmath>
+
+using namespace Map;
+
+STF_SUITE_NAME("Map.TerrainGraph")
+
+static TerrainOp make_op(TerrainOpCode code, int a = -1, int b = -1, int c = -1)
+{
+	TerrainOp op;
+	op.code = code;
+	op.a = a;
+	op.b = b;
+	op.c = c;
+	return op;
+}
+
+static TerrainOp make_mad(int a, float k, float c)
+{
+	TerrainOp op = make_op(TOP_MAD, a);
+	op.k[0] = k;
+	op.k[1] = c;
+	return op;
+}
+
+static TerrainOp make_fbm2(int x, int z, int octaves, float freq, float amp)
+{
+	TerrainOp op = make_op(TOP_FBM2, x, z);
+	op.n = octaves;
+	op.k[0] = freq;
+	op.k[1] = amp;
+	op.k[2] = 2.0f;
+	op.k[3] = 0.5f;
+	return op;
+}
+
+// density = y - 2.5 - fbm2(x, z), the hand-written noise terrain without
+// the 3D detail
+static void make_hills(TerrainGraph *g, const Noise2D *n2d, const Noise3D *n3d)
+{
+	g->n2d = n2d;
+	g->n3d = n3d;
+	const int x = g->add(make_op(TOP_X));
+	const int y = g->add(make_op(TOP_Y));
+	const int z = g->add(make_op(TOP_Z));
+	const int h = g->add(make_fbm2(x, z, 5, 1.0f / 6.0f, 1.0f));
+	const int base = g->add(make_mad(y, 1.0f, -2.5f));
+	g->density = g->add(make_op(TOP_SUB, base, h));
+}
+
+STF_TEST("TerrainGraph::compile(...)") {
+	Noise2D n2d(0);
+	Noise3D n3d(0);
+	Error err(EV_QUIET);
+
+	TerrainGraph forward;
+	forward.n2d = &n2d;
+	forward.n3d = &n3d;
+	forward.add(make_op(TOP_ADD, 0, 1));
+	forward.add(make_op(TOP_X));
+	forward.density = 0;
+	STF_ASSERT(!forward.compile(&err));
+
+	TerrainGraph nested;
+	nested.n2d = &n2d;
+	nested.n3d = &n3d;
+	const int x = nested.add(make_op(TOP_X));
+	const int s = nested.add(make_op(TOP_SLOPE, x));
+	nested.density = nested.add(make_op(TOP_SLOPE, s));
+	STF_ASSERT(!nested.compile(&err));
+
+	TerrainGraph hills;
+	make_hills(&hills, &n2d, &n3d);
+	STF_ASSERT(hills.compile(&err));
+}
+
+STF_TEST("TerrainGraph::eval_row(...)") {
+	Noise2D n2d(0);
+	Noise3D n3d(0);
+	TerrainRows rows;
+	float v[34];
+	int m[34];
+
+	// affine coordinates go through get_row, warped ones through get
+	TerrainGraph g;
+	g.n2d = &n2d;
+	g.n3d = &n3d;
+	const int x = g.add(make_op(TOP_X));
+	const int z = g.add(make_op(TOP_Z));
+	const int zero = g.add(make_op(TOP_CONST));
+	const int fast = g.add(make_fbm2(x, z, 3, 0.5f, 1.0f));
+	const int wx = g.add(make_op(TOP_ADD, x, g.add(make_op(TOP_MUL, x, zero))));
+	const int slow = g.add(make_fbm2(wx, z, 3, 0.5f, 1.0f));
+	g.density = g.add(make_op(TOP_SUB, fast, slow));
+	STF_ASSERT(g.compile());
+	g.eval_row(v, m, 34, Vec3(-3.3f, 1.0f, 7.1f), 1.0f / 32.0f, &rows);
+	for (int i = 0; i < 34; i++) {
+		STF_ASSERT(std::fabs(v[i]) < 1e-5f);
+		STF_ASSERT(m[i] == 1);
+	}
+
+	// slope of a plane and materials picked by it
+	TerrainGraph p;
+	p.n2d = &n2d;
+	p.n3d = &n3d;
+	const int px = p.add(make_op(TOP_X));
+	const int pz = p.add(make_op(TOP_Z));
+	const int h = p.add(make_op(TOP_ADD, p.add(make_mad(px, 0.5f, 0)),
+		p.add(make_mad(pz, 0.25f, 0))));
+	const int s = p.add(make_op(TOP_SLOPE, h));
+	TerrainOp mat = make_op(TOP_MATERIAL, h, s);
+	mat.k[0] = 1;
+	mat.n = 0;
+	mat.m = 1;
+	p.rules.append({-INFINITY, INFINITY, 0.5f, INFINITY, 3});
+	p.material = p.add(mat);
+	p.density = s;
+	STF_ASSERT(p.compile());
+	p.eval_row(v, m, 34, Vec3(1.0f, 0.0f, 2.0f), 1.0f / 32.0f, &rows);
+	for (int i = 0; i < 34; i++) {
+		STF_ASSERT(std::fabs(v[i] - std::sqrt(0.25f + 0.0625f)) < 1e-3f);
+		STF_ASSERT(m[i] == 3);
+	}
+}
+
+STF_TEST("TerrainGraph::bounds(...)") {
+	Noise2D n2d(0);
+	Noise3D n3d(0);
+	TerrainGraph g;
+	make_hills(&g, &n2d, &n3d);
+	STF_ASSERT(g.compile());
+
+	TerrainRows rows;
+	float v[34];
+	int m[34];
+	for (int cy = -3; cy < 6; cy++) {
+		const Vec3 min(4.0f, cy, -2.0f);
+		const DensityBounds b = g.bounds(min, min + Vec3(1));
+		STF_ASSERT(b.m == 1);
+		for (int i = 0; i < 33; i++) {
+			const Vec3 p = min + Vec3(0, i, i) / Vec3(32.0f);
+			g.eval_row(v, m, 33, p, 1.0f / 32.0f, &rows);
+			for (int j = 0; j < 33; j++)
+				STF_ASSERT(b.min <= v[j] && v[j] <= b.max);
+		}
+	}
+}
+
+STF_TEST("TerrainGraph::load_column_row(...)") {
+	Noise2D n2d(0);
+	Noise3D n3d(0);
+	TerrainGraph g;
+	make_hills(&g, &n2d, &n3d);
+	STF_ASSERT(g.compile());
+
+	const float step = 1.0f / 32.0f;
+	TerrainRows rows;
+	TerrainColumn column;
+	float v[34], cv[34];
+	int m[34];
+	for (int z = 0; z < 4; z++) {
+		const Vec3 p(-1.0f, 0.5f, 3.0f + z * step);
+		g.eval_row(v, m, 34, p, step, &rows);
+		g.store_column_row(&column, z, 4, rows);
+	}
+
+	// another chunk of the same column
+	TerrainRows other;
+	for (int z = 0; z < 4; z++) {
+		const Vec3 p(-1.0f, 1.5f, 3.0f + z * step);
+		g.eval_row(v, m, 34, p, step, &rows);
+		g.load_column_row(&other, column, z, p, step);
+		g.eval_row(cv, m, 34, p, step, &other);
+		for (int i = 0; i < 34; i++)
+			STF_ASSERT(v[i] == cv[i]);
+	}
+}
+
+STF_TEST("TerrainGraph random") {
+	Noise2D n2d(0);
+	Noise3D n3d(0);
+	TerrainGraph g;
+	g.n2d = &n2d;
+	g.n3d = &n3d;
+	g.seed = 5;
+	const int x = g.add(make_op(TOP_X));
+	const int z = g.add(make_op(TOP_Z));
+	TerrainOp r = make_op(TOP_RANDOM, x, z);
+	r.k[0] = 4.0f;
+	g.density = g.add(r);
+	STF_ASSERT(g.compile());
+
+	// a value per cell, the same whichever row or chunk asks for it
+	TerrainRows rows;
+	float v[34], cv[34];
+	int m[34];
+	const float step = 1.0f / 32.0f;
+	g.eval_row(v, m, 34, Vec3(-1.0f, 0.0f, 0.3f), step, &rows);
+	g.eval_row(cv, m, 17, Vec3(-1.0f + 17 * step, 2.0f, 0.3f), step, &rows);
+	for (int i = 0; i < 34; i++) {
+		STF_ASSERT(v[i] >= 0.0f && v[i] < 1.0f);
+		if (i % 8 != 0)
+			STF_ASSERT(v[i] == v[i - i % 8]);
+		if (i >= 17)
+			STF_ASSERT(v[i] == cv[i-17]);
+	}
+	STF_ASSERT(v[0] != v[8]);
+
+	// another seed is another world
+	g.seed = 6;
+	g.eval_row(cv, m, 34, Vec3(-1.0f, 0.0f, 0.3f), step, &rows);
+	int same = 0;
+	for (int i = 0; i < 34; i += 8)
+		same += v[i] == cv[i];
+	STF_ASSERT(same < 5);
+
+	const DensityBounds b = g.bounds(Vec3(0), Vec3(1));
+	STF_ASSERT(b.min == 0.0f && b.max == 1.0f);
+}
+
+STF_TEST("TerrainGraph matches the hand-written terrain") {
+	const int ROW = 34, ROWS = 34*34*8;
+	Noise2D n2d(0);
+	Noise3D n3d(0);
+	TerrainGraph g;
+	make_hills(&g, &n2d, &n3d);
+	STF_ASSERT(g.compile());
+
+	TerrainRows rows;
+	Vector<float> hand(ROW, 0.0f), graph(ROW, 0.0f), tmp(ROW, 0.0f);
+	Vector<int> m(ROW, 0);
+	const float step = 1.0f / 32.0f;
+
+	// the lambda Generator uses for NEXTGAME_TERRAIN=noise, minus the 3D detail
+	auto hand_written = [&](float *out, const Vec3 &pp) {
+		const Vec3 ff = pp / Vec3(6);
+		const float fstep = step / 6;
+		n2d.get_row(out, ROW, ff.x, fstep, ff.z);
+		float scale = 2.0f, amp = 0.5f;
+		for (int o = 0; o < 4; o++, scale *= 2.0f, amp *= 0.5f) {
+			n2d.get_row(tmp.data(), ROW, ff.x*scale, fstep*scale, ff.z*scale);
+			for (int i = 0; i < ROW; i++)
+				out[i] += tmp[i] * amp;
+		}
+		for (int i = 0; i < ROW; i++)
+			out[i] = pp.y - 2.5f - out[i];
+	};
+
+	float max_diff = 0.0f;
+	for (int r = 0; r < ROWS; r += 97) {
+		const Vec3 p(-1.0f / 32.0f, (r % 34) / 32.0f, r / 34 / 32.0f);
+		hand_written(hand.data(), p);
+		g.eval_row(graph.data(), m.data(), ROW, p, step, &rows);
+		for (int i = 0; i < ROW; i++)
+			max_diff = max(max_diff, std::fabs(hand[i] - graph[i]));
+	}
+	STF_ASSERT(max_diff < 1e-4f);
+}
@@ -0,0 +1,58 @@
+#include "stf.h"
+#include "Core/Vector.h"
+#include "Math/Noise.h"
+
+STF_SUITE_NAME("Math.Noise")
+
+// Rows of odd lengths crossing zero, so that both the SIMD part, the scalar
+// tail and the floor of negative coordinates are covered.
+static const float ROW_STARTS[] = {-7.3f, -1.0f, -0.01f, 0.0f, 3.75f, 255.5f};
+static const int ROW_LENGTHS[] = {1, 3, 4, 7, 33, 66};
+
+STF_TEST("Noise2D::get_row(...)") {
+	Noise2D n(0);
+	float out[66];
+	for (float x : ROW_STARTS) {
+	for (int len : ROW_LENGTHS) {
+		const float step = 1.0f / 32.0f * 5.0f;
+		const float y = x * -0.37f;
+		n.get_row(out, len, x, step, y);
+		for (int i = 0; i < len; i++) {
+			const float v = n.get(x + step * (float)i, y);
+			if (out[i] != v)
+				STF_ERRORF("%d: %f != %f (x: %f, len: %d)", i, out[i], v, x, len);
+		}
+	}}
+}
+
+STF_TEST("Noise3D::get_row(...)") {
+	Noise3D n(0);
+	float out[66];
+	for (float x : ROW_STARTS) {
+	for (int len : ROW_LENGTHS) {
+		const float step = 1.0f / 32.0f * 32.0f / 6.0f;
+		const float y = x * 1.5f, z = -x - 0.5f;
+		n.get_row(out, len, x, step, y, z);
+		for (int i = 0; i < len; i++) {
+			const float v = n.get(x + step * (float)i, y, z);
+			if (out[i] != v)
+				STF_ERRORF("%d: %f != %f (x: %f, len: %d)", i, out[i], v, x, len);
+		}
+	}}
+}
+
+STF_TEST("Noise3D::get_block(...)") {
+	Noise3D n(0);
+	const Vec3i size(5, 3, 2);
+	const Vec3 p(-1.5f, 0.25f, 7.0f), step(0.5f, 0.75f, -1.25f);
+	float out[5*3*2];
+	n.get_block(out, size, p, step);
+	int i = 0;
+	for (int z = 0; z < size.z; z++) {
+	for (int y = 0; y < size.y; y++) {
+	for (int x = 0; x < size.x; x++, i++) {
+		const float v = n.get(p.x + step.x * (float)x,
+			p.y + step.y * (float)y, p.z + step.z * (float)z);
+		STF_ASSERT(out[i] == v);
+	}}}
+}
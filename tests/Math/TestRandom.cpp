@@ -0,0 +1,47 @@
+#include "stf.h"
+#include "Core/Vector.h"
+#include "Math/Random.h"
+
+STF_SUITE_NAME("Math.Random")
+
+STF_TEST("RandomStream order independence") {
+	// the n-th value doesn't depend on what was drawn before
+	RandomStream s(random_key(42, Vec3i(3, -1, 7)));
+	Vector<uint64_t> values;
+	for (int i = 0; i < 100; i++)
+		values.append(s.next_uint64());
+	const RandomStream t(random_key(42, Vec3i(3, -1, 7)));
+	for (int i = 99; i >= 0; i--)
+		STF_ASSERT(t.at(i) == values[i]);
+}
+
+STF_TEST("random_key(...)") {
+	const uint64_t k = random_key(1, Vec3i(0, 0, 0));
+	STF_ASSERT(k == random_key(1, Vec3i(0, 0, 0)));
+	STF_ASSERT(k != random_key(2, Vec3i(0, 0, 0)));
+	STF_ASSERT(k != random_key(1, Vec3i(0, 0, 0), 1));
+	// neighbours and swapped axes differ
+	STF_ASSERT(k != random_key(1, Vec3i(1, 0, 0)));
+	STF_ASSERT(k != random_key(1, Vec3i(0, 1, 0)));
+	STF_ASSERT(k != random_key(1, Vec3i(0, 0, 1)));
+	STF_ASSERT(random_key(1, Vec3i(1, 2, 3)) != random_key(1, Vec3i(3, 2, 1)));
+	STF_ASSERT(random_key(1, Vec3i(-1, 0, 0)) != random_key(1, Vec3i(0, -1, 0)));
+}
+
+STF_TEST("RandomStream ranges") {
+	RandomStream s(random_key(7, Vec3i(0)));
+	int hist[6] = {};
+	double sum = 0;
+	const int N = 60000;
+	for (int i = 0; i < N; i++) {
+		const float f = s.next_float();
+		STF_ASSERT(f >= 0.0f && f < 1.0f);
+		sum += f;
+		const int v = s.next_int(-2, 3);
+		STF_ASSERT(v >= -2 && v <= 3);
+		hist[v+2]++;
+	}
+	STF_ASSERT(sum / N > 0.49 && sum / N < 0.51);
+	for (int h : hist)
+		STF_ASSERT(h > N / 6 * 0.95 && h < N / 6 * 1.05);
+}